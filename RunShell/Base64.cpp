@@ -0,0 +1,99 @@
+/**	\file Base64.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	Base64.cpp																*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+#include "StdAfx.h"
+#include "Base64.h"
+
+static const char g_szAlphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void Base64Encode( const char * pBytes, size_t nBytes, TString & sText )
+{
+	const unsigned char * p = (const unsigned char *) pBytes;
+	size_t nStart = sText.size();
+	sText.resize(nStart + (nBytes + 2) / 3 * 4);
+	TCHAR * pOut = &sText[0] + nStart;
+
+	for(; nBytes >= 3; nBytes -= 3, p += 3) {
+		unsigned long nBits = (p[0] << 16) | (p[1] << 8) | p[2];
+		*pOut++ = g_szAlphabet[(nBits >> 18) & 0x3f];
+		*pOut++ = g_szAlphabet[(nBits >> 12) & 0x3f];
+		*pOut++ = g_szAlphabet[(nBits >> 6) & 0x3f];
+		*pOut++ = g_szAlphabet[nBits & 0x3f];
+	}
+	if(nBytes) {
+		unsigned long nBits = p[0] << 16;
+		if(nBytes == 2)
+			nBits |= p[1] << 8;
+		*pOut++ = g_szAlphabet[(nBits >> 18) & 0x3f];
+		*pOut++ = g_szAlphabet[(nBits >> 12) & 0x3f];
+		*pOut++ = nBytes == 2 ? g_szAlphabet[(nBits >> 6) & 0x3f] : _T('=');
+		*pOut++ = _T('=');
+	}
+}
+
+// Gets the 6 bits a base64 char stands for, -1 if it is not one
+static int Base64Value(TCHAR c)
+{
+	if(c >= _T('A') && c <= _T('Z'))
+		return c - _T('A');
+	if(c >= _T('a') && c <= _T('z'))
+		return c - _T('a') + 26;
+	if(c >= _T('0') && c <= _T('9'))
+		return c - _T('0') + 52;
+	if(c == _T('+'))
+		return 62;
+	if(c == _T('/'))
+		return 63;
+	return -1;
+}
+
+bool Base64Decode( const TCHAR * pcszText, size_t nLength, std::string & sBytes )
+{
+	sBytes.reserve(sBytes.size() + nLength / 4 * 3);
+
+	// collect 6 bits per char, a byte is complete every 8
+	unsigned long nBits = 0;
+	int nBitCount = 0;
+	size_t nPadding = 0;
+	for(size_t i = 0; i < nLength; ++i) {
+		TCHAR c = pcszText[i];
+		if(c == _T(' ') || c == _T('\t') || c == _T('\r') || c == _T('\n'))
+			continue;
+		if(c == _T('=')) {
+			++nPadding;
+			continue;
+		}
+		int nValue = Base64Value(c);
+		if(nValue < 0 || nPadding)
+			return false; // only padding may follow padding
+		nBits = (nBits << 6) | nValue;
+		nBitCount += 6;
+		if(nBitCount >= 8) {
+			nBitCount -= 8;
+			sBytes += (char) ((nBits >> nBitCount) & 0xff);
+		}
+	}
+	// what is left over must be the zero bits in front of the padding
+	return nPadding <= 2 && nBitCount < 6;
+}
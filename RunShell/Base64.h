@@ -0,0 +1,44 @@
+/**	\file Base64.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	Base64.h																*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+#include <string>
+
+/**	\brief Appends the base64 encoding of bytes to a string
+*	\param[in] pBytes the bytes
+*	\param[in] nBytes the number of bytes
+*	\param[in,out] sText the encoding is appended to it, 4 chars for every
+*	3 bytes, padded with '='.
+*
+*	Lets bytes that are not text, NULs included, pass through Autolisp strings.
+*/
+void Base64Encode(const char * pBytes, size_t nBytes, TString & sText);
+
+/**	\brief Appends the bytes a base64 string encodes
+*	\param[in] pcszText the base64 text, white space in it is skipped
+*	\param[in] nLength the number of TCHARs in pcszText
+*	\param[in,out] sBytes the bytes are appended to it
+*	\returns false if the text is not base64
+*/
+bool Base64Decode(const TCHAR * pcszText, size_t nLength, std::string & sBytes);
@@ -0,0 +1,95 @@
+/**	\file CommandLine.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	CommandLine.cpp															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+#include "StdAfx.h"
+#include "CommandLine.h"
+#include <tchar.h>
+
+void AppendArgument( const TCHAR * pcszArgument, TString & sCommandLine )
+{
+	if(!sCommandLine.empty())
+		sCommandLine += _T(' ');
+	if(*pcszArgument && !_tcspbrk(pcszArgument, _T(" \t\n\v\""))) {
+		sCommandLine += pcszArgument;
+		return;
+	}
+
+	sCommandLine += _T('"');
+	for(const TCHAR * p = pcszArgument; ; ++p) {
+		size_t nBackslashes = 0;
+		while(*p == _T('\\')) {
+			++p;
+			++nBackslashes;
+		}
+		if(!*p) {
+			// the closing quote must not be escaped
+			sCommandLine.append(nBackslashes * 2, _T('\\'));
+			break;
+		}
+		if(*p == _T('"')) {
+			sCommandLine.append(nBackslashes * 2 + 1, _T('\\'));
+			sCommandLine += _T('"');
+		} else {
+			sCommandLine.append(nBackslashes, _T('\\'));
+			sCommandLine += *p;
+		}
+	}
+	sCommandLine += _T('"');
+}
+
+void AppendProgramName( const TCHAR * pcszProgram, TString & sCommandLine )
+{
+	if(!sCommandLine.empty())
+		sCommandLine += _T(' ');
+	bool bQuote = !*pcszProgram || _tcspbrk(pcszProgram, _T(" \t"));
+	if(bQuote)
+		sCommandLine += _T('"');
+	sCommandLine += pcszProgram;
+	if(bQuote)
+		sCommandLine += _T('"');
+}
+
+int FindProgram( const TCHAR * pcszProgram, TString & sPath )
+{
+	TString sProgram;
+	DWORD dwSize = ExpandEnvironmentStrings(pcszProgram, NULL, 0);
+	if(!dwSize)
+		return RTERROR;
+	sProgram.resize(dwSize);
+	if(!ExpandEnvironmentStrings(pcszProgram, &sProgram[0], dwSize))
+		return RTERROR;
+	sProgram.resize(_tcslen(sProgram.c_str()));
+
+	// SearchPath also takes paths, and then only checks the file exists
+	sPath.resize(MAX_PATH);
+	for(;;) {
+		DWORD dwLength = SearchPath(NULL, sProgram.c_str(), _T(".exe"), (DWORD) sPath.size(), &sPath[0], NULL);
+		if(!dwLength)
+			return RTERROR;
+		if(dwLength < sPath.size()) {
+			sPath.resize(dwLength);
+			return RTNORM;
+		}
+		sPath.resize(dwLength); // too small, dwLength includes the NUL
+	}
+}
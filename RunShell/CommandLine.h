@@ -0,0 +1,57 @@
+/**	\file CommandLine.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	CommandLine.h															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+
+/**	\brief Appends one argument to a command line, quoted so the program sees it unchanged
+*	\param[in] pcszArgument the argument
+*	\param[in,out] sCommandLine the command line, a space is added first
+*	unless it is empty
+*
+*	Quotes the way the Microsoft C runtime and CommandLineToArgvW split a
+*	command line: arguments with white space or quotes are put in quotes,
+*	quotes inside are escaped with a backslash, and backslashes are doubled
+*	only where they come before a quote.
+*/
+void AppendArgument(const TCHAR * pcszArgument, TString & sCommandLine);
+
+/**	\brief Appends the program name to a command line as its first argument
+*	\param[in] pcszProgram the program name or path
+*	\param[in,out] sCommandLine the command line
+*
+*	The first argument is split by different rules than the rest, where a
+*	backslash never escapes anything, so it is only put in quotes.
+*/
+void AppendProgramName(const TCHAR * pcszProgram, TString & sCommandLine);
+
+/**	\brief Finds a program the way CreateProcess would
+*	\param[in] pcszProgram the program, ".exe" is added if it has no extension
+*	\param[out] sPath the full path of the program
+*	\returns RTNORM if found, otherwise RTERROR with the error in GetLastError
+*
+*	Environment variables in pcszProgram are expanded. A program given
+*	with a path is only checked to exist, otherwise the directories
+*	SearchPath looks in are searched.
+*/
+int FindProgram(const TCHAR * pcszProgram, TString & sPath);
@@ -25,11 +25,11 @@
 #include "StdAfx.h"
 #include "ConsoleWindow.h"
 #include "DocShells.h"
+#include "ShellJobs.h"
+#include "ShellCapture.h"
+#include "ShellReaper.h"
 
 AcApDataManager<CDocShells> docShells;
-int CDocShells::m_nNextHandle = 1;
-
-typedef std::map<int, CShellPipe *> Shells;
 
 CDocShells::CDocShells(void)
 {
@@ -37,33 +37,140 @@ CDocShells::CDocShells(void)
 	// It should be deleted during the kUnloadAppMsg message
 	if(!g_pConsole)
 		g_pConsole = new CConsoleWindow;
+	m_pJobs = NULL;
 }
 
+// Finishes the shells still open when the drawing closes, see ReapShells.
 CDocShells::~CDocShells(void)
 {
+	ReapShells();
+}
+
+void CDocShells::ReapShells( void )
+{
+	// Closing a shell waits for its child to exit, and deleting the job
+	// queue waits for its workers, so neither is done on the main thread
+	// while the drawing closes. The reaper closes them in the background
+	// and terminates those that don't exit in time.
+	CShellJobQueue * pJobs = m_pJobs;
+	m_pJobs = NULL;
+	std::vector<CShellPipe *> shells;
+	for(size_t i = 0; i < m_slots.size(); ++i) {
+		if(m_slots[i].pShell)
+			shells.push_back(m_slots[i].pShell);
+		delete m_slots[i].pCapture;
+	}
+	m_slots.clear();
+	m_handles.Clear();
+	if(g_pShellReaper)
+		g_pShellReaper->Reap(shells, pJobs);
+	else {
+		delete pJobs;
+		for(size_t i = 0; i < shells.size(); ++i)
+			delete shells[i];
+	}
+}
+
+int CDocShells::AddSlot( CShellPipe * pShell, CShellCapture * pCapture )
+{
+	int nHandle = m_handles.Add();
+	if(!nHandle)
+		return 0;
+	size_t nIndex = CHandleTable::IndexOf(nHandle);
+	if(nIndex >= m_slots.size())
+		m_slots.resize(nIndex + 1);
+	m_slots[nIndex].pShell = pShell;
+	m_slots[nIndex].pCapture = pCapture;
+	return nHandle;
+}
+
+int CDocShells::FindSlot( int nHandle ) const
+{
+	DWORD dwError;
+	int nIndex = m_handles.Find(nHandle, dwError);
+	if(nIndex < 0)
+		CShellPipe::SetLastShellError(dwError);
+	return nIndex;
+}
+
+void CDocShells::FreeSlot( int nIndex )
+{
+	m_slots[nIndex].pShell = NULL;
+	m_slots[nIndex].pCapture = NULL;
+	m_handles.Free(nIndex);
 }
 
 int CDocShells::AddShell( CShellPipe * pShell )
 {
-	m_shells[m_nNextHandle] = pShell;
-	return m_nNextHandle++;
+	int nHandle = AddSlot(pShell, NULL);
+	if(!nHandle) {
+		delete pShell;
+		CShellPipe::SetLastShellError(ERROR_TOO_MANY_OPEN_FILES);
+	}
+	return nHandle;
 }
 
 int CDocShells::DeleteShell( int nHandle )
 {
-	Shells::iterator it = m_shells.find(nHandle);
-	if(it!= m_shells.end()) {
-		delete it->second;
-		m_shells.erase(it);
-		return RTNORM;
+	int nIndex = FindSlot(nHandle);
+	if(nIndex < 0)
+		return RTERROR;
+	if(!m_slots[nIndex].pShell) {
+		CShellPipe::SetLastShellError(ERROR_INVALID_HANDLE); // a capture
+		return RTERROR;
 	}
-	return RTERROR;
+	delete m_slots[nIndex].pShell;
+	FreeSlot(nIndex);
+	return RTNORM;
 }
 
 CShellPipe * CDocShells::GetShell( int nHandle ) const
 {
-	Shells::const_iterator it = m_shells.find(nHandle);
-	if(it!= m_shells.end())
-		return it->second;
-	return NULL;
+	int nIndex = FindSlot(nHandle);
+	if(nIndex < 0)
+		return NULL;
+	if(!m_slots[nIndex].pShell)
+		CShellPipe::SetLastShellError(ERROR_INVALID_HANDLE); // a capture
+	return m_slots[nIndex].pShell;
+}
+
+int CDocShells::AddCapture( CShellCapture * pCapture )
+{
+	int nHandle = AddSlot(NULL, pCapture);
+	if(!nHandle) {
+		delete pCapture;
+		CShellPipe::SetLastShellError(ERROR_TOO_MANY_OPEN_FILES);
+	}
+	return nHandle;
+}
+
+int CDocShells::DeleteCapture( int nHandle )
+{
+	int nIndex = FindSlot(nHandle);
+	if(nIndex < 0)
+		return RTERROR;
+	if(!m_slots[nIndex].pCapture) {
+		CShellPipe::SetLastShellError(ERROR_INVALID_HANDLE); // a shell
+		return RTERROR;
+	}
+	delete m_slots[nIndex].pCapture;
+	FreeSlot(nIndex);
+	return RTNORM;
+}
+
+CShellCapture * CDocShells::GetCapture( int nHandle ) const
+{
+	int nIndex = FindSlot(nHandle);
+	if(nIndex < 0)
+		return NULL;
+	if(!m_slots[nIndex].pCapture)
+		CShellPipe::SetLastShellError(ERROR_INVALID_HANDLE); // a shell
+	return m_slots[nIndex].pCapture;
+}
+
+CShellJobQueue * CDocShells::GetJobQueue( void )
+{
+	if(!m_pJobs)
+		m_pJobs = new CShellJobQueue;
+	return m_pJobs;
 }
@@ -23,13 +23,19 @@
 
 
 #pragma once
+#include <vector>
 #include "ShellPipe.h"
+#include "HandleTable.h"
 
 class CConsoleWindow;
+class CShellJobQueue;
+class CShellCapture;
 
 /** \brief Tracks opened shells and assigns handles
 *
-*	
+*	Shells and capture files share one CHandleTable, so a handle from
+*	another drawing, or one that was closed, is told apart from a valid
+*	one even after its slot has been reused.
 */
 class CDocShells
 {
@@ -40,10 +46,8 @@ public:
 	/** \brief Adds a shell to the collection
 	*	\param pShell Pointer to CShellPipe to be added to
 	*	the CDocShells collection.
-	*	\returns a handle (key value) to the collection.
-	*
-	*	Uses m_nNextHandle as the key value associated with pShell, then
-	*	increments m_nNextHandle.
+	*	\returns a handle (key value) to the collection, or 0 if the
+	*	document has no free slot left, in which case pShell is deleted.
 	*/
 	int AddShell(CShellPipe * pShell);
 
@@ -60,12 +64,75 @@ public:
 	*	\param handle previously acquired from AddShell
 	*	\returns CShellPipe instance associated with the handle,
 	*	or NULL if the handle is invalid.
+	*
+	*	For an invalid handle GetLastShellError tells why: ERROR_ACCESS_DENIED
+	*	for a handle of another drawing, otherwise ERROR_INVALID_HANDLE.
 	*/
 	CShellPipe * GetShell(int nHandle) const;
 
+	/** \brief Adds an opened capture file to the collection
+	*	\param pCapture the capture, deleted by DeleteCapture
+	*	\returns a handle to it, never the same as a shell handle, or 0 if
+	*	the document has no free slot left, in which case pCapture is deleted.
+	*/
+	int AddCapture(CShellCapture * pCapture);
+
+	/** \brief Delete a capture file from the collection
+	*	\param handle to the capture to delete
+	*	\returns RTNORM if the capture was deleted, RTERROR otherwise
+	*/
+	int DeleteCapture(int nHandle);
+
+	/** \brief Get a CShellCapture instance from a handle
+	*	\param handle previously acquired from AddCapture
+	*	\returns the capture, or NULL if the handle is invalid, see GetShell.
+	*/
+	CShellCapture * GetCapture(int nHandle) const;
+
+	/** \brief Get the document's background job queue
+	*	\returns the queue, created on first use
+	*/
+	CShellJobQueue * GetJobQueue(void);
+
+	/** \brief Get the document's background job queue, if it was used
+	*	\returns the queue, or NULL if no job was submitted yet
+	*/
+	const CShellJobQueue * FindJobQueue(void) const { return m_pJobs; }
+
+	/** \brief Hands every shell and the job queue to g_pShellReaper
+	*
+	*	Called when the drawing closes, and for every open drawing when the
+	*	application unloads, so the threads of their shells and jobs end
+	*	before the reaper does and not while the DLL is being unloaded.
+	*	Without a reaper they are deleted here. Capture files are closed.
+	*/
+	void ReapShells(void);
+
 private:
-	std::map<int, CShellPipe *> m_shells; /**< collection of CShellPipe s */
-	static int m_nNextHandle; /**< The next handle value to be assigned. */
+	/** \brief What a slot of the handle table holds, a shell or a capture */
+	struct Slot
+	{
+		CShellPipe * pShell;
+		CShellCapture * pCapture;
+	};
+
+	/** \brief Puts a shell or a capture in a free slot
+	*	\returns the handle, or 0 if every slot is taken
+	*/
+	int AddSlot(CShellPipe * pShell, CShellCapture * pCapture);
+
+	/** \brief Finds the slot a handle refers to
+	*	\returns the slot's index, or -1 with the reason set for
+	*	GetLastShellError if the handle is not one of this document's.
+	*/
+	int FindSlot(int nHandle) const;
+
+	/** \brief Empties a slot and frees it in the handle table */
+	void FreeSlot(int nIndex);
+
+	CHandleTable m_handles; /**< hands out the slots, and this document's tag */
+	std::vector<Slot> m_slots; /**< shells and capture files, by the index in their handle */
+	CShellJobQueue * m_pJobs; /**< background jobs, NULL until the first is submitted */
 };
 
 extern AcApDataManager<CDocShells> docShells; // makes CDocShells MDI aware in Autocad.
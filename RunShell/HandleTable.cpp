@@ -0,0 +1,129 @@
+/**	\file HandleTable.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	HandleTable.cpp															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#include "StdAfx.h"
+#include "HandleTable.h"
+
+int CHandleTable::m_nNextTag = 1;
+
+// A handle is the table's tag, the slot's generation and the slot's
+// index, packed in 31 bits so it stays a positive int in Autolisp. The
+// generation starts at 1, so a handle is never 0. The index and the
+// generation split the bits evenly: a drawing can hold 4096 shells and
+// captures at once, and a slot goes through 4095 generations before its
+// handles repeat.
+#define HANDLE_INDEX_BITS 12
+#define HANDLE_GENERATION_BITS 12
+#define HANDLE_TAG_BITS 7
+#define MAX_SLOTS (1 << HANDLE_INDEX_BITS)
+#define MAX_GENERATION ((1 << HANDLE_GENERATION_BITS) - 1)
+#define MAX_HANDLE_TAG ((1 << HANDLE_TAG_BITS) - 1)
+
+// A freed slot is only reused once this many are free, and the oldest
+// first, so an open/close loop spreads over many slots instead of
+// wearing out the generations of one. A handle then comes back only
+// after about a million opens.
+#define MIN_FREE_SLOTS 256
+
+#define HANDLE_INDEX(h) ((h) & (MAX_SLOTS - 1))
+#define HANDLE_GENERATION(h) (((h) >> HANDLE_INDEX_BITS) & MAX_GENERATION)
+#define HANDLE_TAG(h) (((h) >> (HANDLE_INDEX_BITS + HANDLE_GENERATION_BITS)) & MAX_HANDLE_TAG)
+#define MAKE_HANDLE(tag, generation, index) \
+	(((tag) << (HANDLE_INDEX_BITS + HANDLE_GENERATION_BITS)) | ((generation) << HANDLE_INDEX_BITS) | (index))
+
+CHandleTable::CHandleTable(void)
+{
+	m_nFreeSlot = -1;
+	m_nLastFreeSlot = -1;
+	m_nFreeSlots = 0;
+	m_nTag = m_nNextTag;
+	m_nNextTag = m_nNextTag % MAX_HANDLE_TAG + 1;
+}
+
+int CHandleTable::Add( void )
+{
+	int nIndex = m_nFreeSlot;
+	if(nIndex >= 0 && (m_nFreeSlots >= MIN_FREE_SLOTS || m_slots.size() >= MAX_SLOTS)) {
+		m_nFreeSlot = m_slots[nIndex].nNextFree;
+		if(m_nFreeSlot < 0)
+			m_nLastFreeSlot = -1;
+		--m_nFreeSlots;
+	} else {
+		if(m_slots.size() >= MAX_SLOTS)
+			return 0;
+		Slot slot;
+		slot.nGeneration = 1;
+		m_slots.push_back(slot);
+		nIndex = (int) m_slots.size() - 1;
+	}
+
+	Slot & slot = m_slots[nIndex];
+	slot.nNextFree = -1;
+	slot.bTaken = true;
+	return MAKE_HANDLE(m_nTag, slot.nGeneration, nIndex);
+}
+
+int CHandleTable::Find( int nHandle, DWORD & dwError ) const
+{
+	if(nHandle > 0 && HANDLE_TAG(nHandle) && HANDLE_TAG(nHandle) != m_nTag) {
+		dwError = ERROR_ACCESS_DENIED;
+		return -1;
+	}
+	int nIndex = HANDLE_INDEX(nHandle);
+	if(nHandle <= 0 || nIndex >= (int) m_slots.size() || !m_slots[nIndex].bTaken
+		|| m_slots[nIndex].nGeneration != HANDLE_GENERATION(nHandle)) {
+		dwError = ERROR_INVALID_HANDLE;
+		return -1;
+	}
+	return nIndex;
+}
+
+void CHandleTable::Free( int nIndex )
+{
+	Slot & slot = m_slots[nIndex];
+	slot.bTaken = false;
+	// every handle to the slot so far is stale from now on
+	slot.nGeneration = slot.nGeneration % MAX_GENERATION + 1;
+	// freed slots queue up at the end of the free list
+	slot.nNextFree = -1;
+	if(m_nLastFreeSlot >= 0)
+		m_slots[m_nLastFreeSlot].nNextFree = nIndex;
+	else
+		m_nFreeSlot = nIndex;
+	m_nLastFreeSlot = nIndex;
+	++m_nFreeSlots;
+}
+
+void CHandleTable::Clear( void )
+{
+	for(size_t i = 0; i < m_slots.size(); ++i) {
+		if(m_slots[i].bTaken)
+			Free((int) i);
+	}
+}
+
+int CHandleTable::IndexOf( int nHandle )
+{
+	return HANDLE_INDEX(nHandle);
+}
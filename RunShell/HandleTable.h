@@ -0,0 +1,89 @@
+/**	\file HandleTable.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	HandleTable.h															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+#include <vector>
+
+/** \brief Hands out handles to the slots of a table
+*
+*	A handle holds the slot's index, so finding it takes no search, along
+*	with the table's tag and the slot's generation, which changes every
+*	time the slot is freed. A handle from another table, or one that was
+*	freed, is told apart from a valid one even after its slot has been
+*	reused. The table only keeps the slots, what is stored in them is kept
+*	by the owner, by index. No AutoCAD state is involved, so the table can
+*	be tested on its own.
+*/
+class CHandleTable
+{
+public:
+	/** \brief Creates an empty table with the next tag
+	*
+	*	Tags are only reused after 127 tables, a handle kept that long
+	*	still has to match the generation of its slot.
+	*/
+	CHandleTable(void);
+
+	/** \brief Takes a free slot
+	*	\returns a handle to it, or 0 if every slot is taken
+	*/
+	int Add(void);
+
+	/** \brief Finds the slot a handle refers to
+	*	\param[in] nHandle a handle from Add
+	*	\param[out] dwError why the handle is not valid, ERROR_ACCESS_DENIED
+	*	for a handle of another table, otherwise ERROR_INVALID_HANDLE
+	*	\returns the slot's index, or -1 if the handle is not valid
+	*/
+	int Find(int nHandle, DWORD & dwError) const;
+
+	/** \brief Frees a slot, every handle to it is stale from now on
+	*	\param[in] nIndex the index Find returned
+	*/
+	void Free(int nIndex);
+
+	/** \brief Frees every slot still taken */
+	void Clear(void);
+
+	/** \brief Gets the index a handle holds, whether it is valid or not */
+	static int IndexOf(int nHandle);
+
+	int GetTag(void) const { return m_nTag; }				/**< This table's part of every handle */
+	int GetFreeCount(void) const { return m_nFreeSlots; }	/**< Slots on the free list */
+
+private:
+	struct Slot
+	{
+		int nGeneration;	/**< Part of the handle, changes every time the slot is freed */
+		int nNextFree;		/**< Next free slot while this one is free, -1 for none */
+		bool bTaken;		/**< Handed out by Add and not freed yet */
+	};
+
+	std::vector<Slot> m_slots;	/**< By the index in their handle */
+	int m_nFreeSlot;		/**< first free slot, the next one reused, -1 for none */
+	int m_nLastFreeSlot;	/**< last free slot, -1 for none */
+	int m_nFreeSlots;		/**< number of slots on the free list */
+	int m_nTag;				/**< This table's part of every handle */
+	static int m_nNextTag;	/**< The tag the next table gets. */
+};
@@ -0,0 +1,55 @@
+/**	\file LineScanner.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	LineScanner.cpp															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+#include "StdAfx.h"
+#include "LineScanner.h"
+#include <emmintrin.h>
+
+const char * FindNewline( const char * pBegin, const char * pEnd )
+{
+	const char * p = pBegin;
+
+	// Compare 16 bytes at a time. Unaligned loads are used so the
+	// caller's buffer doesn't need any particular alignment.
+	const __m128i newline = _mm_set1_epi8('\n');
+	while(pEnd - p >= 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *) p);
+		int nMask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+		if(nMask) {
+			int nIndex = 0;
+			while(!(nMask & 1)) {
+				nMask >>= 1;
+				++nIndex;
+			}
+			return p + nIndex;
+		}
+		p += 16;
+	}
+
+	// less than 16 bytes left
+	for(; p < pEnd; ++p) {
+		if(*p == '\n')
+			return p;
+	}
+	return pEnd;
+}
@@ -0,0 +1,48 @@
+/**	\file LineScanner.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	LineScanner.h															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+
+/**	\brief Finds the first line feed in a block of raw bytes
+*	\param[in] pBegin first byte to search
+*	\param[in] pEnd one past the last byte to search
+*	\returns pointer to the first '\\n' byte, or pEnd if there is none
+*
+*	Works on the bytes read from the child, before any conversion to
+*	TString. The search is done 16 bytes at a time with SSE2, which
+*	every CPU AutoCAD runs on supports.
+*/
+const char * FindNewline(const char * pBegin, const char * pEnd);
+
+/**	\brief Gets the length of a line without its line end
+*	\param[in] pBegin first byte of the line
+*	\param[in] pNewline the '\\n' ending the line, or the end of the data
+*	\returns the number of bytes before the "\\n" or "\\r\\n"
+*/
+inline size_t LineLength(const char * pBegin, const char * pNewline)
+{
+	if(pNewline > pBegin && pNewline[-1] == '\r')
+		--pNewline;
+	return pNewline - pBegin;
+}
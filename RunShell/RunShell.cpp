@@ -26,6 +26,13 @@
 #include "tchar.h"
 #include "DocShells.h"
 #include "ConsoleWindow.h"
+#include "ShellPool.h"
+#include "ShellReaper.h"
+#include "ShellCache.h"
+#include "ShellBatch.h"
+#include "ShellJobs.h"
+#include "ShellCapture.h"
+#include "Base64.h"
 
 #if defined(ARX2004) || defined(ARX2005) || defined(ARX2006)
 #pragma comment(linker, "/export:_acrxGetApiVersion,PRIVATE")
@@ -38,10 +45,42 @@ struct func_entry { ACHAR *func_name; int (*func) (struct resbuf *); };
 
 // forward references
 int OpenShell(resbuf * pRb);
+int OpenShellPipeline(resbuf * pRb);
+int OpenProcessArgs(resbuf * pRb);
 int CloseShell(resbuf * pRb);
 int ReadShellData(resbuf * pRb);
+int ShellDataAvailable(resbuf * pRb);
+int ReadShellError(resbuf * pRb);
+int ReadShellBinary(resbuf * pRb);
+int ReadShellBinaryFile(resbuf * pRb);
+int WriteShellBinary(resbuf * pRb);
+int ReadShellAll(resbuf * pRb);
+int ReadShellLines(resbuf * pRb);
 int GetLastShellError(resbuf * pRb);
+int SetShellPool(resbuf * pRb);
+int SetShellCache(resbuf * pRb);
+int InvalidateShellCache(resbuf * pRb);
+int RunShellBatch(resbuf * pRb);
+int GetShellStats(resbuf * pRb);
+int SubmitShellJob(resbuf * pRb);
+int PollShellJob(resbuf * pRb);
+int GetShellJobResult(resbuf * pRb);
+int CancelShellJob(resbuf * pRb);
 int WriteShellData(resbuf * pRb);
+int CloseShellInput(resbuf * pRb);
+int FlushShellInput(resbuf * pRb);
+int WriteShellFile(resbuf * pRb);
+int GetShellFileProgress(resbuf * pRb);
+int OpenShellCapture(resbuf * pRb);
+int CloseShellCapture(resbuf * pRb);
+int ReadCaptureLines(resbuf * pRb);
+int ReadCaptureBytes(resbuf * pRb);
+int GetCaptureSize(resbuf * pRb);
+int ExecInShell(resbuf * pRb);
+int GetShellExitCode(resbuf * pRb);
+int GetShellExitCodes(resbuf * pRb);
+int WaitShell(resbuf * pRb);
+int KillShell(resbuf * pRb);
 
 int DoFunc(void);
 int FuncLoad(void);
@@ -49,10 +88,42 @@ int FuncLoad(void);
 // ADS available commands and function pointers
 static struct func_entry func_table[] = {
     {_T("OpenShell"), OpenShell},
+    {_T("OpenShellPipeline"), OpenShellPipeline},
+    {_T("OpenProcessArgs"), OpenProcessArgs},
     {_T("CloseShell"), CloseShell},
     {_T("ReadShellData"), ReadShellData},
+    {_T("ShellDataAvailable"), ShellDataAvailable},
+    {_T("ReadShellError"), ReadShellError},
+    {_T("ReadShellBinary"), ReadShellBinary},
+    {_T("ReadShellBinaryFile"), ReadShellBinaryFile},
+    {_T("WriteShellBinary"), WriteShellBinary},
+    {_T("ReadShellAll"), ReadShellAll},
+    {_T("ReadShellLines"), ReadShellLines},
     {_T("WriteShellData"), WriteShellData},
+    {_T("CloseShellInput"), CloseShellInput},
+    {_T("FlushShellInput"), FlushShellInput},
+    {_T("WriteShellFile"), WriteShellFile},
+    {_T("GetShellFileProgress"), GetShellFileProgress},
+    {_T("OpenShellCapture"), OpenShellCapture},
+    {_T("CloseShellCapture"), CloseShellCapture},
+    {_T("ReadCaptureLines"), ReadCaptureLines},
+    {_T("ReadCaptureBytes"), ReadCaptureBytes},
+    {_T("GetCaptureSize"), GetCaptureSize},
+    {_T("ExecInShell"), ExecInShell},
+    {_T("GetShellExitCode"), GetShellExitCode},
+    {_T("GetShellExitCodes"), GetShellExitCodes},
+    {_T("WaitShell"), WaitShell},
+    {_T("KillShell"), KillShell},
     {_T("GetLastShellError"), GetLastShellError},    
+    {_T("SetShellPool"), SetShellPool},
+    {_T("SetShellCache"), SetShellCache},
+    {_T("InvalidateShellCache"), InvalidateShellCache},
+    {_T("RunShellBatch"), RunShellBatch},
+    {_T("GetShellStats"), GetShellStats},
+    {_T("SubmitShellJob"), SubmitShellJob},
+    {_T("PollShellJob"), PollShellJob},
+    {_T("GetShellJobResult"), GetShellJobResult},
+    {_T("CancelShellJob"), CancelShellJob},
 };
 
 extern "C" AcRx::AppRetCode
@@ -62,6 +133,8 @@ acrxEntryPoint(AcRx::AppMsgCode msg, void * appId)
 case AcRx::kInitAppMsg:
     acrxDynamicLinker->unlockApplication(appId);
     acrxDynamicLinker->registerAppMDIAware(appId);
+    // finishes the shells of drawings as they close
+    g_pShellReaper = new CShellReaper;
     break;
 case AcRx::kUnloadAppMsg:
     // delete the single instance of CConsoleWindow
@@ -70,6 +143,24 @@ case AcRx::kUnloadAppMsg:
         delete g_pConsole;
         g_pConsole = NULL;
     }
+    // close the idle shells of the pool
+    if(g_pShellPool) {
+        delete g_pShellPool;
+        g_pShellPool = NULL;
+    }
+    // Hand the shells and jobs of the drawings still open to the
+    // reaper as well, otherwise their threads would be joined while the
+    // DLL is unloaded. Then terminate whatever is left.
+    if(g_pShellReaper) {
+        AcApDocumentIterator * pDocs = acDocManager->newAcApDocumentIterator();
+        if(pDocs) {
+            for(; !pDocs->done(); pDocs->step())
+                docShells.docData(pDocs->document()).ReapShells();
+            delete pDocs;
+        }
+        delete g_pShellReaper;
+        g_pShellReaper = NULL;
+    }
     break;
 case AcRx::kInvkSubrMsg:
     DoFunc();
@@ -132,9 +223,237 @@ int GetResBufValue(const resbuf * pRb, int & nValue)
     return RTERROR;
 }
 
+// Helper function for RESBUF's that contain RTREAL, RTSHORT or RTLONG,
+// for byte counts that can be larger than an RTLONG holds
+int GetResBufValue(const resbuf * pRb, double & dValue)
+{
+    if(!pRb)
+        return RTERROR;
+    if(pRb->restype == RTREAL) {
+        dValue = pRb->resval.rreal;
+        return RTNORM;
+    }
+    int nValue = 0;
+    if(GetResBufValue(pRb, nValue) != RTNORM)
+        return RTERROR;
+    dValue = nValue;
+    return RTNORM;
+}
+
+// Helper function that builds an Autolisp list of strings. The
+// returned list must be released with acutRelRb.
+resbuf * BuildStringList(const std::vector<TString> & strings)
+{
+    resbuf * pHead = NULL, * pTail = NULL;
+    for(std::vector<TString>::const_iterator it = strings.begin(); it != strings.end(); ++it) {
+        resbuf * pRb = acutBuildList(RTSTR, it->c_str(), 0);
+        if(!pRb) {
+            acutRelRb(pHead);
+            return NULL;
+        }
+        if(pTail)
+            pTail->rbnext = pRb;
+        else
+            pHead = pRb;
+        pTail = pRb;
+    }
+    return pHead;
+}
+
+// Helper function that reads a list of (application commandline)
+// lists. On success pRb is moved past the end of the outer list.
+int GetCommandList(const resbuf *& pRb, std::vector<CShellCommand> & commands)
+{
+    if(!pRb || pRb->restype != RTLB)
+        return RTERROR;
+    pRb = pRb->rbnext;
+    while(pRb && pRb->restype == RTLB) {
+        CShellCommand command;
+        const resbuf * pApp = pRb->rbnext;
+        if(GetResBufValue(pApp, command.sApplicationName) != RTNORM
+            || GetResBufValue(pApp->rbnext, command.sCommandLine) != RTNORM
+            || !pApp->rbnext->rbnext || pApp->rbnext->rbnext->restype != RTLE)
+            return RTERROR;
+        commands.push_back(command);
+        pRb = pApp->rbnext->rbnext->rbnext;
+    }
+    if(!pRb || pRb->restype != RTLE)
+        return RTERROR;
+    pRb = pRb->rbnext;
+    return RTNORM;
+}
+
+// Helper function that appends resbufs to a list being built. Releases
+// the list and returns RTERROR if pNew is NULL (out of memory).
+int AppendResBuf(resbuf *& pHead, resbuf *& pTail, resbuf * pNew)
+{
+    if(!pNew) {
+        acutRelRb(pHead);
+        pHead = pTail = NULL;
+        return RTERROR;
+    }
+    if(pTail)
+        pTail->rbnext = pNew;
+    else
+        pHead = pNew;
+    pTail = pNew;
+    while(pTail->rbnext)
+        pTail = pTail->rbnext;
+    return RTNORM;
+}
+
+// Helper function that appends the result of a command to a list,
+// (exitcode string ...) if it ran to the end, "cancelled" if ESC
+// stopped it, otherwise Nil.
+int AppendCommandResult(resbuf *& pHead, resbuf *& pTail, const CShellCommand & command)
+{
+    if(command.bCancelled)
+        return AppendResBuf(pHead, pTail, acutBuildList(RTSTR, _T("cancelled"), 0));
+    if(command.nResult != RTNORM)
+        return AppendResBuf(pHead, pTail, acutBuildList(RTNIL, 0));
+    if(AppendResBuf(pHead, pTail, acutBuildList(RTLB, RTLONG, command.dwExitCode, 0)) != RTNORM)
+        return RTERROR;
+    if(!command.output.empty() && AppendResBuf(pHead, pTail, BuildStringList(command.output)) != RTNORM)
+        return RTERROR;
+    return AppendResBuf(pHead, pTail, acutBuildList(RTLE, 0));
+}
+
+// Helper function that reads an encoding name
+int GetEncodingValue(const resbuf * pRb, TextEncoding & encoding)
+{
+    TString sEncoding;
+    if(GetResBufValue(pRb, sEncoding) != RTNORM)
+        return RTERROR;
+    if(!_tcsicmp(sEncoding.c_str(), _T("utf8")))
+        encoding = kEncodingUtf8;
+    else if(!_tcsicmp(sEncoding.c_str(), _T("oem")))
+        encoding = kEncodingOem;
+    else if(!_tcsicmp(sEncoding.c_str(), _T("ansi")))
+        encoding = kEncodingAnsi;
+    else if(!_tcsicmp(sEncoding.c_str(), _T("utf16")))
+        encoding = kEncodingUtf16;
+    else
+        return RTERROR;
+    return RTNORM;
+}
+
+// Helper function that reads the optional keyword strings which
+// follow the command line argument of OpenShell.
+int GetShellOptions(const resbuf * pRb, CShellOptions & options)
+{
+    for(; pRb; pRb = pRb->rbnext) {
+        TString sKeyword;
+        if(GetResBufValue(pRb, sKeyword) != RTNORM)
+            return RTERROR;
+
+        if(!_tcsicmp(sKeyword.c_str(), _T("pumped")))
+            options.bPumped = true;
+        else if(!_tcsicmp(sKeyword.c_str(), _T("merged")))
+            options.bMerged = true;
+        else if(!_tcsicmp(sKeyword.c_str(), _T("duplex")))
+            options.bDuplex = true;
+        else if(!_tcsicmp(sKeyword.c_str(), _T("killonbreak")))
+            options.bKillOnBreak = true;
+        else if(!_tcsicmp(sKeyword.c_str(), _T("cached")))
+            options.bCached = true;
+        else if(!_tcsicmp(sKeyword.c_str(), _T("depends"))) {
+            TString sPath;
+            pRb = pRb->rbnext;
+            if(GetResBufValue(pRb, sPath) != RTNORM || sPath.empty())
+                return RTERROR;
+            options.dependencies.push_back(sPath);
+        }
+        else if(!_tcsicmp(sKeyword.c_str(), _T("sentinel"))) {
+            pRb = pRb->rbnext;
+            if(GetResBufValue(pRb, options.sSentinelCommand) != RTNORM)
+                return RTERROR;
+        }
+        else if(!_tcsicmp(sKeyword.c_str(), _T("readahead"))) {
+            int nSize = 0;
+            pRb = pRb->rbnext;
+            if(GetResBufValue(pRb, nSize) != RTNORM || nSize <= 0)
+                return RTERROR;
+            options.nReadAhead = (DWORD) nSize;
+        }
+        else if(!_tcsicmp(sKeyword.c_str(), _T("bufferlimit"))) {
+            int nSize = 0;
+            pRb = pRb->rbnext;
+            if(GetResBufValue(pRb, nSize) != RTNORM || nSize < 0)
+                return RTERROR;
+            options.nBufferLimit = (DWORD) nSize;
+        }
+        else if(!_tcsicmp(sKeyword.c_str(), _T("encoding"))) {
+            pRb = pRb->rbnext;
+            if(GetEncodingValue(pRb, options.encoding) != RTNORM)
+                return RTERROR;
+        }
+        else if(!_tcsicmp(sKeyword.c_str(), _T("pipesize"))) {
+            int nSize = 0;
+            pRb = pRb->rbnext;
+            if(GetResBufValue(pRb, nSize) != RTNORM || nSize < 0)
+                return RTERROR;
+            options.nPipeSize = (DWORD) nSize;
+        }
+        else if(!_tcsicmp(sKeyword.c_str(), _T("asyncwrite"))) {
+            int nSize = 0;
+            pRb = pRb->rbnext;
+            if(GetResBufValue(pRb, nSize) != RTNORM || nSize <= 0)
+                return RTERROR;
+            options.nWriteQueue = (DWORD) nSize;
+        }
+        else if(!_tcsicmp(sKeyword.c_str(), _T("onfull"))) {
+            TString sPolicy;
+            pRb = pRb->rbnext;
+            if(GetResBufValue(pRb, sPolicy) != RTNORM)
+                return RTERROR;
+            if(!_tcsicmp(sPolicy.c_str(), _T("block")))
+                options.writeFull = kWriteFullBlock;
+            else if(!_tcsicmp(sPolicy.c_str(), _T("fail")))
+                options.writeFull = kWriteFullFail;
+            else if(!_tcsicmp(sPolicy.c_str(), _T("drop")))
+                options.writeFull = kWriteFullDrop;
+            else
+                return RTERROR;
+        }
+        else if(!_tcsicmp(sKeyword.c_str(), _T("stdout"))) {
+            pRb = pRb->rbnext;
+            if(GetResBufValue(pRb, options.sStdoutFile) != RTNORM || options.sStdoutFile.empty())
+                return RTERROR;
+        }
+        else if(!_tcsicmp(sKeyword.c_str(), _T("stderr"))) {
+            pRb = pRb->rbnext;
+            if(GetResBufValue(pRb, options.sStderrFile) != RTNORM || options.sStderrFile.empty())
+                return RTERROR;
+        }
+        else if(!_tcsicmp(sKeyword.c_str(), _T("cwd"))) {
+            pRb = pRb->rbnext;
+            if(GetResBufValue(pRb, options.sDirectory) != RTNORM || options.sDirectory.empty())
+                return RTERROR;
+        }
+        else if(!_tcsicmp(sKeyword.c_str(), _T("env"))) {
+            TString sVariable;
+            pRb = pRb->rbnext;
+            // NAME=VALUE, the name can't be empty
+            if(GetResBufValue(pRb, sVariable) != RTNORM || sVariable.find(_T('='), 1) == TString::npos)
+                return RTERROR;
+            options.environment.push_back(sVariable);
+        }
+        else
+            return RTERROR; // unknown keyword
+    }
+    // a merged stderr goes wherever stdout goes
+    if(options.bMerged && !options.sStderrFile.empty())
+        return RTERROR;
+    // a cached result is the whole output of a shell that has ended
+    if(options.bCached && (options.bDuplex || !options.sStdoutFile.empty() || !options.sStderrFile.empty()))
+        return RTERROR;
+    return RTNORM;
+}
+
 
 /** \brief The gateway function between Autolisp and CShellPipe::OpenShell
-*	\param pRb a resbuf that must have 2 link that are strings
+*	\param pRb a resbuf that must have 2 link that are strings, optionally
+*	followed by option keywords (see CShellOptions)
 *	\returns RTRSLT meaning a result is being returned.
 *
 *	When this function makes calls to any other function and the return
@@ -166,9 +485,121 @@ static int OpenShell(resbuf * pRb)
     }
     pcszCommandLine = pRb->rbnext->resval.rstring;
 
-    // Create a new instance of CShellPipe
+    // get the optional keywords
+    CShellOptions options;
+    if(GetShellOptions(pRb->rbnext->rbnext, options) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // Take a started shell from the pool, or create a new instance of CShellPipe
+    CShellPipe * pPipe = NULL;
+    if(g_pShellPool)
+        pPipe = g_pShellPool->Acquire(pcszApplicationName, pcszCommandLine, options);
+    if(!pPipe) {
+        pPipe = new CShellPipe;
+        if(pPipe->OpenShell(pcszApplicationName, pcszCommandLine, options) != RTNORM) {
+            delete pPipe;
+            acedRetNil();
+            return RSRSLT;
+        }
+    }
+
+    int nHandle = docShells.docData().AddShell(pPipe);
+    if(!nHandle)
+        acedRetNil();
+    else
+        acedRetInt(nHandle);
+    return RSRSLT;
+}
+
+/** \brief The gateway function between Autolisp and CShellPipe::OpenProcessArgs
+*	\param pRb a resbuf with the program and a list of argument strings,
+*	optionally followed by option keywords (see CShellOptions)
+*	\returns RTRSLT meaning a result is being returned.
+*
+*	Returns a handle that works with every function taking one from
+*	OpenShell, or Nil if the program could not be found or started.
+*/
+static int OpenProcessArgs(resbuf * pRb)
+{
+    TString sProgram;
+    if(GetResBufValue(pRb, sProgram) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // get the arguments, nil is an empty list
+    std::vector<const TCHAR *> arguments;
+    const resbuf * pArg = pRb->rbnext;
+    if(pArg && pArg->restype == RTLB) {
+        for(pArg = pArg->rbnext; pArg && pArg->restype == RTSTR; pArg = pArg->rbnext)
+            arguments.push_back(pArg->resval.rstring);
+        if(!pArg || pArg->restype != RTLE) {
+            acedRetNil();
+            return RSRSLT;
+        }
+    } else if(!pArg || pArg->restype != RTNIL) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // get the optional keywords
+    CShellOptions options;
+    if(GetShellOptions(pArg->rbnext, options) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    CShellPipe * pPipe = new CShellPipe;
+    if(pPipe->OpenProcessArgs(sProgram.c_str(), arguments, options) != RTNORM) {
+        delete pPipe;
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    int nHandle = docShells.docData().AddShell(pPipe);
+    if(!nHandle)
+        acedRetNil();
+    else
+        acedRetInt(nHandle);
+    return RSRSLT;
+}
+
+/** \brief The gateway function between Autolisp and CShellPipe::OpenPipeline
+*	\param pRb a resbuf with a list of (application commandline) lists, one
+*	per stage, optionally followed by option keywords (see CShellOptions)
+*	\returns RTRSLT meaning a result is being returned.
+*
+*	Returns a handle that works with every function taking one from
+*	OpenShell, or Nil if the stages could not be started. Writes go to the
+*	first stage, stdout reads come from the last stage, stderr reads from
+*	all of them.
+*/
+static int OpenShellPipeline(resbuf * pRb)
+{
+    const resbuf * pArgs = pRb;
+    std::vector<CShellCommand> stages;
+    if(GetCommandList(pArgs, stages) != RTNORM || stages.empty()) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // get the optional keywords
+    CShellOptions options;
+    if(GetShellOptions(pArgs, options) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    std::vector<const TCHAR *> applicationNames, commandLines;
+    for(size_t i = 0; i < stages.size(); ++i) {
+        applicationNames.push_back(stages[i].sApplicationName.c_str());
+        commandLines.push_back(stages[i].sCommandLine.c_str());
+    }
+
     CShellPipe * pPipe = new CShellPipe;
-    if(pPipe->OpenShell(pRb->resval.rstring, pRb->rbnext->resval.rstring) != RTNORM) {
+    if(pPipe->OpenPipeline(applicationNames, commandLines, options) != RTNORM) {
         delete pPipe;
         acedRetNil();
         return RSRSLT;
@@ -199,6 +630,8 @@ static int OpenShell(resbuf * pRb)
 *	this function will return RTRSLT with acedRetT().
 *	
 *	The calling Autolisp function will receive T as a returned value.
+*	If the user presses ESC while waiting for the shell to exit the
+*	CShellPipe is still deleted, but Nil is returned.
 */
 static int CloseShell(resbuf * pRb)
 {
@@ -209,8 +642,16 @@ static int CloseShell(resbuf * pRb)
         return RSRSLT;
     }
 
-    // use the handle to delete the CShellPipe associated with it
-    if(docShells.docData().DeleteShell(nHandle) == RTNORM)
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // wait for the shell to exit, then delete the CShellPipe
+    bool bClosed = pShell->CloseShell() == RTNORM;
+    if(docShells.docData().DeleteShell(nHandle) == RTNORM && bClosed)
         acedRetT();
     else
         acedRetNil();
@@ -219,7 +660,8 @@ static int CloseShell(resbuf * pRb)
 
 
 /** \brief Reads data from a CShellPipe instance
-*	\param pRb a resbuf containing the handle value
+*	\param pRb a resbuf containing the handle value, optionally followed
+*	by a timeout in milliseconds
 *	\returns RTRSLT meaning a result is being returned.
 *
 *	The pRb must be a RTSHORT or RTLONG value that is a handle
@@ -235,7 +677,9 @@ static int CloseShell(resbuf * pRb)
 *	the read data.
 *	
 *	The calling Autolisp function will receive a string as a returned value,
-*	which is the read data.
+*	which is the read data. If a timeout is given and no data arrives in
+*	time an empty string is returned, which tells it apart from the Nil
+*	returned when there is nothing left to read.
 */
 static int ReadShellData(resbuf * pRb)
 {
@@ -246,6 +690,13 @@ static int ReadShellData(resbuf * pRb)
         return RSRSLT;
     }
 
+    // get the optional timeout
+    int nTimeout = -1;
+    if(pRb->rbnext && (GetResBufValue(pRb->rbnext, nTimeout) != RTNORM || nTimeout < 0)) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
     // use the handle to get the associated CShellPipe instance.
     CShellPipe * pShell = docShells.docData().GetShell(nHandle);
     if(!pShell) {
@@ -253,9 +704,11 @@ static int ReadShellData(resbuf * pRb)
         return RSRSLT;
     }
 
-    // read the data from the CShellPipe instance
-    TString sResults;
-    if(pShell->ReadShellData(sResults) != RTNORM) {
+    // read the data from the CShellPipe instance. ADS functions only
+    // run on the main thread, so one string can be reused for every call.
+    static TString sResults;
+    int nResult = pShell->ReadShellData(sResults, nTimeout < 0 ? INFINITE : (DWORD) nTimeout);
+    if(nResult != RTNORM && nResult != RTNONE) {
         acedRetNil();
         return RSRSLT;
     }
@@ -265,28 +718,91 @@ static int ReadShellData(resbuf * pRb)
     return RSRSLT;
 }
 
-/** \brief Writes data to the CShellPipe instance
-*	\param pRb a resbuf containing the handle value, and string to write
-*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
-*	function will receive a T as a returned value if the function succeeds,
-*	otherwise Nil is returned
+/** \brief Gets the number of bytes that can be read from a CShellPipe instance
+*	\param pRb a resbuf containing the handle value
+*	\returns RTRSLT meaning a result is being returned.
 *
-*	The pRb must be a list containing a RTSHORT or RTLONG for the first value
-*	that is the handle associated to a CShellPipe instance.
-*	The second value must be a RTSTR for the second value which is the value
-*	to be written to Stdin of CPipeShell.
+*	Returns the number of stdout bytes that ReadShellData can return
+*	without waiting, 0 if the shell hasn't written anything yet, or Nil
+*	once the shell has closed stdout and everything has been read.
+*	Never waits for the shell.
+*/
+static int ShellDataAvailable(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    DWORD nBytes = 0;
+    if(pShell->ShellDataAvailable(nBytes) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetInt((int) nBytes);
+    return RSRSLT;
+}
+
+
+/** \brief Reads stderr data from a CShellPipe instance
+*	\param pRb a resbuf containing the handle value
+*	\returns RTRSLT meaning a result is being returned.
 *
-*	When this function makes calls to any other function and the return
-*	value from those functions are RTERROR, then this function will
-*	return RTRSLT with acedRetNil(). The Autolisp function that called
-*	this will receive a Nil return.
+*	Same as ReadShellData, except the data comes from the stderr
+*	stream of the shell. Shells opened with the "merged" option send
+*	stderr to stdout, and this function returns Nil for them.
+*/
+static int ReadShellError(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // read the stderr data from the CShellPipe instance
+    static TString sResults;
+    if(pShell->ReadShellError(sResults) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetStr(sResults.c_str());
+    return RSRSLT;
+}
+
+/** \brief Reads all the stdout data from a CShellPipe instance
+*	\param pRb a resbuf containing the handle value, optionally followed
+*	by the string "chunks" or "lines"
+*	\returns RTRSLT meaning a result is being returned.
 *
-*	Otherwise if everything is OK (all functions called return RTNORM) then
-*	this function will return RTRSLT with acedRetStr() that contains
-*	the read data.
-*	
+*	Reads until the shell closes stdout and returns the whole output
+*	as one list of strings. With "chunks", the default, the strings are
+*	pieces of at most 503 chars that can be joined back together, with
+*	"lines" each string is one line of output without its line end.
+*
+*	Returns Nil if there is no output or on errors. Any other mode sets
+*	ERROR_INVALID_PARAMETER.
 */
-static int WriteShellData(resbuf * pRb)
+static int ReadShellAll(resbuf * pRb)
 {
     int nHandle = 0;
     // get the handle, bail if pRb is not RTLONG or RTSHORT
@@ -295,15 +811,72 @@ static int WriteShellData(resbuf * pRb)
         return RSRSLT;
     }
 
-    // Get the string to send to stdio. Bail if it is NULL
-    // or not a string
-    TCHAR * pcszSendString = NULL;
-    if(!pRb->rbnext || pRb->rbnext->restype != RTSTR) {
+    // get the optional mode string
+    bool bLines = false;
+    if(pRb->rbnext) {
+        TString sMode;
+        if(GetResBufValue(pRb->rbnext, sMode) != RTNORM) {
+            acedRetNil();
+            return RSRSLT;
+        }
+        if(!_tcsicmp(sMode.c_str(), _T("lines")))
+            bLines = true;
+        else if(_tcsicmp(sMode.c_str(), _T("chunks"))) {
+            CShellPipe::SetLastShellError(ERROR_INVALID_PARAMETER);
+            acedRetNil();
+            return RSRSLT;
+        }
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    std::vector<TString> results;
+    if(pShell->ReadShellAll(results, bLines) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    resbuf * pList = BuildStringList(results);
+    if(!pList) {
+        acedRetNil();
+        return RSRSLT;
+    }
+    acedRetList(pList);
+    acutRelRb(pList);
+    return RSRSLT;
+}
+
+/** \brief Reads whole lines of stdout data from a CShellPipe instance
+*	\param pRb a resbuf containing the handle value, optionally followed
+*	by the most lines to return as RTSHORT or RTLONG
+*	\returns RTRSLT meaning a result is being returned.
+*
+*	Returns a list of the complete lines read so far, without their
+*	line ends. Partial lines are kept by the CShellPipe instance until
+*	the rest of the line has been read.
+*
+*	Returns Nil when there is nothing left to read or on errors.
+*/
+static int ReadShellLines(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
         acedRetNil();
         return RSRSLT;
     }
-    pcszSendString = pRb->rbnext->resval.rstring;
 
+    // get the optional line limit
+    int nMaxLines = 0;
+    if(pRb->rbnext && GetResBufValue(pRb->rbnext, nMaxLines) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
 
     // use the handle to get the associated CShellPipe instance.
     CShellPipe * pShell = docShells.docData().GetShell(nHandle);
@@ -312,22 +885,1141 @@ static int WriteShellData(resbuf * pRb)
         return RSRSLT;
     }
 
-    // read the data from the CShellPipe instance
-    if(pShell->WriteShellData(pcszSendString) != RTNORM) {
+    std::vector<TString> lines;
+    if(pShell->ReadShellLines(lines, nMaxLines) != RTNORM) {
         acedRetNil();
         return RSRSLT;
     }
 
-    acedRetT();
+    resbuf * pList = BuildStringList(lines);
+    if(!pList) {
+        acedRetNil();
+        return RSRSLT;
+    }
+    acedRetList(pList);
+    acutRelRb(pList);
     return RSRSLT;
 }
 
-static int GetLastShellError(resbuf * pRb)
+/** \brief Reads bytes from the stdout stream of a CShellPipe instance
+*	\param pRb a resbuf containing the handle value, optionally followed by
+*	the most bytes to read
+*	\returns RTRSLT meaning a result is being returned.
+*
+*	Returns the bytes as a base64 string, or Nil at the end of the stream or
+*	on errors. The default of 375 bytes is the most whose base64 encoding
+*	fits the 503 chars acedRetStr is documented to support.
+*/
+static int ReadShellBinary(resbuf * pRb)
 {
-    TString sResult;
-    DWORD dwError = CShellPipe::GetLastShellError(sResult);
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
 
-    resbuf * pErrorRb = acutBuildList(RTLONG, dwError, RTSTR, sResult.c_str(), 0);
-    acedRetList(pErrorRb);
+    // get the optional byte limit, 375 bytes encode to 500 chars
+    int nMax = 375;
+    if(pRb->rbnext && (GetResBufValue(pRb->rbnext, nMax) != RTNORM || nMax <= 0)) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    static std::string sBytes;
+    if(pShell->ReadShellBinary(sBytes, (DWORD) nMax) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    static TString sResults;
+    sResults.erase();
+    Base64Encode(sBytes.data(), sBytes.size(), sResults);
+    acedRetStr(sResults.c_str());
     return RSRSLT;
-}
\ No newline at end of file
+}
+
+/** \brief Writes the rest of the stdout stream of a CShellPipe instance to a file
+*	\param pRb a resbuf containing the handle value and the file path
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive the number of bytes written to the file as a
+*	real, otherwise Nil is returned
+*/
+static int ReadShellBinaryFile(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // get the path
+    TString sPath;
+    if(GetResBufValue(pRb->rbnext, sPath) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    ULONGLONG nBytes = 0;
+    if(pShell->ReadShellBinary(sPath.c_str(), nBytes) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetReal((double) nBytes);
+    return RSRSLT;
+}
+
+/** \brief Writes bytes to the CShellPipe instance
+*	\param pRb a resbuf containing the handle value, and a base64 string or
+*	a list of them
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive the number of bytes written if the function
+*	succeeds, otherwise Nil is returned
+*
+*	The strings of a list are joined before they are decoded, so they can
+*	be split anywhere. The bytes are written exactly as they are decoded.
+*/
+static int WriteShellBinary(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    static TString sText;
+    sText.erase();
+    const resbuf * pArg = pRb->rbnext;
+    if(pArg && pArg->restype == RTSTR)
+        sText = pArg->resval.rstring;
+    else if(pArg && pArg->restype == RTLB) {
+        for(pArg = pArg->rbnext; pArg && pArg->restype == RTSTR; pArg = pArg->rbnext)
+            sText += pArg->resval.rstring;
+        if(!pArg || pArg->restype != RTLE) {
+            acedRetNil();
+            return RSRSLT;
+        }
+    } else {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    static std::string sBytes;
+    sBytes.erase();
+    if(!Base64Decode(sText.data(), sText.size(), sBytes)) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    DWORD nWritten = 0;
+    if(pShell->WriteShellBinary(sBytes.data(), sBytes.size(), nWritten) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetInt((int) nWritten);
+    return RSRSLT;
+}
+
+/** \brief Writes data to the CShellPipe instance
+*	\param pRb a resbuf containing the handle value, and a string or a list
+*	of strings to write
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive the number of bytes written if the function
+*	succeeds, otherwise Nil is returned
+*
+*	The pRb must be a list containing a RTSHORT or RTLONG for the first value
+*	that is the handle associated to a CShellPipe instance.
+*	The second value must be a RTSTR, or a list of RTSTR, which is the value
+*	to be written to Stdin of CPipeShell. The strings of a list are written
+*	one after the other with a single write.
+*
+*	When this function makes calls to any other function and the return
+*	value from those functions are RTERROR, then this function will
+*	return RTRSLT with acedRetNil(). The Autolisp function that called
+*	this will receive a Nil return.
+*	
+*/
+static int WriteShellData(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // Get the strings to send to stdio. The pointers point into the
+    // resbufs, and ADS functions only run on the main thread, so one
+    // vector can be reused for every call.
+    static std::vector<const TCHAR *> strings;
+    strings.clear();
+    const resbuf * pArg = pRb->rbnext;
+    if(pArg && pArg->restype == RTSTR)
+        strings.push_back(pArg->resval.rstring);
+    else if(pArg && pArg->restype == RTLB) {
+        for(pArg = pArg->rbnext; pArg && pArg->restype == RTSTR; pArg = pArg->rbnext)
+            strings.push_back(pArg->resval.rstring);
+        if(!pArg || pArg->restype != RTLE) {
+            acedRetNil();
+            return RSRSLT;
+        }
+    } else if(!pArg || pArg->restype != RTNIL) { // nil is an empty list
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // write the data to the CShellPipe instance
+    DWORD nWritten = 0;
+    if(pShell->WriteShellData(strings, nWritten) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetInt((int) nWritten);
+    return RSRSLT;
+}
+
+/** \brief Closes the stdin stream of a CShellPipe instance
+*	\param pRb a resbuf containing the handle value
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive a T as a returned value if the function succeeds,
+*	otherwise Nil is returned
+*
+*	Shells opened with the "duplex" option keep stdin open until this
+*	function is called.
+*/
+static int CloseShellInput(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    if(pShell->CloseShellInput() != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetT();
+    return RSRSLT;
+}
+
+/** \brief Waits until a CShellPipe instance's queued stdin reaches the child
+*	\param pRb a resbuf containing the handle value, optionally followed by
+*	the most milliseconds to wait
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive a T as a returned value once the queue is empty,
+*	otherwise Nil is returned on timeout or errors.
+*
+*	Only shells opened with the "asyncwrite" option queue their writes.
+*/
+static int FlushShellInput(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // get the optional timeout
+    int nTimeout = -1;
+    if(pRb->rbnext && (GetResBufValue(pRb->rbnext, nTimeout) != RTNORM || nTimeout < 0)) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    if(pShell->FlushShellInput(nTimeout < 0 ? INFINITE : (DWORD) nTimeout) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetT();
+    return RSRSLT;
+}
+
+/** \brief Streams a file to the stdin of a CShellPipe instance
+*	\param pRb a resbuf containing the handle value and the file path,
+*	optionally followed by the offset in the file to start at and the
+*	number of bytes to write
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive a T as a returned value if the file is being
+*	written, otherwise Nil is returned
+*
+*	The shell must be opened with the "asyncwrite" option. The bytes are
+*	written by the shell's writer thread, as they are in the file, and
+*	stdin is only closed after them.
+*/
+static int WriteShellFile(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // get the path
+    TString sPath;
+    if(GetResBufValue(pRb->rbnext, sPath) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // get the optional offset and length
+    double dOffset = 0.0, dLength = 0.0;
+    const resbuf * pOffset = pRb->rbnext->rbnext;
+    if(pOffset && (GetResBufValue(pOffset, dOffset) != RTNORM || dOffset < 0.0
+        || (pOffset->rbnext && (GetResBufValue(pOffset->rbnext, dLength) != RTNORM || dLength < 0.0)))) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    if(pShell->WriteShellFile(sPath.c_str(), (ULONGLONG) dOffset, (ULONGLONG) dLength) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetT();
+    return RSRSLT;
+}
+
+/** \brief Gets how far WriteShellFile has got
+*	\param pRb a resbuf containing the handle value
+*	\returns RTRSLT meaning a result is being returned.
+*
+*	Returns a list (sent total done), the bytes written so far and the
+*	bytes to write as reals, and T once the whole file is written or Nil
+*	while it is still being written. Returns Nil if no file was written
+*	or the transfer failed.
+*/
+static int GetShellFileProgress(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    ULONGLONG nSent = 0, nTotal = 0;
+    int nResult = pShell->GetShellFileProgress(nSent, nTotal);
+    if(nResult == RTERROR) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    resbuf * pList = acutBuildList(RTREAL, (double) nSent, RTREAL, (double) nTotal,
+        nResult == RTNORM ? RTT : RTNIL, 0);
+    acedRetList(pList);
+    acutRelRb(pList);
+    return RSRSLT;
+}
+
+/** \brief Opens a file written by a shell opened with "stdout" or "stderr"
+*	\param pRb a resbuf containing the path, optionally followed by the
+*	encoding of the file
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function receives a handle for the other capture functions, or Nil
+*	if the file can't be opened.
+*
+*	The file is mapped read-only, and may still be growing.
+*/
+static int OpenShellCapture(resbuf * pRb)
+{
+    TString sPath;
+    if(GetResBufValue(pRb, sPath) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    TextEncoding encoding = kEncodingUtf8;
+    if(pRb->rbnext && GetEncodingValue(pRb->rbnext, encoding) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    CShellCapture * pCapture = new CShellCapture(encoding);
+    if(pCapture->Open(sPath.c_str()) != RTNORM) {
+        delete pCapture;
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    int nHandle = docShells.docData().AddCapture(pCapture);
+    if(!nHandle)
+        acedRetNil();
+    else
+        acedRetInt(nHandle);
+    return RSRSLT;
+}
+
+/** \brief Closes a handle from OpenShellCapture
+*	\param pRb a resbuf containing the handle value
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive a T as a returned value if the function succeeds,
+*	otherwise Nil is returned
+*/
+static int CloseShellCapture(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    if(docShells.docData().DeleteCapture(nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetT();
+    return RSRSLT;
+}
+
+/** \brief Reads lines of a capture file
+*	\param pRb a resbuf containing the handle value and the index of the
+*	first line, 0 for the first line of the file, optionally followed by
+*	the most lines to read
+*	\returns RTRSLT meaning a result is being returned.
+*
+*	Returns a list of the lines without their line ends, or Nil if the
+*	first line is past the end of the file.
+*/
+static int ReadCaptureLines(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // get the first line and the optional line limit
+    int nFirst = 0, nCount = 0;
+    if(GetResBufValue(pRb->rbnext, nFirst) != RTNORM || nFirst < 0
+        || (pRb->rbnext->rbnext && (GetResBufValue(pRb->rbnext->rbnext, nCount) != RTNORM || nCount < 0))) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    CShellCapture * pCapture = docShells.docData().GetCapture(nHandle);
+    if(!pCapture) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    std::vector<TString> lines;
+    if(pCapture->ReadLines((size_t) nFirst, (size_t) nCount, lines) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    resbuf * pList = BuildStringList(lines);
+    if(!pList) {
+        acedRetNil();
+        return RSRSLT;
+    }
+    acedRetList(pList);
+    acutRelRb(pList);
+    return RSRSLT;
+}
+
+/** \brief Reads a byte range of a capture file as text
+*	\param pRb a resbuf containing the handle value, the offset of the first
+*	byte and the most bytes to read
+*	\returns RTRSLT meaning a result is being returned.
+*
+*	Returns the text, or Nil if the offset is past the end of the file.
+*/
+static int ReadCaptureBytes(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    double dOffset = 0.0;
+    int nLength = 0;
+    if(GetResBufValue(pRb->rbnext, dOffset) != RTNORM || dOffset < 0.0
+        || GetResBufValue(pRb->rbnext->rbnext, nLength) != RTNORM || nLength <= 0) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    CShellCapture * pCapture = docShells.docData().GetCapture(nHandle);
+    if(!pCapture) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    static TString sResults;
+    if(pCapture->ReadBytes((ULONGLONG) dOffset, (DWORD) nLength, sResults) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetStr(sResults.c_str());
+    return RSRSLT;
+}
+
+/** \brief Gets the size of a capture file
+*	\param pRb a resbuf containing the handle value
+*	\returns RTRSLT meaning a result is being returned.
+*
+*	Returns a list (bytes lines), the bytes as a real, or Nil on errors.
+*/
+static int GetCaptureSize(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    CShellCapture * pCapture = docShells.docData().GetCapture(nHandle);
+    if(!pCapture) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    ULONGLONG nSize = 0;
+    size_t nLines = 0;
+    if(pCapture->GetSize(nSize, nLines) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    resbuf * pList = acutBuildList(RTREAL, (double) nSize, RTLONG, (int) nLines, 0);
+    acedRetList(pList);
+    acutRelRb(pList);
+    return RSRSLT;
+}
+
+/** \brief Runs a command in a CShellPipe instance opened "duplex" and
+*	"pumped" or "merged"
+*	\param pRb a resbuf containing the handle value and the command string
+*	\returns RTRSLT meaning a result is being returned.
+*
+*	Returns a list whose first item is the exit status of the command,
+*	followed by the lines the command wrote to stdout. Returns Nil on
+*	errors, or if the shell ended before the command finished.
+*/
+static int ExecInShell(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // get the command string
+    TString sCommand;
+    if(GetResBufValue(pRb->rbnext, sCommand) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    std::vector<TString> lines;
+    int nExitCode = 0;
+    if(pShell->ExecInShell(sCommand.c_str(), lines, nExitCode) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    resbuf * pList = acutBuildList(RTLONG, nExitCode, 0);
+    if(!pList) {
+        acedRetNil();
+        return RSRSLT;
+    }
+    pList->rbnext = BuildStringList(lines);
+    acedRetList(pList);
+    acutRelRb(pList);
+    return RSRSLT;
+}
+
+/** \brief Gets the exit code of a CShellPipe instance's process
+*	\param pRb a resbuf containing the handle value
+*	\returns RTRSLT meaning a result is being returned.
+*
+*	Returns the exit code as an integer, or Nil if the process is still
+*	running or on errors.
+*/
+static int GetShellExitCode(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    DWORD dwExitCode = 0;
+    if(pShell->GetShellExitCode(dwExitCode) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetInt((int) dwExitCode);
+    return RSRSLT;
+}
+
+/** \brief Gets the exit code of every stage of a CShellPipe instance
+*	\param pRb a resbuf containing the handle value
+*	\returns RTRSLT meaning a result is being returned.
+*
+*	Returns a list with the exit code of each stage of a pipeline, in stage
+*	order, Nil in place of a stage that is still running. A shell from
+*	OpenShell gives a list of one. Returns Nil on errors.
+*/
+static int GetShellExitCodes(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    std::vector<DWORD> exitCodes;
+    std::vector<bool> exited;
+    if(pShell->GetShellExitCodes(exitCodes, exited) == RTERROR) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    resbuf * pHead = NULL, * pTail = NULL;
+    for(size_t i = 0; i < exitCodes.size(); ++i) {
+        resbuf * pCode = exited[i] ? acutBuildList(RTLONG, (int) exitCodes[i], 0) : acutBuildList(RTNIL, 0);
+        if(AppendResBuf(pHead, pTail, pCode) != RTNORM) {
+            acedRetNil();
+            return RSRSLT;
+        }
+    }
+    acedRetList(pHead);
+    acutRelRb(pHead);
+    return RSRSLT;
+}
+
+/** \brief Waits for a CShellPipe instance's process to exit
+*	\param pRb a resbuf containing the handle value, optionally followed
+*	by a timeout in milliseconds
+*	\returns RTRSLT meaning a result is being returned.
+*
+*	Returns T once the process has exited, Nil on timeout, if the user
+*	pressed ESC, or on errors. Without a timeout waits until the process
+*	exits or ESC is pressed.
+*/
+static int WaitShell(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // get the optional timeout
+    int nTimeout = -1;
+    if(pRb->rbnext && (GetResBufValue(pRb->rbnext, nTimeout) != RTNORM || nTimeout < 0)) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    if(pShell->WaitShell(nTimeout < 0 ? INFINITE : (DWORD) nTimeout) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetT();
+    return RSRSLT;
+}
+
+/** \brief Terminates a CShellPipe instance's process and its children
+*	\param pRb a resbuf containing the handle value
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive a T as a returned value if the function succeeds,
+*	otherwise Nil is returned
+*
+*	The handle stays valid, so the exit code can still be read. It must
+*	still be closed with CloseShell.
+*/
+static int KillShell(resbuf * pRb)
+{
+    int nHandle = 0;
+    // get the handle, bail if pRb is not RTLONG or RTSHORT
+    if(GetResBufValue(pRb, nHandle) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // use the handle to get the associated CShellPipe instance.
+    CShellPipe * pShell = docShells.docData().GetShell(nHandle);
+    if(!pShell) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    if(pShell->KillShell(1) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetT();
+    return RSRSLT;
+}
+
+static int GetLastShellError(resbuf * pRb)
+{
+    TString sResult;
+    DWORD dwError = CShellPipe::GetLastShellError(sResult);
+
+    resbuf * pErrorRb = acutBuildList(RTLONG, dwError, RTSTR, sResult.c_str(), 0);
+    acedRetList(pErrorRb);
+    return RSRSLT;
+}
+
+/** \brief Configures a pool of started shells for OpenShell
+*	\param pRb a resbuf with the application name and command line strings,
+*	the pool size, optionally the idle time in milliseconds, then optionally
+*	the same option keywords as OpenShell.
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive a T as a returned value if the function succeeds,
+*	otherwise Nil is returned
+*
+*	OpenShell calls with the same application name, command line and options
+*	are then given an idle shell from the pool. A size of 0 removes the pool.
+*	Configuring a pool again also retries one that gave up starting shells.
+*/
+static int SetShellPool(resbuf * pRb)
+{
+    TString sApplicationName, sCommandLine;
+    if(GetResBufValue(pRb, sApplicationName) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+    pRb = pRb->rbnext;
+    if(GetResBufValue(pRb, sCommandLine) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+    pRb = pRb->rbnext;
+    int nSize = 0;
+    if(GetResBufValue(pRb, nSize) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+    pRb = pRb->rbnext;
+
+    // optional idle time, default is 5 minutes
+    int nIdleMs = 300000;
+    if(pRb && GetResBufValue(pRb, nIdleMs) == RTNORM)
+        pRb = pRb->rbnext;
+
+    CShellOptions options;
+    if(nIdleMs <= 0 || GetShellOptions(pRb, options) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    if(!g_pShellPool)
+        g_pShellPool = new CShellPool;
+    if(g_pShellPool->Configure(sApplicationName.c_str(), sCommandLine.c_str(),
+        options, nSize, (DWORD) nIdleMs) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetT();
+    return RSRSLT;
+}
+
+/** \brief Sets the most memory the results of cached shells may use
+*	\param pRb a resbuf with the limit in bytes
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive a T as a returned value if the function succeeds,
+*	otherwise Nil is returned
+*
+*	Results are dropped least recently used first to get under a lower
+*	limit. A limit of 0 empties the cache and keeps nothing.
+*/
+static int SetShellCache(resbuf * pRb)
+{
+    int nLimit = 0;
+    if(GetResBufValue(pRb, nLimit) != RTNORM || nLimit < 0) {
+        acedRetNil();
+        return RSRSLT;
+    }
+    g_shellCache.SetLimit((size_t) nLimit);
+    acedRetT();
+    return RSRSLT;
+}
+
+/** \brief Drops results of cached shells
+*	\param pRb a resbuf with an optional application name, as given to
+*	OpenShell. Without it every result is dropped.
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive the number of results dropped.
+*/
+static int InvalidateShellCache(resbuf * pRb)
+{
+    TString sApplicationName;
+    if(pRb && GetResBufValue(pRb, sApplicationName) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+    acedRetInt(g_shellCache.Invalidate(pRb ? sApplicationName.c_str() : NULL));
+    return RSRSLT;
+}
+
+/** \brief Gets the counters the extension keeps
+*	\returns RTRSLT meaning a result is being returned.
+*
+*	Returns an association list of counter names and values.
+*/
+static int GetShellStats(resbuf * pRb)
+{
+    LONG nHits = 0, nMisses = 0, nFailures = 0;
+    int nIdle = 0;
+    DWORD dwPoolError = 0;
+    if(g_pShellPool) {
+        nHits = g_pShellPool->GetHits();
+        nMisses = g_pShellPool->GetMisses();
+        nIdle = g_pShellPool->GetIdleCount();
+        nFailures = g_pShellPool->GetFailures();
+        dwPoolError = g_pShellPool->GetLastFailure();
+    }
+
+    // the job counters are those of the current document
+    int nJobsQueued = 0, nJobsRunning = 0;
+    LONG nJobsCompleted = 0;
+    DWORD dwJobWait = 0, dwJobRun = 0;
+    const CShellJobQueue * pJobs = docShells.docData().FindJobQueue();
+    if(pJobs) {
+        nJobsQueued = pJobs->GetQueued();
+        nJobsRunning = pJobs->GetRunning();
+        nJobsCompleted = pJobs->GetCompleted();
+        dwJobWait = pJobs->GetAverageWait();
+        dwJobRun = pJobs->GetAverageRun();
+    }
+
+    // shells of closed drawings, the handle counts show a leak
+    int nReaperPending = 0;
+    LONG nReaperExited = 0, nReaperKilled = 0;
+    DWORD dwHandlesBefore = 0, dwHandlesAfter = 0, dwHandles = 0;
+    if(g_pShellReaper) {
+        nReaperPending = g_pShellReaper->GetPending();
+        nReaperExited = g_pShellReaper->GetExited();
+        nReaperKilled = g_pShellReaper->GetKilled();
+        dwHandlesBefore = g_pShellReaper->GetHandlesBefore();
+        dwHandlesAfter = g_pShellReaper->GetHandlesAfter();
+    }
+    GetProcessHandleCount(GetCurrentProcess(), &dwHandles);
+
+    resbuf * pStatsRb = acutBuildList(
+        RTLB, RTSTR, _T("poolhits"), RTLONG, nHits, RTDOTE,
+        RTLB, RTSTR, _T("poolmisses"), RTLONG, nMisses, RTDOTE,
+        RTLB, RTSTR, _T("poolidle"), RTLONG, nIdle, RTDOTE,
+        RTLB, RTSTR, _T("poolfailures"), RTLONG, nFailures, RTDOTE,
+        RTLB, RTSTR, _T("poolerror"), RTLONG, (long) dwPoolError, RTDOTE,
+        RTLB, RTSTR, _T("cachehits"), RTLONG, g_shellCache.GetHits(), RTDOTE,
+        RTLB, RTSTR, _T("cachemisses"), RTLONG, g_shellCache.GetMisses(), RTDOTE,
+        RTLB, RTSTR, _T("cacheentries"), RTLONG, g_shellCache.GetCount(), RTDOTE,
+        RTLB, RTSTR, _T("cachebytes"), RTLONG, (long) g_shellCache.GetBytes(), RTDOTE,
+        RTLB, RTSTR, _T("cacheevictions"), RTLONG, g_shellCache.GetEvictions(), RTDOTE,
+        RTLB, RTSTR, _T("batchwallms"), RTLONG, CShellBatch::GetLastWallTime(), RTDOTE,
+        RTLB, RTSTR, _T("batchserialms"), RTLONG, CShellBatch::GetLastSerialTime(), RTDOTE,
+        RTLB, RTSTR, _T("jobsqueued"), RTLONG, nJobsQueued, RTDOTE,
+        RTLB, RTSTR, _T("jobsrunning"), RTLONG, nJobsRunning, RTDOTE,
+        RTLB, RTSTR, _T("jobscompleted"), RTLONG, nJobsCompleted, RTDOTE,
+        RTLB, RTSTR, _T("jobwaitms"), RTLONG, dwJobWait, RTDOTE,
+        RTLB, RTSTR, _T("jobrunms"), RTLONG, dwJobRun, RTDOTE,
+        RTLB, RTSTR, _T("reaperpending"), RTLONG, nReaperPending, RTDOTE,
+        RTLB, RTSTR, _T("reaperexited"), RTLONG, nReaperExited, RTDOTE,
+        RTLB, RTSTR, _T("reaperkilled"), RTLONG, nReaperKilled, RTDOTE,
+        RTLB, RTSTR, _T("reaperhandlesbefore"), RTLONG, dwHandlesBefore, RTDOTE,
+        RTLB, RTSTR, _T("reaperhandlesafter"), RTLONG, dwHandlesAfter, RTDOTE,
+        RTLB, RTSTR, _T("handles"), RTLONG, dwHandles, RTDOTE,
+        0);
+    acedRetList(pStatsRb);
+    acutRelRb(pStatsRb);
+    return RSRSLT;
+}
+
+/** \brief Runs a list of commands several at a time
+*	\param pRb a resbuf with a list of (application commandline) lists,
+*	optionally followed by the most commands to run at once
+*	\returns RTRSLT meaning a result is being returned.
+*
+*	Each command is run like OpenShell, ReadShellAll and CloseShell would,
+*	but up to the given number of them (by default one per processor) run
+*	at the same time. Returns a list with one item per command, in input
+*	order: (exitcode string ...) with the command's stdout in 503 char
+*	pieces, or Nil for a command that could not be run. ESC terminates the
+*	running commands, they and the ones not started yet are returned as
+*	"cancelled" and the ones that had finished keep their results.
+*/
+static int RunShellBatch(resbuf * pRb)
+{
+    const resbuf * pArgs = pRb;
+    std::vector<CShellCommand> commands;
+    if(GetCommandList(pArgs, commands) != RTNORM || commands.empty()) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // get the optional worker count
+    int nWorkers = 0;
+    if(pArgs && GetResBufValue(pArgs, nWorkers) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    // after ESC the commands that finished still have their results
+    CShellBatch batch(commands, nWorkers);
+    int nResult = batch.Run();
+    if(nResult != RTNORM && nResult != RTCAN) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    resbuf * pHead = NULL, * pTail = NULL;
+    for(std::vector<CShellCommand>::iterator it = commands.begin(); it != commands.end(); ++it) {
+        if(AppendCommandResult(pHead, pTail, *it) != RTNORM) {
+            acedRetNil();
+            return RSRSLT;
+        }
+    }
+
+    acedRetList(pHead);
+    acutRelRb(pHead);
+    return RSRSLT;
+}
+
+/** \brief Queues a command to run in the background
+*	\param pRb a resbuf with the application name and command line strings,
+*	optionally followed by a priority
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive a job id if the function succeeds, otherwise Nil
+*	is returned
+*
+*	The command is run like OpenShell, ReadShellAll and CloseShell would, on
+*	one of the document's worker threads. Waiting jobs with a higher priority
+*	(default 0) start first. Jobs still waiting or running when the drawing
+*	closes are cancelled.
+*/
+static int SubmitShellJob(resbuf * pRb)
+{
+    TString sApplicationName, sCommandLine;
+    if(GetResBufValue(pRb, sApplicationName) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+    pRb = pRb->rbnext;
+    if(GetResBufValue(pRb, sCommandLine) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+    pRb = pRb->rbnext;
+
+    // get the optional priority
+    int nPriority = 0;
+    if(pRb && GetResBufValue(pRb, nPriority) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    int nJob = docShells.docData().GetJobQueue()->Submit(sApplicationName.c_str(),
+        sCommandLine.c_str(), nPriority);
+    if(!nJob) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetInt(nJob);
+    return RSRSLT;
+}
+
+/** \brief Gets the state of a background job
+*	\param pRb a resbuf containing the job id
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive "queued", "running", "done", "failed" or
+*	"cancelled", or Nil if the job id is not valid.
+*/
+static int PollShellJob(resbuf * pRb)
+{
+    int nJob = 0;
+    CShellJobQueue * pJobs = docShells.docData().GetJobQueue();
+    CShellJobQueue::JobState state;
+    if(GetResBufValue(pRb, nJob) != RTNORM || pJobs->Poll(nJob, state) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    switch(state) {
+    case CShellJobQueue::kQueued:
+        acedRetStr(_T("queued"));
+        break;
+    case CShellJobQueue::kRunning:
+        acedRetStr(_T("running"));
+        break;
+    case CShellJobQueue::kDone:
+        acedRetStr(_T("done"));
+        break;
+    case CShellJobQueue::kFailed:
+        acedRetStr(_T("failed"));
+        break;
+    default:
+        acedRetStr(_T("cancelled"));
+        break;
+    }
+    return RSRSLT;
+}
+
+/** \brief Gets the result of a finished background job
+*	\param pRb a resbuf containing the job id
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive (exitcode string ...) with the command's stdout in
+*	503 char pieces, otherwise Nil is returned.
+*
+*	Once a job has ended, failed or was cancelled its result can be taken
+*	once, after which the job id is no longer valid. Nil is returned while
+*	the job is still queued or running.
+*/
+static int GetShellJobResult(resbuf * pRb)
+{
+    int nJob = 0;
+    CShellCommand command;
+    if(GetResBufValue(pRb, nJob) != RTNORM
+        || docShells.docData().GetJobQueue()->GetResult(nJob, command) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    resbuf * pHead = NULL, * pTail = NULL;
+    if(AppendCommandResult(pHead, pTail, command) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetList(pHead);
+    acutRelRb(pHead);
+    return RSRSLT;
+}
+
+/** \brief Cancels a background job
+*	\param pRb a resbuf containing the job id
+*	\returns RTRSLT meaning a result is being returned. The calling Autolisp
+*	function will receive a T as a returned value if the job was queued or
+*	running, otherwise Nil is returned
+*
+*	A running job's processes are terminated. The job id stays valid until
+*	GetShellJobResult is called for it.
+*/
+static int CancelShellJob(resbuf * pRb)
+{
+    int nJob = 0;
+    if(GetResBufValue(pRb, nJob) != RTNORM
+        || docShells.docData().GetJobQueue()->Cancel(nJob) != RTNORM) {
+        acedRetNil();
+        return RSRSLT;
+    }
+
+    acedRetT();
+    return RSRSLT;
+}
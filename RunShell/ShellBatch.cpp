@@ -0,0 +1,178 @@
+/**	\file ShellBatch.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellBatch.cpp															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+#include "StdAfx.h"
+#include "ShellBatch.h"
+#include <process.h>
+#include <algorithm>
+
+#define BATCH_WAIT_INTERVAL 50
+
+int StartShellCommand( CShellCommand & command, const CShellOptions & options, CShellPipe & shell )
+{
+	command.nResult = RTERROR;
+	command.bCancelled = false;
+	command.dwExitCode = 0;
+	command.dwElapsed = 0;
+	command.output.clear();
+
+	// All of stdout ends up in memory anyway, and nothing reads stderr,
+	// so a buffer limit could only stall the command.
+	CShellOptions runOptions = options;
+	runOptions.bPumped = true;
+	runOptions.nBufferLimit = 0;
+	return shell.OpenShell(command.sApplicationName.c_str(), command.sCommandLine.c_str(), runOptions);
+}
+
+int FinishShellCommand( CShellCommand & command, CShellPipe & shell, DWORD dwStart )
+{
+	// no output at all is not an error
+	shell.ReadShellAll(command.output, false);
+	if(shell.WaitShell(INFINITE) != RTNORM || shell.GetShellExitCode(command.dwExitCode) != RTNORM)
+		return RTERROR;
+
+	command.dwElapsed = GetTickCount() - dwStart;
+	command.nResult = RTNORM;
+	return RTNORM;
+}
+
+
+DWORD CShellBatch::m_dwLastWallTime = 0;
+DWORD CShellBatch::m_dwLastSerialTime = 0;
+
+CShellBatch::CShellBatch( std::vector<CShellCommand> & commands, int nWorkers )
+: m_commands(commands)
+{
+	if(nWorkers <= 0) {
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		nWorkers = (int) info.dwNumberOfProcessors;
+	}
+	if(nWorkers > (int) commands.size())
+		nWorkers = (int) commands.size();
+	if(nWorkers > MAXIMUM_WAIT_OBJECTS)
+		nWorkers = MAXIMUM_WAIT_OBJECTS;
+	m_nWorkers = nWorkers;
+	m_nNext = -1;
+	m_bCancel = FALSE;
+	InitializeCriticalSection(&m_cs);
+}
+
+CShellBatch::~CShellBatch(void)
+{
+	DeleteCriticalSection(&m_cs);
+}
+
+int CShellBatch::Run( void )
+{
+	DWORD dwStart = GetTickCount();
+	for(size_t i = 0; i < m_commands.size(); ++i)
+		m_commands[i].nResult = RTERROR;
+
+	std::vector<HANDLE> threads;
+	for(int i = 0; i < m_nWorkers; ++i) {
+		unsigned nThreadId;
+		HANDLE hThread = (HANDLE) _beginthreadex(NULL, 0, WorkerThread, this, 0, &nThreadId);
+		if(hThread)
+			threads.push_back(hThread);
+	}
+	if(threads.empty() && !m_commands.empty())
+		return RTERROR;
+
+	// Wait in slices so ESC is noticed. On ESC no more commands are
+	// started and the running ones are killed, so the workers end soon.
+	while(!threads.empty()) {
+		DWORD dwWait = WaitForMultipleObjects((DWORD) threads.size(), &threads[0], TRUE, BATCH_WAIT_INTERVAL);
+		if(dwWait != WAIT_TIMEOUT)
+			break;
+		if(!m_bCancel && acedUsrBrk()) {
+			// a worker still opening its shell sees m_bCancel under the lock
+			EnterCriticalSection(&m_cs);
+			InterlockedExchange(&m_bCancel, TRUE);
+			for(size_t i = 0; i < m_running.size(); ++i)
+				m_running[i]->KillShell(ERROR_CANCELLED);
+			LeaveCriticalSection(&m_cs);
+		}
+	}
+	for(size_t i = 0; i < threads.size(); ++i)
+		CloseHandle(threads[i]);
+
+	m_dwLastWallTime = GetTickCount() - dwStart;
+	m_dwLastSerialTime = 0;
+	for(size_t i = 0; i < m_commands.size(); ++i)
+		m_dwLastSerialTime += m_commands[i].dwElapsed;
+
+	return m_bCancel ? RTCAN : RTNORM;
+}
+
+unsigned __stdcall CShellBatch::WorkerThread( void * pParam )
+{
+	CShellBatch * pThis = (CShellBatch *) pParam;
+
+	// acedUsrBrk may only be called from the AutoCAD main thread,
+	// Run checks for ESC on behalf of the workers.
+	CShellOptions options;
+	options.bCheckUserBreak = false;
+
+	for(;;) {
+		LONG nIndex = InterlockedIncrement(&pThis->m_nNext);
+		if(nIndex >= (LONG) pThis->m_commands.size())
+			break;
+
+		CShellCommand & command = pThis->m_commands[nIndex];
+		if(pThis->m_bCancel) {
+			command.bCancelled = true;
+			continue;
+		}
+		CShellPipe * pShell = new CShellPipe;
+		DWORD dwStart = GetTickCount();
+		if(StartShellCommand(command, options, *pShell) != RTNORM) {
+			delete pShell;
+			continue;
+		}
+
+		// KillShell can't stop a shell still being opened, so Run only
+		// sees the shell now. An ESC that came in meanwhile is seen here,
+		// under the lock Run kills with, so one of the two kills it.
+		EnterCriticalSection(&pThis->m_cs);
+		bool bCancel = pThis->m_bCancel != FALSE;
+		if(bCancel)
+			pShell->KillShell(ERROR_CANCELLED);
+		else
+			pThis->m_running.push_back(pShell);
+		LeaveCriticalSection(&pThis->m_cs);
+
+		if(!bCancel) {
+			int nResult = FinishShellCommand(command, *pShell, dwStart);
+			// A command Run killed ends with ERROR_CANCELLED and only part
+			// of its output. One that exited before the kill keeps its result.
+			EnterCriticalSection(&pThis->m_cs);
+			pThis->m_running.erase(std::find(pThis->m_running.begin(), pThis->m_running.end(), pShell));
+			bCancel = pThis->m_bCancel && (nResult != RTNORM || command.dwExitCode == ERROR_CANCELLED);
+			LeaveCriticalSection(&pThis->m_cs);
+		}
+		command.bCancelled = bCancel;
+		delete pShell;
+	}
+	return 0;
+}
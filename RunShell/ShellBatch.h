@@ -0,0 +1,116 @@
+/**	\file ShellBatch.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellBatch.h															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+#include <vector>
+#include "ShellPipe.h"
+
+/**	\brief An application and command line to run, and what it produced
+*/
+struct CShellCommand
+{
+	CShellCommand(void) { nResult = RTERROR; bCancelled = false; dwExitCode = 0; dwElapsed = 0; }
+
+	TString sApplicationName;		/**< as given to OpenShell */
+	TString sCommandLine;			/**< as given to OpenShell */
+	int nResult;					/**< RTNORM if the command ran to the end */
+	bool bCancelled;				/**< ESC stopped it, or kept it from starting */
+	DWORD dwExitCode;				/**< exit code of the process */
+	DWORD dwElapsed;				/**< milliseconds from start to exit */
+	std::vector<TString> output;	/**< stdout, in ADS_BUFFER_SIZE - 1 char pieces */
+};
+
+/**	\brief Starts one command, the first half of running it to completion
+*	\param[in,out] command the command to run, its results are cleared
+*	\param[in] options the options to open the shell with
+*	\param[in] shell the CShellPipe to open
+*	\returns RTNORM if the shell was opened, otherwise RTERROR
+*
+*	Opens the shell pumped, so a command writing lots of stderr can't stall.
+*	KillShell has nothing to terminate until this returns, so a shell must
+*	only be made known to a thread that may kill it afterwards.
+*/
+int StartShellCommand(CShellCommand & command, const CShellOptions & options, CShellPipe & shell);
+
+/**	\brief Finishes a command StartShellCommand started
+*	\param[in,out] command the command, receives the results
+*	\param[in] shell the shell StartShellCommand opened
+*	\param[in] dwStart GetTickCount before StartShellCommand was called
+*	\returns RTNORM if the command ran to the end, otherwise RTERROR
+*
+*	Reads all of stdout and waits for the process to exit.
+*/
+int FinishShellCommand(CShellCommand & command, CShellPipe & shell, DWORD dwStart);
+
+/**	\brief Runs a list of commands, several at a time
+*
+*	Each worker thread takes the next command not yet started, so at most
+*	nWorkers children run at once and the results stay in input order.
+*	Run blocks the calling thread until every command has finished, but
+*	the user can cancel it with ESC, which terminates the running children.
+*	The commands that finished before that keep their results.
+*/
+class CShellBatch
+{
+public:
+	/**	\param[in] commands the commands to run
+	*	\param[in] nWorkers the most commands to run at once, 0 for one per
+	*	processor
+	*/
+	CShellBatch(std::vector<CShellCommand> & commands, int nWorkers);
+	~CShellBatch(void);
+
+	/**	\brief Runs the commands
+	*	\returns RTNORM when every command has finished, RTCAN if the user
+	*	pressed ESC, otherwise RTERROR if the workers could not be started.
+	*
+	*	After ESC the commands that were killed or never started have
+	*	CShellCommand::bCancelled set, the others have their results.
+	*/
+	int Run(void);
+
+	/**	\brief Milliseconds the last batch took from start to end */
+	static DWORD GetLastWallTime(void) { return m_dwLastWallTime; }
+
+	/**	\brief Sum of the run times of the commands of the last batch, which
+	*	is about what running them one after the other would have taken.
+	*/
+	static DWORD GetLastSerialTime(void) { return m_dwLastSerialTime; }
+
+private:
+	CShellBatch(const CShellBatch &);
+	CShellBatch & operator=(const CShellBatch &);
+
+	static unsigned __stdcall WorkerThread(void * pParam);
+
+	std::vector<CShellCommand> & m_commands;
+	int m_nWorkers;
+	LONG m_nNext;						/**< Index of the next command to start, less one */
+	volatile LONG m_bCancel;			/**< Set when the user cancels, checked under m_cs before a shell is listed */
+	CRITICAL_SECTION m_cs;				/**< Guards m_running, and killing the shells in it */
+	std::vector<CShellPipe *> m_running;	/**< Shells running, so they can be killed */
+
+	static DWORD m_dwLastWallTime;
+	static DWORD m_dwLastSerialTime;
+};
@@ -0,0 +1,156 @@
+/**	\file ShellBuffer.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellBuffer.cpp															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+#include "StdAfx.h"
+#include "ShellBuffer.h"
+
+CShellBuffer::CShellBuffer(void)
+{
+	InitializeCriticalSection(&m_cs);
+	m_nHead = 0;
+	m_nLimit = 0;
+	m_bEof = false;
+	m_dwError = 0;
+	// manual reset, the event stays signaled for as long as there is
+	// something for the consumer to do.
+	m_hDataEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	// and this one for as long as the producer may go on
+	m_hRoomEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
+}
+
+CShellBuffer::~CShellBuffer(void)
+{
+	DeleteCriticalSection(&m_cs);
+}
+
+void CShellBuffer::Append( const char * pData, DWORD nSize )
+{
+	if(!nSize)
+		return;
+
+	EnterCriticalSection(&m_cs);
+	// Drop the consumed bytes before growing, so the vector only
+	// grows when the unread data actually needs the room.
+	if(m_nHead && m_nHead == m_data.size()) {
+		m_data.clear();
+		m_nHead = 0;
+	} else if(m_nHead > m_data.size() / 2) {
+		m_data.erase(m_data.begin(), m_data.begin() + m_nHead);
+		m_nHead = 0;
+	}
+	m_data.insert(m_data.end(), pData, pData + nSize);
+	SetEvent(m_hDataEvent.Handle());
+	if(m_nLimit && m_data.size() - m_nHead >= m_nLimit)
+		ResetEvent(m_hRoomEvent.Handle());
+	LeaveCriticalSection(&m_cs);
+}
+
+void CShellBuffer::SetEof( DWORD dwError )
+{
+	EnterCriticalSection(&m_cs);
+	m_bEof = true;
+	m_dwError = dwError;
+	SetEvent(m_hDataEvent.Handle());
+	LeaveCriticalSection(&m_cs);
+}
+
+int CShellBuffer::Read( char * pBuf, DWORD nMax, DWORD & nRead, DWORD dwTimeout )
+{
+	nRead = 0;
+	WaitForSingleObject(m_hDataEvent.Handle(), dwTimeout);
+
+	EnterCriticalSection(&m_cs);
+	size_t nAvailable = m_data.size() - m_nHead;
+	if(nAvailable) {
+		nRead = (DWORD) (nAvailable < nMax ? nAvailable : nMax);
+		memcpy(pBuf, &m_data[m_nHead], nRead);
+		m_nHead += nRead;
+	}
+	if(m_nHead == m_data.size() && !m_bEof)
+		ResetEvent(m_hDataEvent.Handle());
+	if(m_data.size() - m_nHead < m_nLimit)
+		SetEvent(m_hRoomEvent.Handle());
+	bool bEof = m_bEof;
+	LeaveCriticalSection(&m_cs);
+
+	if(!nRead)
+		return bEof ? RTERROR : RTNONE;
+	return RTNORM;
+}
+
+DWORD CShellBuffer::GetSize( void ) const
+{
+	EnterCriticalSection(&m_cs);
+	DWORD nSize = (DWORD) (m_data.size() - m_nHead);
+	LeaveCriticalSection(&m_cs);
+	return nSize;
+}
+
+void CShellBuffer::SetLimit( DWORD nLimit )
+{
+	EnterCriticalSection(&m_cs);
+	m_nLimit = nLimit;
+	if(m_nLimit && m_data.size() - m_nHead >= m_nLimit)
+		ResetEvent(m_hRoomEvent.Handle());
+	else
+		SetEvent(m_hRoomEvent.Handle());
+	LeaveCriticalSection(&m_cs);
+}
+
+bool CShellBuffer::IsFull( void ) const
+{
+	EnterCriticalSection(&m_cs);
+	bool bFull = m_nLimit && m_data.size() - m_nHead >= m_nLimit;
+	LeaveCriticalSection(&m_cs);
+	return bFull;
+}
+
+void CShellBuffer::GetData( std::string & sData ) const
+{
+	EnterCriticalSection(&m_cs);
+	if(m_nHead < m_data.size())
+		sData.assign(&m_data[m_nHead], m_data.size() - m_nHead);
+	else
+		sData.erase();
+	LeaveCriticalSection(&m_cs);
+}
+
+void CShellBuffer::Reset( void )
+{
+	EnterCriticalSection(&m_cs);
+	m_data.clear();
+	m_nHead = 0;
+	m_bEof = false;
+	m_dwError = 0;
+	ResetEvent(m_hDataEvent.Handle());
+	SetEvent(m_hRoomEvent.Handle());
+	LeaveCriticalSection(&m_cs);
+}
+
+bool CShellBuffer::IsEof( void ) const
+{
+	EnterCriticalSection(&m_cs);
+	bool bEof = m_bEof && m_nHead == m_data.size();
+	LeaveCriticalSection(&m_cs);
+	return bEof;
+}
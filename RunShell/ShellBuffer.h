@@ -0,0 +1,122 @@
+/**	\file ShellBuffer.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellBuffer.h															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+#include <vector>
+#include <string>
+#include "ShellHandle.h"
+
+/**	\brief Thread safe first in, first out byte buffer
+*
+*	A producer thread (usually the pump thread of a CShellPipe) appends
+*	the bytes it reads from a pipe, and the consumer (the Autolisp side)
+*	takes them out again. When the producer reaches the end of its stream
+*	it calls SetEof, after which Read returns whatever is left and then
+*	fails.
+*
+*	With a limit set the producer stops taking data from its pipe once
+*	that many bytes are waiting, so a child that writes faster than the
+*	consumer reads stalls on the full pipe instead of filling memory.
+*	The room event tells the producer when to carry on.
+*
+*	The class only depends on Win32, so it can be exercised on its own
+*	against any local child process.
+*/
+class CShellBuffer
+{
+public:
+	CShellBuffer(void);
+	~CShellBuffer(void);
+
+	/**	\brief Appends bytes to the end of the buffer
+	*	\param[in] pData the bytes to append
+	*	\param[in] nSize number of bytes in pData
+	*
+	*	Wakes any consumer blocked in Read.
+	*/
+	void Append(const char * pData, DWORD nSize);
+
+	/**	\brief Marks the end of the stream
+	*	\param[in] dwError the error that ended the stream, 0 or
+	*	ERROR_BROKEN_PIPE for a normal end of stream.
+	*/
+	void SetEof(DWORD dwError);
+
+	/**	\brief Takes bytes from the front of the buffer
+	*	\param[out] pBuf receives the bytes
+	*	\param[in] nMax size of pBuf
+	*	\param[out] nRead number of bytes placed into pBuf
+	*	\param[in] dwTimeout milliseconds to wait for data to arrive
+	*	\returns RTNORM if bytes were read, RTNONE if no bytes arrived
+	*	within dwTimeout, otherwise RTERROR if the stream has ended and
+	*	the buffer is empty.
+	*/
+	int Read(char * pBuf, DWORD nMax, DWORD & nRead, DWORD dwTimeout = INFINITE);
+
+	/**	\brief Number of bytes waiting to be read */
+	DWORD GetSize(void) const;
+
+	/**	\brief Sets the high-water mark
+	*	\param[in] nLimit bytes waiting to be read at which the producer
+	*	stops reading, 0 for no limit
+	*/
+	void SetLimit(DWORD nLimit);
+
+	/**	\brief true while the limit is reached and the producer must wait */
+	bool IsFull(void) const;
+
+	/**	\brief Event signaled while the buffer is below its limit, for the
+	*	producer to wait on when IsFull
+	*/
+	HANDLE GetRoomEvent(void) { return m_hRoomEvent.Handle(); }
+
+	/**	\brief Copies the bytes waiting to be read, without taking them out
+	*	\param[out] sData receives the bytes
+	*/
+	void GetData(std::string & sData) const;
+
+	/**	\brief Empties the buffer and clears the end of stream, for a
+	*	producer that starts over
+	*/
+	void Reset(void);
+
+	/**	\brief true once SetEof has been called and all data has been read */
+	bool IsEof(void) const;
+
+	/**	\brief The error value passed to SetEof */
+	DWORD GetError(void) const { return m_dwError; }
+
+private:
+	CShellBuffer(const CShellBuffer &);
+	CShellBuffer & operator=(const CShellBuffer &);
+
+	mutable CRITICAL_SECTION m_cs;	/**< Guards every member below */
+	std::vector<char> m_data;		/**< Buffered bytes, valid from m_nHead to the end */
+	size_t m_nHead;					/**< Offset of the first unread byte in m_data */
+	DWORD m_nLimit;					/**< High-water mark, 0 for none */
+	bool m_bEof;					/**< Producer has finished */
+	DWORD m_dwError;				/**< Reason the producer finished */
+	CShellHandle m_hDataEvent;		/**< Signaled while data is waiting or at eof */
+	CShellHandle m_hRoomEvent;		/**< Signaled while below m_nLimit */
+};
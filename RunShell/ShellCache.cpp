@@ -0,0 +1,200 @@
+/**	\file ShellCache.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellCache.cpp															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+#include "StdAfx.h"
+#include "ShellCache.h"
+#include <tchar.h>
+#include <stdio.h>
+
+#define DEFAULT_CACHE_LIMIT 16777216	// bytes of output kept until SetShellCache changes it
+#define ENTRY_OVERHEAD 128				// bytes counted for each entry besides its strings
+
+CShellCache g_shellCache;
+
+// 64 bit FNV-1a, enough to tell the stdin of one call from another
+static ULONGLONG Fnv1a(const char * pData, size_t nSize)
+{
+	ULONGLONG nHash = 14695981039346656037ULL;
+	for(size_t i = 0; i < nSize; ++i) {
+		nHash ^= (unsigned char) pData[i];
+		nHash *= 1099511628211ULL;
+	}
+	return nHash;
+}
+
+CShellCache::CShellCache(void)
+{
+	InitializeCriticalSection(&m_cs);
+	m_nLimit = DEFAULT_CACHE_LIMIT;
+	m_nBytes = 0;
+	m_nHits = 0;
+	m_nMisses = 0;
+	m_nEvictions = 0;
+}
+
+CShellCache::~CShellCache(void)
+{
+	DeleteCriticalSection(&m_cs);
+}
+
+TString CShellCache::MakeKey( const std::vector<TString> & applicationNames,
+							 const std::vector<TString> & commandLines, const CShellOptions & options,
+							 const std::string & sInput )
+{
+	TString sKey;
+	for(size_t i = 0; i < applicationNames.size(); ++i) {
+		sKey += applicationNames[i];
+		sKey += _T('\n');
+		sKey += commandLines[i];
+		sKey += _T('\n');
+	}
+	sKey += options.bMerged ? _T('m') : _T('-');
+	sKey += _T('\n');
+	sKey += options.sDirectory;
+	sKey += _T('\n');
+	for(size_t i = 0; i < options.environment.size(); ++i) {
+		sKey += options.environment[i];
+		sKey += _T('\n');
+	}
+
+	TCHAR szValue[64];
+	_stprintf(szValue, _T("%016I64x,%Iu\n"), Fnv1a(sInput.data(), sInput.size()), sInput.size());
+	sKey += szValue;
+
+	// a file that doesn't exist is part of the key too
+	for(size_t i = 0; i < options.dependencies.size(); ++i) {
+		sKey += options.dependencies[i];
+		WIN32_FILE_ATTRIBUTE_DATA data;
+		if(GetFileAttributesEx(options.dependencies[i].c_str(), GetFileExInfoStandard, &data))
+			_stprintf(szValue, _T("|%08lx%08lx,%08lx%08lx\n"), data.ftLastWriteTime.dwHighDateTime,
+				data.ftLastWriteTime.dwLowDateTime, data.nFileSizeHigh, data.nFileSizeLow);
+		else
+			_tcscpy(szValue, _T("|-\n"));
+		sKey += szValue;
+	}
+	return sKey;
+}
+
+bool CShellCache::Lookup( const TString & sKey, std::string & sStdout, std::string & sStderr,
+						 std::vector<DWORD> & exitCodes )
+{
+	EnterCriticalSection(&m_cs);
+	Index::iterator it = m_index.find(sKey);
+	bool bHit = it != m_index.end();
+	if(bHit) {
+		// move it to the front, it is now the most recently used
+		m_entries.splice(m_entries.begin(), m_entries, it->second);
+		sStdout = it->second->sStdout;
+		sStderr = it->second->sStderr;
+		exitCodes = it->second->exitCodes;
+		++m_nHits;
+	} else
+		++m_nMisses;
+	LeaveCriticalSection(&m_cs);
+	return bHit;
+}
+
+void CShellCache::Store( const TString & sKey, const TString & sApplicationName, const std::string & sStdout,
+						const std::string & sStderr, const std::vector<DWORD> & exitCodes )
+{
+	size_t nBytes = (sKey.size() + sApplicationName.size()) * sizeof(TCHAR) + sStdout.size()
+		+ sStderr.size() + exitCodes.size() * sizeof(DWORD) + ENTRY_OVERHEAD;
+
+	EnterCriticalSection(&m_cs);
+	// two shells may have missed the same key and both run
+	Index::iterator it = m_index.find(sKey);
+	if(it != m_index.end())
+		Erase(it->second);
+	if(nBytes <= m_nLimit) {
+		Trim(m_nLimit - nBytes);
+		m_entries.push_front(Entry());
+		Entry & entry = m_entries.front();
+		entry.sKey = sKey;
+		entry.sApplicationName = sApplicationName;
+		entry.sStdout = sStdout;
+		entry.sStderr = sStderr;
+		entry.exitCodes = exitCodes;
+		entry.nBytes = nBytes;
+		m_index[sKey] = m_entries.begin();
+		m_nBytes += nBytes;
+	}
+	LeaveCriticalSection(&m_cs);
+}
+
+void CShellCache::SetLimit( size_t nLimit )
+{
+	EnterCriticalSection(&m_cs);
+	m_nLimit = nLimit;
+	Trim(nLimit);
+	LeaveCriticalSection(&m_cs);
+}
+
+int CShellCache::Invalidate( const TCHAR * pcszApplicationName )
+{
+	int nDropped = 0;
+	EnterCriticalSection(&m_cs);
+	Entries::iterator it = m_entries.begin();
+	while(it != m_entries.end()) {
+		Entries::iterator itNext = it;
+		++itNext;
+		if(!pcszApplicationName || !_tcsicmp(it->sApplicationName.c_str(), pcszApplicationName)) {
+			Erase(it);
+			++nDropped;
+		}
+		it = itNext;
+	}
+	LeaveCriticalSection(&m_cs);
+	return nDropped;
+}
+
+int CShellCache::GetCount( void ) const
+{
+	EnterCriticalSection(&m_cs);
+	int nCount = (int) m_index.size();
+	LeaveCriticalSection(&m_cs);
+	return nCount;
+}
+
+size_t CShellCache::GetBytes( void ) const
+{
+	EnterCriticalSection(&m_cs);
+	size_t nBytes = m_nBytes;
+	LeaveCriticalSection(&m_cs);
+	return nBytes;
+}
+
+void CShellCache::Trim( size_t nLimit )
+{
+	while(m_nBytes > nLimit && !m_entries.empty()) {
+		Entries::iterator it = m_entries.end();
+		Erase(--it);
+		++m_nEvictions;
+	}
+}
+
+void CShellCache::Erase( Entries::iterator it )
+{
+	m_nBytes -= it->nBytes;
+	m_index.erase(it->sKey);
+	m_entries.erase(it);
+}
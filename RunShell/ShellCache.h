@@ -0,0 +1,133 @@
+/**	\file ShellCache.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellCache.h															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include "ShellOptions.h"
+
+/**	\brief Keeps the output of shells opened with the "cached" option
+*	\note THERE SHOULD ONLY BE ONE INSTANCE OF THIS CLASS
+*
+*	Scripts run the same read-only commands over and over, a directory
+*	listing or a "git rev-parse" for every drawing opened. A cached shell
+*	looks its result up when it is first read, and only runs when the
+*	result isn't there. The key holds the stages, the options that change
+*	what a command outputs, a digest of everything written to stdin and
+*	the modification time of each file named with "depends".
+*
+*	Entries are dropped least recently used first once the output they
+*	hold goes over the memory limit. Safe to use from any thread.
+*/
+class CShellCache
+{
+public:
+	CShellCache(void);
+	~CShellCache(void);
+
+	/**	\brief Builds the key a result is stored under
+	*	\param[in] applicationNames the application of each stage
+	*	\param[in] commandLines the command line of each stage
+	*	\param[in] options the options the shell was opened with
+	*	\param[in] sInput the bytes written to stdin
+	*	\returns the key
+	*
+	*	Reads the modification time of every file in options.dependencies,
+	*	so the key changes when one of them does.
+	*/
+	static TString MakeKey(const std::vector<TString> & applicationNames,
+		const std::vector<TString> & commandLines, const CShellOptions & options,
+		const std::string & sInput);
+
+	/**	\brief Looks a result up
+	*	\param[in] sKey the key from MakeKey
+	*	\param[out] sStdout, sStderr the output stored
+	*	\param[out] exitCodes the exit code of each stage
+	*	\returns true on a hit
+	*/
+	bool Lookup(const TString & sKey, std::string & sStdout, std::string & sStderr,
+		std::vector<DWORD> & exitCodes);
+
+	/**	\brief Stores a result, dropping old ones to stay under the limit
+	*	\param[in] sKey the key from MakeKey
+	*	\param[in] sApplicationName the first stage's application, for Invalidate
+	*	\param[in] sStdout, sStderr the output
+	*	\param[in] exitCodes the exit code of each stage
+	*
+	*	A result bigger than the whole limit is not stored.
+	*/
+	void Store(const TString & sKey, const TString & sApplicationName, const std::string & sStdout,
+		const std::string & sStderr, const std::vector<DWORD> & exitCodes);
+
+	/**	\brief Sets the most bytes the entries may hold, 0 stores nothing */
+	void SetLimit(size_t nLimit);
+
+	/**	\brief Drops entries
+	*	\param[in] pcszApplicationName drop the entries of this application,
+	*	as given to OpenShell, NULL for all of them
+	*	\returns the number of entries dropped
+	*/
+	int Invalidate(const TCHAR * pcszApplicationName);
+
+	LONG GetHits(void) const { return m_nHits; }			/**< Lookups that found a result */
+	LONG GetMisses(void) const { return m_nMisses; }		/**< Lookups that found nothing */
+	LONG GetEvictions(void) const { return m_nEvictions; }	/**< Entries dropped for the limit */
+	int GetCount(void) const;		/**< Number of entries */
+	size_t GetBytes(void) const;	/**< Bytes the entries hold */
+
+private:
+	CShellCache(const CShellCache &);
+	CShellCache & operator=(const CShellCache &);
+
+	struct Entry
+	{
+		TString sKey;
+		TString sApplicationName;
+		std::string sStdout;
+		std::string sStderr;
+		std::vector<DWORD> exitCodes;
+		size_t nBytes;					/**< What the entry counts against the limit */
+	};
+	typedef std::list<Entry> Entries;
+	typedef std::map<TString, Entries::iterator> Index;
+
+	/**	\brief Drops the least recently used entries until m_nBytes fits nLimit, m_cs must be held */
+	void Trim(size_t nLimit);
+
+	/**	\brief Drops one entry, m_cs must be held */
+	void Erase(Entries::iterator it);
+
+	mutable CRITICAL_SECTION m_cs;	/**< Guards the members below */
+	Entries m_entries;				/**< Most recently used first */
+	Index m_index;					/**< m_entries by key */
+	size_t m_nLimit;
+	size_t m_nBytes;
+	LONG m_nHits;
+	LONG m_nMisses;
+	LONG m_nEvictions;
+};
+
+extern CShellCache g_shellCache;
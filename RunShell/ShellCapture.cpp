@@ -0,0 +1,238 @@
+/**	\file ShellCapture.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellCapture.cpp														*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+#include "StdAfx.h"
+#include "ShellCapture.h"
+#include "LineScanner.h"
+#include <algorithm>
+
+// Bytes mapped at once. Reads of a range in the same window share its
+// view, only a single line longer than this gets a bigger one.
+#define CAPTURE_WINDOW (4 * 1024 * 1024)
+
+CShellCapture::CShellCapture( TextEncoding encoding )
+: m_decoder(encoding)
+{
+	m_pView = NULL;
+	m_nViewOffset = 0;
+	m_nViewSize = 0;
+	m_nSize = 0;
+	m_nIndexed = 0;
+	m_nScanned = 0;
+}
+
+CShellCapture::~CShellCapture(void)
+{
+	if(m_pView)
+		UnmapViewOfFile(m_pView);
+}
+
+int CShellCapture::Open( const TCHAR * pcszPath )
+{
+	// the child may still be writing the file
+	m_hFile = CreateFile(pcszPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(m_hFile.Handle() == INVALID_HANDLE_VALUE) {
+		m_hFile.Handle() = NULL;
+		return RTERROR;
+	}
+	return Refresh();
+}
+
+int CShellCapture::Refresh( void )
+{
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(m_hFile.Handle(), &size))
+		return RTERROR;
+	if((ULONGLONG) size.QuadPart <= m_nSize)
+		return RTNORM;
+
+	// A mapping can't grow, so create it again for the new size. Nothing
+	// is mapped into memory yet, MapRange does that for what is read. An
+	// empty file can't be mapped at all, m_hMapping stays closed until
+	// the file has data.
+	if(m_pView) {
+		UnmapViewOfFile(m_pView);
+		m_pView = NULL;
+	}
+	m_hMapping.CloseHandle();
+	m_hMapping = CreateFileMapping(m_hFile.Handle(), NULL, PAGE_READONLY,
+		size.HighPart, size.LowPart, NULL);
+	if(!m_hMapping.IsValid())
+		return RTERROR;
+	m_nSize = (ULONGLONG) size.QuadPart;
+	return RTNORM;
+}
+
+const char * CShellCapture::MapRange( ULONGLONG nOffset, ULONGLONG nLength )
+{
+	if(m_pView && nOffset >= m_nViewOffset && nOffset + nLength <= m_nViewOffset + m_nViewSize)
+		return m_pView + (nOffset - m_nViewOffset);
+
+	if(m_pView) {
+		UnmapViewOfFile(m_pView);
+		m_pView = NULL;
+	}
+	if(!m_hMapping.IsValid() || nOffset + nLength > m_nSize)
+		return NULL;
+
+	// a view starts at a multiple of the allocation granularity
+	static DWORD dwGranularity = 0;
+	if(!dwGranularity) {
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		dwGranularity = info.dwAllocationGranularity;
+	}
+	ULONGLONG nViewOffset = nOffset - nOffset % dwGranularity;
+	ULONGLONG nViewSize = nOffset - nViewOffset + nLength;
+	if(nViewSize < CAPTURE_WINDOW)
+		nViewSize = CAPTURE_WINDOW;
+	if(nViewSize > m_nSize - nViewOffset)
+		nViewSize = m_nSize - nViewOffset;
+	if(nViewSize != (SIZE_T) nViewSize) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+
+	m_pView = (const char *) MapViewOfFile(m_hMapping.Handle(), FILE_MAP_READ,
+		(DWORD) (nViewOffset >> 32), (DWORD) nViewOffset, (SIZE_T) nViewSize);
+	if(!m_pView)
+		return NULL;
+	m_nViewOffset = nViewOffset;
+	m_nViewSize = nViewSize;
+	return m_pView + (nOffset - m_nViewOffset);
+}
+
+int CShellCapture::IndexLines( void )
+{
+	bool bUtf16 = m_decoder.GetEncoding() == kEncodingUtf16;
+	while(m_nScanned < m_nSize) {
+		// one window at a time, plus the byte after it, which UTF-16
+		// needs to tell a line feed from the low byte of another character
+		ULONGLONG nEnd = m_nSize - m_nScanned > CAPTURE_WINDOW ? m_nScanned + CAPTURE_WINDOW : m_nSize;
+		const char * pWindow = MapRange(m_nScanned, (nEnd < m_nSize ? nEnd + 1 : nEnd) - m_nScanned);
+		if(!pWindow)
+			return RTERROR;
+		const char * pEnd = pWindow + (nEnd - m_nScanned);
+		for(const char * p = pWindow;;) {
+			const char * pNewline = FindNewline(p, pEnd);
+			if(pNewline == pEnd)
+				break;
+			ULONGLONG nNewline = m_nScanned + (pNewline - pWindow);
+			p = pNewline + 1;
+			if(bUtf16) {
+				// in UTF-16 a line feed is "\n\0" at an even offset, one
+				// in the last byte of the file is looked at again later
+				if(nNewline + 1 == m_nSize) {
+					m_nScanned = nNewline;
+					return RTNORM;
+				}
+				if(nNewline % 2 || pNewline[1])
+					continue;
+			}
+			m_lines.push_back(m_nIndexed);
+			m_nIndexed = nNewline + (bUtf16 ? 2 : 1);
+		}
+		m_nScanned = nEnd;
+	}
+	return RTNORM;
+}
+
+size_t CShellCapture::LineCount( void ) const
+{
+	return m_lines.size() + (m_nIndexed < m_nSize ? 1 : 0);
+}
+
+int CShellCapture::GetSize( ULONGLONG & nSize, size_t & nLines )
+{
+	if(Refresh() != RTNORM || IndexLines() != RTNORM)
+		return RTERROR;
+	nSize = m_nSize;
+	nLines = LineCount();
+	return RTNORM;
+}
+
+int CShellCapture::ReadLines( size_t nFirst, size_t nCount, std::vector<TString> & lines )
+{
+	lines.clear();
+	if(Refresh() != RTNORM || IndexLines() != RTNORM)
+		return RTERROR;
+
+	size_t nLines = LineCount();
+	if(nFirst >= nLines)
+		return RTERROR;
+	if(!nCount || nCount > nLines - nFirst)
+		nCount = nLines - nFirst;
+
+	bool bUtf16 = m_decoder.GetEncoding() == kEncodingUtf16;
+	lines.resize(nCount);
+	for(size_t i = 0; i < nCount; ++i) {
+		// a line ends where the next one starts, less its line feed
+		size_t nLine = nFirst + i;
+		ULONGLONG nLineOffset, nNewline;
+		if(nLine < m_lines.size()) {
+			nLineOffset = m_lines[nLine];
+			ULONGLONG nNext = nLine + 1 < m_lines.size() ? m_lines[nLine + 1] : m_nIndexed;
+			nNewline = nNext - (bUtf16 ? 2 : 1);
+		} else {
+			nLineOffset = m_nIndexed; // the last line, with no line end
+			nNewline = m_nSize;
+		}
+		if(nNewline == nLineOffset)
+			continue;
+
+		// consecutive lines are mostly in the window already mapped
+		const char * pLine = MapRange(nLineOffset, nNewline - nLineOffset);
+		if(!pLine) {
+			lines.clear();
+			return RTERROR;
+		}
+		const char * pNewline = pLine + (size_t) (nNewline - nLineOffset);
+		size_t nLength = pNewline - pLine;
+		if(bUtf16) {
+			if(nLength >= 2 && pNewline[-2] == '\r' && !pNewline[-1])
+				nLength -= 2;
+		} else
+			nLength = LineLength(pLine, pNewline);
+		m_decoder.Reset();
+		m_decoder.Decode(pLine, nLength, lines[i], true);
+	}
+	return RTNORM;
+}
+
+int CShellCapture::ReadBytes( ULONGLONG nOffset, DWORD nLength, TString & sResults )
+{
+	sResults.erase();
+	if(Refresh() != RTNORM)
+		return RTERROR;
+	if(nOffset >= m_nSize)
+		return RTERROR;
+
+	size_t nBytes = (size_t) std::min<ULONGLONG>(nLength, m_nSize - nOffset);
+	const char * pBytes = MapRange(nOffset, nBytes);
+	if(!pBytes)
+		return RTERROR;
+	m_decoder.Reset();
+	m_decoder.Decode(pBytes, nBytes, sResults, true);
+	return RTNORM;
+}
@@ -0,0 +1,111 @@
+/**	\file ShellCapture.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellCapture.h															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+#include <vector>
+#include "ShellHandle.h"
+#include "TextDecoder.h"
+
+/**	\brief Reads lines and byte ranges of a captured output file
+*
+*	A shell opened with the "stdout" or "stderr" option writes that stream
+*	straight into a file. CShellCapture indexes its lines as they are asked
+*	for, so any line or byte range can be read without reading the file
+*	from the start. Only a window of the file around what is being read is
+*	mapped, so a large file doesn't take up the address space. The file may
+*	still be growing, each read first looks for what the child has added
+*	since, and only that is indexed.
+*/
+class CShellCapture
+{
+public:
+	CShellCapture(TextEncoding encoding = kEncodingUtf8);
+	~CShellCapture(void);
+
+	/**	\brief Opens the file
+	*	\param[in] pcszPath the file
+	*	\returns RTNORM if successful, otherwise RTERROR
+	*/
+	int Open(const TCHAR * pcszPath);
+
+	/**	\brief Gets the size of the file and the number of lines in it
+	*	\param[out] nSize bytes in the file
+	*	\param[out] nLines lines in the file, the last one may not have a line end
+	*	\returns RTNORM if successful, otherwise RTERROR
+	*/
+	int GetSize(ULONGLONG & nSize, size_t & nLines);
+
+	/**	\brief Reads lines
+	*	\param[in] nFirst index of the first line, 0 for the first line of the file
+	*	\param[in] nCount most lines to read, 0 to read to the end of the file
+	*	\param[out] lines the lines without their line ends
+	*	\returns RTNORM if at least one line was read, otherwise RTERROR
+	*	for errors or if nFirst is past the last line.
+	*/
+	int ReadLines(size_t nFirst, size_t nCount, std::vector<TString> & lines);
+
+	/**	\brief Reads a byte range as text
+	*	\param[in] nOffset the first byte
+	*	\param[in] nLength most bytes to read
+	*	\param[out] sResults the text
+	*	\returns RTNORM if at least one byte was read, otherwise RTERROR for
+	*	errors or if nOffset is past the end of the file.
+	*/
+	int ReadBytes(ULONGLONG nOffset, DWORD nLength, TString & sResults);
+
+private:
+	CShellCapture(const CShellCapture &);
+	CShellCapture & operator=(const CShellCapture &);
+
+	/**	\brief Gets the size of the file again, and a new mapping if it has grown */
+	int Refresh(void);
+
+	/**	\brief Maps a byte range of the file
+	*	\param[in] nOffset the first byte
+	*	\param[in] nLength bytes that have to be mapped from nOffset on
+	*	\returns pointer to the byte at nOffset, or NULL for errors. It is
+	*	valid until the next call, which reuses the view if it covers the range.
+	*/
+	const char * MapRange(ULONGLONG nOffset, ULONGLONG nLength);
+
+	/**	\brief Indexes the lines ended since the last call, only the
+	*	bytes added since then are scanned
+	*	\returns RTNORM if successful, otherwise RTERROR
+	*/
+	int IndexLines(void);
+
+	/**	\brief Gets the number of lines, counting a last line with no line end */
+	size_t LineCount(void) const;
+
+	CShellHandle m_hFile;
+	CShellHandle m_hMapping;
+	const char * m_pView;			/**< The mapped window, NULL for none */
+	ULONGLONG m_nViewOffset;		/**< Offset of the window in the file */
+	ULONGLONG m_nViewSize;			/**< Bytes in the window */
+	ULONGLONG m_nSize;				/**< Size of the file when it was last refreshed */
+	std::vector<ULONGLONG> m_lines;	/**< Offset of each line that has a line end */
+	ULONGLONG m_nIndexed;			/**< Offset of the first line without a line end yet */
+	ULONGLONG m_nScanned;			/**< Offset of the first byte not searched for line feeds */
+	CTextDecoder m_decoder;
+};
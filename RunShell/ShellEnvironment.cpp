@@ -0,0 +1,177 @@
+/**	\file ShellEnvironment.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellEnvironment.cpp													*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+#include "StdAfx.h"
+#include "ShellEnvironment.h"
+#include <tchar.h>
+#include <algorithm>
+
+// Most entries kept in each cache. A full cache is emptied and filled
+// again, scripts use a handful of override sets and application names.
+#define MAX_CACHED_BLOCKS 32
+#define MAX_CACHED_EXPANSIONS 256
+
+CShellEnvironment g_shellEnvironment;
+
+// Length of the name in a "NAME=VALUE" entry. The names Windows keeps for
+// the current directory of each drive start with '=', so the search for
+// the separator starts after the first character.
+static size_t NameLength(const TString & sEntry)
+{
+	size_t nEqual = sEntry.find(_T('='), 1);
+	return nEqual == TString::npos ? sEntry.size() : nEqual;
+}
+
+// Compares the names of two entries, ignoring case
+static int CompareNames(const TString & sLeft, const TString & sRight)
+{
+	size_t nLeft = NameLength(sLeft), nRight = NameLength(sRight);
+	for(size_t i = 0; i < nLeft && i < nRight; ++i) {
+		TCHAR cLeft = (TCHAR) _totupper(sLeft[i]), cRight = (TCHAR) _totupper(sRight[i]);
+		if(cLeft != cRight)
+			return cLeft < cRight ? -1 : 1;
+	}
+	return nLeft == nRight ? 0 : (nLeft < nRight ? -1 : 1);
+}
+
+// CreateProcess wants the entries sorted by name, ignoring case
+static bool NameLess(const TString & sLeft, const TString & sRight)
+{
+	return CompareNames(sLeft, sRight) < 0;
+}
+
+CShellEnvironment::CShellEnvironment(void)
+{
+	InitializeCriticalSection(&m_cs);
+}
+
+CShellEnvironment::~CShellEnvironment(void)
+{
+	DeleteCriticalSection(&m_cs);
+}
+
+int CShellEnvironment::GetBlock( const std::vector<TString> & overrides, std::vector<TCHAR> & block )
+{
+	// The key is the overrides as given, one per line. The same
+	// variables set in another order build a block of their own.
+	TString sKey;
+	for(size_t i = 0; i < overrides.size(); ++i) {
+		sKey += overrides[i];
+		sKey += _T('\n');
+	}
+
+	EnterCriticalSection(&m_cs);
+	Blocks::iterator it = m_blocks.find(sKey);
+	if(it == m_blocks.end()) {
+		std::vector<TCHAR> newBlock;
+		if(BuildBlock(overrides, newBlock) != RTNORM) {
+			LeaveCriticalSection(&m_cs);
+			return RTERROR;
+		}
+		if(m_blocks.size() >= MAX_CACHED_BLOCKS)
+			m_blocks.clear();
+		it = m_blocks.insert(Blocks::value_type(sKey, std::vector<TCHAR>())).first;
+		it->second.swap(newBlock);
+	}
+	block = it->second;
+	LeaveCriticalSection(&m_cs);
+	return RTNORM;
+}
+
+int CShellEnvironment::Expand( const TCHAR * pcszSource, TString & sExpanded )
+{
+	EnterCriticalSection(&m_cs);
+	Expansions::const_iterator it = m_expanded.find(pcszSource);
+	if(it != m_expanded.end()) {
+		sExpanded = it->second;
+		LeaveCriticalSection(&m_cs);
+		return RTNORM;
+	}
+	LeaveCriticalSection(&m_cs);
+
+	DWORD dwSize = ExpandEnvironmentStrings(pcszSource, NULL, 0);
+	if(dwSize == 0)
+		return RTERROR;
+	TString sResult(dwSize, _T('\0'));
+	dwSize = ExpandEnvironmentStrings(pcszSource, &sResult[0], dwSize);
+	if(dwSize == 0)
+		return RTERROR;
+	sResult.resize(_tcslen(sResult.c_str()));
+
+	EnterCriticalSection(&m_cs);
+	if(m_expanded.size() >= MAX_CACHED_EXPANSIONS)
+		m_expanded.clear();
+	m_expanded[pcszSource] = sResult;
+	LeaveCriticalSection(&m_cs);
+
+	sExpanded.swap(sResult);
+	return RTNORM;
+}
+
+int CShellEnvironment::BuildBlock( const std::vector<TString> & overrides, std::vector<TCHAR> & block )
+{
+	// Read AutoCAD's environment, one entry per string
+#ifdef _UNICODE
+	LPWCH pEnvironment = GetEnvironmentStringsW();
+#else
+	LPCH pEnvironment = GetEnvironmentStrings();
+#endif
+	if(!pEnvironment)
+		return RTERROR;
+	std::vector<TString> entries;
+	for(const TCHAR * p = pEnvironment; *p; p += _tcslen(p) + 1)
+		entries.push_back(p);
+	FreeEnvironmentStrings(pEnvironment);
+
+	// Replace, add or remove each overridden variable
+	for(size_t i = 0; i < overrides.size(); ++i) {
+		const TString & sOverride = overrides[i];
+		size_t nName = NameLength(sOverride);
+		if(nName == 0 || nName == sOverride.size())
+			return RTERROR;
+		bool bRemove = nName + 1 == sOverride.size();
+
+		std::vector<TString>::iterator it = entries.begin();
+		while(it != entries.end() && CompareNames(*it, sOverride) != 0)
+			++it;
+		if(it != entries.end()) {
+			if(bRemove)
+				entries.erase(it);
+			else
+				*it = sOverride;
+		} else if(!bRemove)
+			entries.push_back(sOverride);
+	}
+	std::stable_sort(entries.begin(), entries.end(), NameLess);
+
+	// Each entry ends with a null, and the block with one more
+	block.clear();
+	for(size_t i = 0; i < entries.size(); ++i) {
+		block.insert(block.end(), entries[i].begin(), entries[i].end());
+		block.push_back(_T('\0'));
+	}
+	if(block.empty())
+		block.push_back(_T('\0'));
+	block.push_back(_T('\0'));
+	return RTNORM;
+}
@@ -0,0 +1,76 @@
+/**	\file ShellEnvironment.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellEnvironment.h														*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+#include <map>
+#include <vector>
+
+/**	\brief Caches what CShellPipe looks up in AutoCAD's environment for every child
+*	\note THERE SHOULD ONLY BE ONE INSTANCE OF THIS CLASS
+*
+*	A shell opened with "env" options gets an environment block of its own,
+*	AutoCAD's environment with the overrides merged in. The block is built
+*	the first time a set of overrides is used and handed out again for every
+*	shell opened with the same set. Expanded application names and working
+*	directories are kept the same way.
+*
+*	Both caches hold what AutoCAD's environment was when they were filled.
+*	They are safe to use from any thread.
+*/
+class CShellEnvironment
+{
+public:
+	CShellEnvironment(void);
+	~CShellEnvironment(void);
+
+	/**	\brief Gets the environment block for a set of overrides
+	*	\param[in] overrides "NAME=VALUE" strings, an empty VALUE removes NAME
+	*	\param[out] block receives the block, in the form CreateProcess takes
+	*	\returns RTNORM if successful, otherwise RTERROR
+	*/
+	int GetBlock(const std::vector<TString> & overrides, std::vector<TCHAR> & block);
+
+	/**	\brief Expands the environment variables in a string
+	*	\param[in] pcszSource the string, with variables in the form %NAME%
+	*	\param[out] sExpanded receives the expanded string
+	*	\returns RTNORM if successful, otherwise RTERROR
+	*/
+	int Expand(const TCHAR * pcszSource, TString & sExpanded);
+
+private:
+	CShellEnvironment(const CShellEnvironment &);
+	CShellEnvironment & operator=(const CShellEnvironment &);
+
+	/**	\brief Merges the overrides into AutoCAD's environment */
+	static int BuildBlock(const std::vector<TString> & overrides, std::vector<TCHAR> & block);
+
+	typedef std::map<TString, std::vector<TCHAR> > Blocks;
+	typedef std::map<TString, TString> Expansions;
+
+	CRITICAL_SECTION m_cs;	/**< Guards the members below */
+	Blocks m_blocks;		/**< Environment blocks by their overrides */
+	Expansions m_expanded;	/**< Expanded strings by the string given */
+};
+
+extern CShellEnvironment g_shellEnvironment;
@@ -49,7 +49,7 @@ public:
 	}
 
 	HANDLE & Handle(void) { return m_hHandle; }
-	bool IsValid(void) { return m_hHandle != 0; }
+	bool IsValid(void) const { return m_hHandle != 0; }
 
 	HANDLE & operator=(const HANDLE hHandle) { m_hHandle = hHandle; return m_hHandle; }
 
@@ -0,0 +1,261 @@
+/**	\file ShellJobs.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellJobs.cpp															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+#include "StdAfx.h"
+#include "ShellJobs.h"
+#include <process.h>
+
+CShellJobQueue::CShellJobQueue(void)
+{
+	InitializeCriticalSection(&m_cs);
+	m_nNextJob = 1;
+	m_nRunning = 0;
+	m_nCompleted = 0;
+	m_nStarted = 0;
+	m_dwTotalWait = 0;
+	m_dwTotalRun = 0;
+}
+
+CShellJobQueue::~CShellJobQueue(void)
+{
+	if(!m_threads.empty()) {
+		// Stop the workers from taking new jobs, then cancel the running
+		// ones. A worker still opening its shell kills it once it sees that.
+		SetEvent(m_hStopEvent.Handle());
+		EnterCriticalSection(&m_cs);
+		for(Jobs::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it) {
+			Job * pJob = it->second;
+			if(pJob->state != kRunning)
+				continue;
+			pJob->state = kCancelled;
+			if(pJob->pShell)
+				pJob->pShell->KillShell(ERROR_CANCELLED);
+		}
+		LeaveCriticalSection(&m_cs);
+
+		WaitForMultipleObjects((DWORD) m_threads.size(), &m_threads[0], TRUE, INFINITE);
+		for(size_t i = 0; i < m_threads.size(); ++i)
+			CloseHandle(m_threads[i]);
+	}
+
+	for(Jobs::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it)
+		delete it->second;
+	DeleteCriticalSection(&m_cs);
+}
+
+void CShellJobQueue::StartWorkers( void )
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	int nWorkers = (int) info.dwNumberOfProcessors;
+	if(nWorkers > MAXIMUM_WAIT_OBJECTS)
+		nWorkers = MAXIMUM_WAIT_OBJECTS;
+
+	m_hWorkSemaphore = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+	m_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	for(int i = 0; i < nWorkers; ++i) {
+		unsigned nThreadId;
+		HANDLE hThread = (HANDLE) _beginthreadex(NULL, 0, WorkerThread, this, 0, &nThreadId);
+		if(hThread)
+			m_threads.push_back(hThread);
+	}
+}
+
+int CShellJobQueue::Submit( const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine, int nPriority )
+{
+	if(m_threads.empty())
+		StartWorkers();
+	if(m_threads.empty())
+		return 0;
+
+	Job * pJob = new Job;
+	pJob->command.sApplicationName = pcszApplicationName;
+	pJob->command.sCommandLine = pcszCommandLine;
+	pJob->nPriority = nPriority;
+	pJob->state = kQueued;
+	pJob->pShell = NULL;
+	pJob->bWorker = false;
+	pJob->dwSubmitted = GetTickCount();
+
+	EnterCriticalSection(&m_cs);
+	int nJob = m_nNextJob++;
+	m_jobs[nJob] = pJob;
+	m_waiting.insert(std::make_pair(-nPriority, nJob));
+	LeaveCriticalSection(&m_cs);
+
+	ReleaseSemaphore(m_hWorkSemaphore.Handle(), 1, NULL);
+	return nJob;
+}
+
+int CShellJobQueue::Poll( int nJob, JobState & state ) const
+{
+	int nResult = RTERROR;
+	EnterCriticalSection(&m_cs);
+	Jobs::const_iterator it = m_jobs.find(nJob);
+	if(it != m_jobs.end()) {
+		state = it->second->state;
+		nResult = RTNORM;
+	}
+	LeaveCriticalSection(&m_cs);
+	return nResult;
+}
+
+int CShellJobQueue::GetResult( int nJob, CShellCommand & command )
+{
+	Job * pJob = NULL;
+	EnterCriticalSection(&m_cs);
+	Jobs::iterator it = m_jobs.find(nJob);
+	if(it != m_jobs.end() && it->second->state != kQueued && it->second->state != kRunning
+		&& !it->second->bWorker) {
+		pJob = it->second;
+		m_jobs.erase(it);
+	}
+	LeaveCriticalSection(&m_cs);
+
+	if(!pJob)
+		return RTERROR;
+	command = pJob->command;
+	delete pJob;
+	return RTNORM;
+}
+
+int CShellJobQueue::Cancel( int nJob )
+{
+	int nResult = RTERROR;
+	EnterCriticalSection(&m_cs);
+	Jobs::iterator it = m_jobs.find(nJob);
+	if(it != m_jobs.end()) {
+		Job * pJob = it->second;
+		if(pJob->state == kQueued) {
+			m_waiting.erase(std::make_pair(-pJob->nPriority, nJob));
+			pJob->state = kCancelled;
+			nResult = RTNORM;
+		} else if(pJob->state == kRunning) {
+			// The worker sees the state once its shell is open, and kills
+			// it itself if pShell isn't set yet.
+			pJob->state = kCancelled;
+			if(pJob->pShell)
+				pJob->pShell->KillShell(ERROR_CANCELLED);
+			nResult = RTNORM;
+		}
+	}
+	LeaveCriticalSection(&m_cs);
+	return nResult;
+}
+
+int CShellJobQueue::GetQueued( void ) const
+{
+	EnterCriticalSection(&m_cs);
+	int nQueued = (int) m_waiting.size();
+	LeaveCriticalSection(&m_cs);
+	return nQueued;
+}
+
+int CShellJobQueue::GetRunning( void ) const
+{
+	EnterCriticalSection(&m_cs);
+	int nRunning = m_nRunning;
+	LeaveCriticalSection(&m_cs);
+	return nRunning;
+}
+
+DWORD CShellJobQueue::GetAverageWait( void ) const
+{
+	EnterCriticalSection(&m_cs);
+	DWORD dwAverage = m_nStarted ? m_dwTotalWait / m_nStarted : 0;
+	LeaveCriticalSection(&m_cs);
+	return dwAverage;
+}
+
+DWORD CShellJobQueue::GetAverageRun( void ) const
+{
+	EnterCriticalSection(&m_cs);
+	DWORD dwAverage = m_nCompleted ? m_dwTotalRun / m_nCompleted : 0;
+	LeaveCriticalSection(&m_cs);
+	return dwAverage;
+}
+
+unsigned __stdcall CShellJobQueue::WorkerThread( void * pParam )
+{
+	CShellJobQueue * pThis = (CShellJobQueue *) pParam;
+	HANDLE hWaits[2] = { pThis->m_hStopEvent.Handle(), pThis->m_hWorkSemaphore.Handle() };
+
+	// acedUsrBrk may only be called from the AutoCAD main thread
+	CShellOptions options;
+	options.bCheckUserBreak = false;
+
+	while(WaitForMultipleObjects(2, hWaits, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+		// take the waiting job with the highest priority. There may be
+		// none left if it was cancelled after being submitted.
+		CShellPipe * pShell = new CShellPipe;
+		Job * pJob = NULL;
+		EnterCriticalSection(&pThis->m_cs);
+		if(!pThis->m_waiting.empty()) {
+			int nJob = pThis->m_waiting.begin()->second;
+			pThis->m_waiting.erase(pThis->m_waiting.begin());
+			pJob = pThis->m_jobs[nJob];
+			pJob->state = kRunning;
+			pJob->bWorker = true;
+			++pThis->m_nRunning;
+			++pThis->m_nStarted;
+			pThis->m_dwTotalWait += GetTickCount() - pJob->dwSubmitted;
+		}
+		LeaveCriticalSection(&pThis->m_cs);
+
+		if(pJob) {
+			DWORD dwStart = GetTickCount();
+			int nResult = StartShellCommand(pJob->command, options, *pShell);
+
+			// KillShell can't stop a shell still being opened, so Cancel
+			// only gets the shell now. A cancel that came in meanwhile is
+			// seen here, under the lock Cancel kills with.
+			bool bCancelled = false;
+			if(nResult == RTNORM) {
+				EnterCriticalSection(&pThis->m_cs);
+				bCancelled = pJob->state == kCancelled;
+				if(bCancelled)
+					pShell->KillShell(ERROR_CANCELLED);
+				else
+					pJob->pShell = pShell;
+				LeaveCriticalSection(&pThis->m_cs);
+			}
+			if(nResult == RTNORM && !bCancelled)
+				nResult = FinishShellCommand(pJob->command, *pShell, dwStart);
+
+			EnterCriticalSection(&pThis->m_cs);
+			pJob->pShell = NULL;
+			pJob->bWorker = false;
+			if(pJob->state == kRunning)
+				pJob->state = nResult == RTNORM ? kDone : kFailed;
+			--pThis->m_nRunning;
+			// failed and cancelled jobs would skew the average run time
+			if(pJob->state == kDone) {
+				++pThis->m_nCompleted;
+				pThis->m_dwTotalRun += pJob->command.dwElapsed;
+			}
+			LeaveCriticalSection(&pThis->m_cs);
+		}
+		delete pShell;
+	}
+	return 0;
+}
@@ -0,0 +1,119 @@
+/**	\file ShellJobs.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellJobs.h																*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+#include <set>
+#include "ShellBatch.h"
+
+/**	\brief Runs commands in the background, highest priority first
+*
+*	Commands submitted to the queue wait until one of the worker threads
+*	is free. The waiting command with the highest priority is started
+*	first, and commands with the same priority start in the order they
+*	were submitted. Autolisp polls a job by its id and fetches the result
+*	once it is done.
+*
+*	Each CDocShells owns a queue, so the jobs of a drawing are cancelled
+*	and their processes terminated when the drawing closes.
+*/
+class CShellJobQueue
+{
+public:
+	enum JobState { kQueued, kRunning, kDone, kFailed, kCancelled };
+
+	CShellJobQueue(void);
+
+	/**	\brief Cancels every job and waits for the worker threads to exit */
+	~CShellJobQueue(void);
+
+	/**	\brief Queues a command
+	*	\param[in] pcszApplicationName the application, as given to OpenShell
+	*	\param[in] pcszCommandLine the command line, as given to OpenShell
+	*	\param[in] nPriority jobs with a higher priority start first
+	*	\returns the job id, or 0 on errors
+	*/
+	int Submit(const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine, int nPriority);
+
+	/**	\brief Gets the state of a job
+	*	\returns RTNORM if nJob is a job of this queue, otherwise RTERROR
+	*/
+	int Poll(int nJob, JobState & state) const;
+
+	/**	\brief Takes the result of a finished job
+	*	\param[in] nJob the job id
+	*	\param[out] command receives the command and its results
+	*	\returns RTNORM if the job has finished, otherwise RTERROR.
+	*
+	*	The job is removed from the queue, its id is no longer valid. A
+	*	cancelled job only finishes once its worker has let go of it.
+	*/
+	int GetResult(int nJob, CShellCommand & command);
+
+	/**	\brief Cancels a job
+	*	\returns RTNORM if the job was waiting or running, otherwise RTERROR.
+	*
+	*	A running job's processes are terminated.
+	*/
+	int Cancel(int nJob);
+
+	int GetQueued(void) const;			/**< Jobs waiting to start */
+	int GetRunning(void) const;			/**< Jobs running now */
+	LONG GetCompleted(void) const { return m_nCompleted; }	/**< Jobs that have run to the end */
+	DWORD GetAverageWait(void) const;	/**< Average ms a job waited to start */
+	DWORD GetAverageRun(void) const;	/**< Average ms a completed job ran */
+
+private:
+	CShellJobQueue(const CShellJobQueue &);
+	CShellJobQueue & operator=(const CShellJobQueue &);
+
+	struct Job
+	{
+		CShellCommand command;
+		int nPriority;
+		JobState state;
+		CShellPipe * pShell;	/**< Set once the running job's shell is open, so Cancel can kill it */
+		bool bWorker;			/**< A worker thread still uses the job, even once it is cancelled */
+		DWORD dwSubmitted;		/**< GetTickCount when submitted */
+	};
+	typedef std::map<int, Job *> Jobs;
+	typedef std::set<std::pair<int, int> > Waiting;	/**< (-priority, id), the first starts next */
+
+	/**	\brief Starts the worker threads, done on the first Submit */
+	void StartWorkers(void);
+
+	static unsigned __stdcall WorkerThread(void * pParam);
+
+	mutable CRITICAL_SECTION m_cs;	/**< Guards everything below */
+	Jobs m_jobs;
+	Waiting m_waiting;
+	int m_nNextJob;
+	int m_nRunning;
+	LONG m_nCompleted;
+	LONG m_nStarted;
+	DWORD m_dwTotalWait;
+	DWORD m_dwTotalRun;
+	std::vector<HANDLE> m_threads;
+	CShellHandle m_hWorkSemaphore;	/**< Released once per submitted job */
+	CShellHandle m_hStopEvent;		/**< Set to stop the workers */
+};
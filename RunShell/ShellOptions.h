@@ -0,0 +1,144 @@
+/**	\file ShellOptions.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellOptions.h															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+#include <tchar.h>
+#include <vector>
+#include "TextDecoder.h"
+#include "ShellWriter.h"
+
+/**	\brief Options that control how CShellPipe::OpenShell runs a child
+*
+*	The defaults reproduce the original behaviour of the extension, so
+*	a default constructed CShellOptions opens a plain one-shot shell.
+*	From Autolisp the options are given as keyword strings following
+*	the command line argument of OpenShell.
+*
+*	\code
+*	(setq handle (openshell "%comspec%" "/c dir /s" "pumped"))
+*	\endcode
+*/
+class CShellOptions
+{
+public:
+	CShellOptions(void)
+	{
+		bPumped = false;
+		bMerged = false;
+		bDuplex = false;
+		bCheckUserBreak = true;
+		bKillOnBreak = false;
+		bCached = false;
+		nReadAhead = 65536;
+		nBufferLimit = 16 * 1024 * 1024;
+		nPipeSize = 0;
+		encoding = kEncodingUtf8;
+		nWriteQueue = 0;
+		writeFull = kWriteFullBlock;
+		sSentinelCommand = _T("echo %SENTINEL1%^%SENTINEL2% %errorlevel%");
+	}
+
+	bool bPumped;	/**< Drain the child's stdout from a background thread.
+					*	 ReadShellData is then served from memory and the child
+					*	 never stalls on a full pipe. Keyword "pumped".
+					*/
+	bool bMerged;	/**< Send the child's stderr into its stdout pipe, so both
+					*	 streams are read through ReadShellData in the order the
+					*	 child wrote them. Keyword "merged".
+					*/
+	bool bDuplex;	/**< Keep stdin open after reading, so reads and writes can
+					*	 alternate for the life of the shell. Stdin is closed by
+					*	 CloseShellInput. Keyword "duplex".
+					*/
+	bool bCheckUserBreak;	/**< Let ESC cancel blocking reads and closes. Must be
+							*	 false for shells used outside the AutoCAD main
+							*	 thread, acedUsrBrk may only be called from it.
+							*/
+	bool bKillOnBreak;	/**< Terminate the child when ESC cancels a blocking
+						*	 call. Keyword "killonbreak".
+						*/
+	bool bCached;	/**< Look the result up in g_shellCache when the shell is first
+					*	 read, and only start it on a miss. A cached shell is
+					*	 pumped. It can't be duplex or write a capture file,
+					*	 the open fails. Keyword "cached".
+					*/
+	DWORD nReadAhead;	/**< Bytes of stdout read from the child at once. ReadShellData
+						*	 hands them out ADS sized pieces at a time, so there is one
+						*	 kernel call per nReadAhead bytes instead of per 503.
+						*	 Keyword "readahead" followed by the size.
+						*/
+	DWORD nBufferLimit;	/**< Most bytes of each stream a pumped shell holds unread,
+						*	 0 for no limit. Once it is reached the pump stops
+						*	 reading that stream until the reader catches up, and
+						*	 the child waits on the full pipe. A cached shell has
+						*	 no limit. Keyword "bufferlimit" followed by the size.
+						*/
+	DWORD nPipeSize;	/**< Buffer size asked for when the pipes are created, 0 for
+						*	 the system default. A bigger pipe lets a fast child get
+						*	 further ahead of the reader. Keyword "pipesize"
+						*	 followed by the size.
+						*/
+	TextEncoding encoding;	/**< How the child's output is encoded. cmd.exe built-ins
+							*	 write the OEM code page. Keyword "encoding" followed
+							*	 by "utf8", "oem", "ansi" or "utf16".
+							*/
+	DWORD nWriteQueue;	/**< Most bytes of stdin queued for a background writer
+						*	 thread, 0 to write directly. With a queue a child that
+						*	 isn't reading its stdin can't block AutoCAD. Keyword
+						*	 "asyncwrite" followed by the size.
+						*/
+	WriteFullPolicy writeFull;	/**< What a write does when the queue is full. Keyword
+								*	 "onfull" followed by "block", "fail" or "drop".
+								*/
+	TString sSentinelCommand;	/**< Command ExecInShell writes after each command
+								*	 to mark the end of its output. It must print
+								*	 a unique string followed by the exit status.
+								*	 The string is given in two halves, %SENTINEL1%
+								*	 and %SENTINEL2%, to be printed joined, so an
+								*	 echo of the command itself doesn't contain it.
+								*	 %SENTINEL% is the whole string. The default
+								*	 suits cmd.exe, ^ joins the halves. Keyword
+								*	 "sentinel" followed by the command string.
+								*/
+	TString sStdoutFile;	/**< File the child writes its stdout straight into,
+							*	 instead of a pipe. Nothing is read or converted on
+							*	 our side. Keyword "stdout" followed by the path.
+							*/
+	TString sStderrFile;	/**< Same for stderr, can't be combined with bMerged.
+							*	 Keyword "stderr" followed by the path.
+							*/
+	TString sDirectory;	/**< Working directory of the child, empty for AutoCAD's.
+						*	 Environment variables are expanded. Keyword "cwd"
+						*	 followed by the path.
+						*/
+	std::vector<TString> environment;	/**< "NAME=VALUE" variables the child gets on
+										*	 top of AutoCAD's environment, an empty
+										*	 VALUE removes NAME. Keyword "env"
+										*	 followed by the string, once per variable.
+										*/
+	std::vector<TString> dependencies;	/**< Files whose modification times are part of
+										*	 the key of a cached result. Keyword
+										*	 "depends" followed by the path, once per file.
+										*/
+};
@@ -27,11 +27,20 @@
 
 #include "StdAfx.h"
 #include "ShellPipe.h"
+#include "LineScanner.h"
+#include "CommandLine.h"
+#include "ShellEnvironment.h"
+#include "ShellCache.h"
 #include <tchar.h>
+#include <process.h>
 #include <algorithm>
 #include <cctype>
+#include <climits>
 
-#define _ENVIRONMENT_VARIABLE_LIMIT 32768
+#define PUMP_BUFFER_SIZE 4096
+#define READ_ALL_SIZE 65536
+#define POLL_INTERVAL 10
+#define USER_BREAK_INTERVAL 50	// longest a blocking call goes without checking for ESC
 
 // trim from both ends
 template<class T>
@@ -53,122 +62,650 @@ static inline T &rtrim(T &s) {
     return s;
 }
 
-int ExpandEnvironmentString(const TCHAR * pcszSource, TString & sNewString)
+// Milliseconds left of dwTimeout since dwStart, 0 once it has passed
+static DWORD TimeLeft(DWORD dwStart, DWORD dwTimeout)
 {
-    //	pszNewString = NULL;
-    DWORD dwSize = ExpandEnvironmentStrings(pcszSource, NULL, 0);
-    if(dwSize == 0) {
-        return RTERROR;
-    }
-    sNewString.resize(dwSize);
-    dwSize = ExpandEnvironmentStrings(pcszSource, &sNewString[0], dwSize);
-    if(dwSize == 0) {
-        sNewString = _T("");
-        return RTERROR;
-    }
-    return RTNORM;
+	if(dwTimeout == INFINITE)
+		return INFINITE;
+	DWORD dwElapsed = GetTickCount() - dwStart;
+	return dwElapsed >= dwTimeout ? 0 : dwTimeout - dwElapsed;
 }
 
+// True for the errors a stream ends with once the child has closed it.
+// Anything else, ESC included, leaves data that may still follow.
+static bool IsEndOfStream(DWORD dwError)
+{
+	return dwError == ERROR_BROKEN_PIPE || dwError == ERROR_HANDLE_EOF;
+}
+
+// Same as CreatePipe, except the read end is opened for overlapped I/O so
+// the pump thread can wait on it together with its stop event, or the
+// write end if bOutbound, for the stdin writer thread. Anonymous pipes do
+// not support overlapped I/O, so a uniquely named pipe is used.
+static BOOL CreateOverlappedPipe(HANDLE * phRead, HANDLE * phWrite,
+								 SECURITY_ATTRIBUTES * pSa, DWORD nSize, bool bOutbound = false)
+{
+	static LONG nPipeSerial = 0;
+	TCHAR szPipeName[MAX_PATH];
+	_stprintf(szPipeName, _T("\\\\.\\pipe\\RunShell.%08x.%08x"),
+		GetCurrentProcessId(), InterlockedIncrement(&nPipeSerial));
+
+	if(!nSize)
+		nSize = PUMP_BUFFER_SIZE;
+
+	// the overlapped end is the server end, the read end unless bOutbound
+	HANDLE * phServer = bOutbound ? phWrite : phRead;
+	HANDLE * phClient = bOutbound ? phRead : phWrite;
+	*phServer = CreateNamedPipe(szPipeName,
+		(bOutbound ? PIPE_ACCESS_OUTBOUND : PIPE_ACCESS_INBOUND) | FILE_FLAG_OVERLAPPED,
+		PIPE_TYPE_BYTE | PIPE_WAIT, 1, nSize, nSize, 0, pSa);
+	if(*phServer == INVALID_HANDLE_VALUE) {
+		*phServer = NULL;
+		return FALSE;
+	}
+
+	*phClient = CreateFile(szPipeName, bOutbound ? GENERIC_READ : GENERIC_WRITE, 0, pSa,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(*phClient == INVALID_HANDLE_VALUE) {
+		DWORD dwError = GetLastError();
+		::CloseHandle(*phServer);
+		*phRead = *phWrite = NULL;
+		SetLastError(dwError);
+		return FALSE;
+	}
+	return TRUE;
+}
 
+// Creates the file a captured stream is written to, the handle the
+// child gets instead of the write end of a pipe. Readers may
+// open the file while the child is still writing it.
+static BOOL CreateCaptureFile(const TCHAR * pcszPath, HANDLE * phWrite, SECURITY_ATTRIBUTES * pSa)
+{
+	*phWrite = CreateFile(pcszPath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, pSa,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(*phWrite == INVALID_HANDLE_VALUE) {
+		*phWrite = NULL;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// The last error is kept per thread. Shells are opened, read and closed
+// on the pool, batch, job and reaper threads too, and their errors must
+// not turn up in GetLastShellError on the main thread. TlsAlloc rather
+// than __declspec(thread), which doesn't work in a DLL loaded with
+// LoadLibrary before Vista. The index is never freed, shells deleted
+// while the DLL unloads still set it.
+static DWORD s_nLastErrorTls = TlsAlloc();
+
+DWORD CShellPipe::GetLastShellError( void )
+{
+	return (DWORD) (DWORD_PTR) TlsGetValue(s_nLastErrorTls);
+}
 
-DWORD CShellPipe::m_dwLastError = 0;
+void CShellPipe::SetLastShellError( DWORD dwError )
+{
+	TlsSetValue(s_nLastErrorTls, (LPVOID) (DWORD_PTR) dwError);
+}
 
 CShellPipe::CShellPipe(void)
 {
-    memset(&m_pi, 0, sizeof(PROCESS_INFORMATION));
-	m_dwLastError = 0;
+	m_nAheadHead = 0;
+	m_nLineScanned = 0;
+	m_bDeferred = false;
+	m_bCaching = false;
+	m_bCacheHit = false;
+	SetLastShellError(0);
 }
 
 CShellPipe::~CShellPipe(void)
 {
+	StopPump();
+	m_writer.Stop();
+	for(size_t i = 0; i < m_stages.size(); ++i)
+		::CloseHandle(m_stages[i]);
 }
 
 int CShellPipe::SetErrorReturnCode( void )
 {
-	m_dwLastError = GetLastError();
+	SetLastShellError(GetLastError());
 	return RTERROR;
 }
 
-int CShellPipe::OpenShell( const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine )
+int CShellPipe::OpenShell( const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine,
+						   const CShellOptions & options )
 {
-	SECURITY_ATTRIBUTES sa;
-	sa.nLength = sizeof(SECURITY_ATTRIBUTES);
-	sa.bInheritHandle = TRUE;
-	sa.lpSecurityDescriptor = NULL;
+	return OpenStages(1, &pcszApplicationName, &pcszCommandLine, options);
+}
 
-	// Create a pipe for the child process's STDOUT. 
-	if(!CreatePipe(&m_hParentRead.Handle(), &m_hChildWrite.Handle(), &sa, 0))
+int CShellPipe::OpenPipeline( const std::vector<const TCHAR *> & applicationNames,
+							  const std::vector<const TCHAR *> & commandLines, const CShellOptions & options )
+{
+	// WaitShell waits for all the stages at once
+	if(applicationNames.empty() || applicationNames.size() != commandLines.size()
+		|| applicationNames.size() > MAXIMUM_WAIT_OBJECTS) {
+		SetLastShellError(ERROR_INVALID_PARAMETER);
+		return RTERROR;
+	}
+	return OpenStages(applicationNames.size(), &applicationNames[0], &commandLines[0], options);
+}
+
+int CShellPipe::OpenProcessArgs( const TCHAR * pcszProgram, const std::vector<const TCHAR *> & arguments,
+								 const CShellOptions & options )
+{
+	// Resolve the program first, CreateProcess takes it as given then
+	TString sPath;
+	if(FindProgram(pcszProgram, sPath) != RTNORM)
 		return SetErrorReturnCode();
 
-	// Ensure the read handle to the pipe for STDOUT is not inherited.
-	SetHandleInformation(m_hParentRead.Handle(), HANDLE_FLAG_INHERIT, 0);
+	TString sCommandLine;
+	AppendProgramName(sPath.c_str(), sCommandLine);
+	for(size_t i = 0; i < arguments.size(); ++i)
+		AppendArgument(arguments[i], sCommandLine);
+	return OpenShell(sPath.c_str(), sCommandLine.c_str(), options);
+}
 
-	// Create a pipe for the child process's STDIN. 
-	if(!CreatePipe(&m_hChildRead.Handle(), &m_hParentWrite.Handle(), &sa, 0))
-		return SetErrorReturnCode();
+int CShellPipe::OpenStages( size_t nStages, const TCHAR * const * ppApplicationNames,
+						   const TCHAR * const * ppCommandLines, const CShellOptions & options )
+{
+	m_options = options;
+	m_stdoutDecoder.SetEncoding(m_options.encoding);
+	m_stderrDecoder.SetEncoding(m_options.encoding);
+	m_stdinEncoder.SetEncoding(m_options.encoding);
 
-	// Ensure the write handle to the pipe for STDIN is not inherited. 
-	SetHandleInformation(m_hParentWrite.Handle(), HANDLE_FLAG_INHERIT, 0);
+	// A cached shell starts nothing yet. ResolveCached does once the
+	// whole of its stdin is known and the result isn't in the cache.
+	// Its result is all of its output, which a capture file would take
+	// and a duplex shell never ends.
+	if(m_options.bCached) {
+		if(m_options.bDuplex || !m_options.sStdoutFile.empty() || !m_options.sStderrFile.empty()) {
+			SetLastShellError(ERROR_INVALID_PARAMETER);
+			return RTERROR;
+		}
+		m_options.bPumped = true;
+		for(size_t i = 0; i < nStages; ++i) {
+			m_deferredApplications.push_back(ppApplicationNames[i] ? ppApplicationNames[i] : _T(""));
+			m_deferredCommandLines.push_back(ppCommandLines[i] ? ppCommandLines[i] : _T(""));
+		}
+		m_bDeferred = true;
+		SetLastShellError(0);
+		return RTNORM;
+	}
 
-	// Create a pipe for the child process's STDERR. 
-	if(!CreatePipe(&m_hParentError.Handle(), &m_hChildError.Handle(), &sa, 0))
+	// None of the handles is inheritable. Another thread starting a
+	// process at the same time would get them, and a child holding the
+	// write end of a pipe keeps its reader from ever seeing the end.
+	// CreateChildProcess hands each child inheritable copies of its own
+	// three handles only.
+
+	// Create a pipe for the child process's STDOUT. The pump thread needs
+	// an overlapped read end so it can be told to stop. A captured STDOUT
+	// goes straight into its file, without a pipe.
+	if(!m_options.sStdoutFile.empty()) {
+		if(!CreateCaptureFile(m_options.sStdoutFile.c_str(), &m_hChildWrite.Handle(), NULL))
+			return SetErrorReturnCode();
+	} else if(m_options.bPumped) {
+		if(!CreateOverlappedPipe(&m_hParentRead.Handle(), &m_hChildWrite.Handle(), NULL, m_options.nPipeSize))
+			return SetErrorReturnCode();
+	} else if(!CreatePipe(&m_hParentRead.Handle(), &m_hChildWrite.Handle(), NULL, m_options.nPipeSize))
+		return SetErrorReturnCode();
+
+	// Create a pipe for the child process's STDIN. The writer thread needs
+	// an overlapped write end so it can be told to stop.
+	if(m_options.nWriteQueue) {
+		if(!CreateOverlappedPipe(&m_hChildRead.Handle(), &m_hParentWrite.Handle(), NULL, m_options.nPipeSize, true))
+			return SetErrorReturnCode();
+	} else if(!CreatePipe(&m_hChildRead.Handle(), &m_hParentWrite.Handle(), NULL, m_options.nPipeSize))
 		return SetErrorReturnCode();
 
-	// Ensure the read handle to the pipe for STDERR is not inherited. 
-	SetHandleInformation(m_hParentError.Handle(), HANDLE_FLAG_INHERIT, 0);
+	// Create a pipe for the child process's STDERR. A merged shell writes
+	// STDERR into the STDOUT pipe instead, so the OS keeps the two streams
+	// in the order the child wrote them.
+	if(!m_options.bMerged) {
+		if(!m_options.sStderrFile.empty()) {
+			if(!CreateCaptureFile(m_options.sStderrFile.c_str(), &m_hChildError.Handle(), NULL))
+				return SetErrorReturnCode();
+		} else if(m_options.bPumped) {
+			if(!CreateOverlappedPipe(&m_hParentError.Handle(), &m_hChildError.Handle(), NULL, m_options.nPipeSize))
+				return SetErrorReturnCode();
+		} else if(!CreatePipe(&m_hParentError.Handle(), &m_hChildError.Handle(), NULL, m_options.nPipeSize))
+			return SetErrorReturnCode();
+	}
+
+	// Create the child processes.
+	if(StartStages(nStages, ppApplicationNames, ppCommandLines) != RTNORM)
+		return RTERROR;
 
-	// Create the child process. 
-	if(CreateChildProcess(pcszApplicationName, pcszCommandLine) != RTNORM)
+	// The children have their own copies of the child ends now. Ours
+	// must be closed, or reads and ShellDataAvailable never see the end
+	// of the streams, and writes never see a child that has exited.
+	if(m_hChildWrite.CloseHandle() != RTNORM || m_hChildError.CloseHandle() != RTNORM
+		|| m_hChildRead.CloseHandle() != RTNORM)
 		return SetErrorReturnCode();
+	if(m_options.bPumped) {
+		m_stdout.SetLimit(m_options.nBufferLimit);
+		m_stderr.SetLimit(m_options.nBufferLimit);
+		if(StartPump() != RTNORM)
+			return RTERROR;
+	}
+	if(m_options.nWriteQueue) {
+		// the writer owns stdin from here on, it closes it when told to
+		HANDLE hParentWrite = m_hParentWrite.Handle();
+		m_hParentWrite.Handle() = NULL;
+		if(m_writer.Start(hParentWrite, m_options.nWriteQueue, m_options.writeFull) != RTNORM)
+			return SetErrorReturnCode();
+	}
 
-	m_dwLastError = 0;
+	SetLastShellError(0);
 	return RTNORM;
 }
 
-// Create a child process that uses the previously created pipes for STDIN and STDOUT.
-BOOL CShellPipe::CreateChildProcess( const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine )
+int CShellPipe::ResolveCached( DWORD dwTimeout )
+{
+	DWORD dwStart = GetTickCount();
+	if(m_bDeferred && StartCached() != RTNORM)
+		return RTERROR;
+	if(!m_bCaching)
+		return RTNORM;
+
+	// The output is complete once the pump thread has returned, which it
+	// does once every stream has ended. ESC leaves an ordinary pumped shell.
+	for(;;) {
+		DWORD dwLeft = TimeLeft(dwStart, dwTimeout);
+		DWORD dwWait = m_options.bCheckUserBreak ? std::min<DWORD>(dwLeft, USER_BREAK_INTERVAL) : dwLeft;
+		if(WaitForSingleObject(m_hPumpThread.Handle(), dwWait) != WAIT_TIMEOUT)
+			break;
+		if(UserBreak()) {
+			m_bCaching = false;
+			return RTERROR;
+		}
+		if(dwWait == dwLeft)
+			return RTNONE;
+	}
+	int nResult = WaitStages(TimeLeft(dwStart, dwTimeout));
+	if(nResult == RTNONE)
+		return RTNONE;
+	m_bCaching = false;
+	if(nResult != RTNORM)
+		return RTERROR;
+
+	// Only a run where every stage succeeded is kept, a failure may
+	// not happen the next time.
+	std::vector<DWORD> exitCodes;
+	std::vector<bool> exited;
+	if(GetShellExitCodes(exitCodes, exited) != RTNORM)
+		return RTERROR;
+	bool bSucceeded = m_stdout.GetError() == ERROR_BROKEN_PIPE
+		&& (m_options.bMerged || m_stderr.GetError() == ERROR_BROKEN_PIPE);
+	for(size_t i = 0; i < exitCodes.size(); ++i) {
+		if(exitCodes[i])
+			bSucceeded = false;
+	}
+	if(bSucceeded) {
+		std::string sStdout, sStderr;
+		m_stdout.GetData(sStdout);
+		m_stderr.GetData(sStderr);
+		g_shellCache.Store(m_sCacheKey, m_deferredApplications[0], sStdout, sStderr, exitCodes);
+	}
+
+	SetLastShellError(0);
+	return RTNORM;
+}
+
+int CShellPipe::StartCached( void )
+{
+	m_sCacheKey = CShellCache::MakeKey(m_deferredApplications, m_deferredCommandLines,
+		m_options, m_sDeferredInput);
+	std::string sStdout, sStderr;
+	if(g_shellCache.Lookup(m_sCacheKey, sStdout, sStderr, m_cachedExitCodes)) {
+		// the streams end the way they would have for the real process
+		m_stdout.Append(sStdout.data(), (DWORD) sStdout.size());
+		m_stdout.SetEof(ERROR_BROKEN_PIPE);
+		m_stderr.Append(sStderr.data(), (DWORD) sStderr.size());
+		m_stderr.SetEof(m_options.bMerged ? ERROR_INVALID_HANDLE : ERROR_BROKEN_PIPE);
+		m_bDeferred = false;
+		m_bCacheHit = true;
+		SetLastShellError(0);
+		return RTNORM;
+	}
+
+	std::vector<const TCHAR *> applicationNames, commandLines;
+	for(size_t i = 0; i < m_deferredApplications.size(); ++i) {
+		applicationNames.push_back(m_deferredApplications[i].c_str());
+		commandLines.push_back(m_deferredCommandLines[i].c_str());
+	}
+	CShellOptions cachedOptions = m_options;
+	// the whole output is kept to be stored, so it has no limit
+	CShellOptions options = m_options;
+	options.bCached = false;
+	options.nBufferLimit = 0;
+	if(OpenStages(applicationNames.size(), &applicationNames[0], &commandLines[0], options) != RTNORM) {
+		// Leave nothing behind, so the next call starts it over.
+		DWORD dwError = GetLastShellError();
+		if(m_hJob.IsValid())
+			TerminateJobObject(m_hJob.Handle(), ERROR_CANCELLED);
+		for(size_t i = 0; i < m_stages.size(); ++i) {
+			TerminateProcess(m_stages[i], ERROR_CANCELLED);
+			::CloseHandle(m_stages[i]);
+		}
+		m_stages.clear();
+		if(m_hProcess.IsValid())
+			TerminateProcess(m_hProcess.Handle(), ERROR_CANCELLED);
+		m_hProcess.CloseHandle();
+		m_hJob.CloseHandle();
+		ClosePipes();
+		m_hStopEvent.CloseHandle();
+		m_stdout.Reset();
+		m_stderr.Reset();
+		m_options = cachedOptions;
+		m_bDeferred = true;
+		SetLastShellError(dwError);
+		return RTERROR;
+	}
+	m_bDeferred = false;
+	m_bCaching = true;
+
+	DWORD nWritten;
+	m_sWriteBuffer.swap(m_sDeferredInput);
+	std::string().swap(m_sDeferredInput);
+	if(WriteBuffer(nWritten) != RTNORM || CloseShellInput() != RTNORM) {
+		m_bCaching = false;
+		return RTERROR;
+	}
+	return RTNORM;
+}
+
+// STARTUPINFOEX and the handle list attribute. The headers only declare
+// them for Vista and later, and the DLL must still load on XP, so the
+// functions are looked up at run time.
+#define SHELL_EXTENDED_STARTUPINFO_PRESENT 0x00080000
+#define SHELL_PROC_THREAD_ATTRIBUTE_HANDLE_LIST 0x00020002
+
+struct ShellStartupInfoEx
+{
+	STARTUPINFO StartupInfo;
+	LPVOID lpAttributeList;
+};
+
+typedef BOOL (WINAPI * InitializeProcThreadAttributeListProc)(LPVOID, DWORD, DWORD, SIZE_T *);
+typedef BOOL (WINAPI * UpdateProcThreadAttributeProc)(LPVOID, DWORD, DWORD_PTR, PVOID, SIZE_T, PVOID, SIZE_T *);
+typedef VOID (WINAPI * DeleteProcThreadAttributeListProc)(LPVOID);
+
+// The handle list functions, or NULL before Vista, and the lock that
+// stands in for them there. Plain data and never deleted, so children
+// can be started from any thread at any time after the DLL is loaded.
+static InitializeProcThreadAttributeListProc s_pInitializeAttributeList = NULL;
+static UpdateProcThreadAttributeProc s_pUpdateAttribute = NULL;
+static DeleteProcThreadAttributeListProc s_pDeleteAttributeList = NULL;
+static CRITICAL_SECTION s_inheritLock;
+
+static struct InheritInit
+{
+	InheritInit(void)
+	{
+		InitializeCriticalSection(&s_inheritLock);
+		HMODULE hKernel = GetModuleHandle(_T("kernel32.dll"));
+		s_pInitializeAttributeList = (InitializeProcThreadAttributeListProc)
+			GetProcAddress(hKernel, "InitializeProcThreadAttributeList");
+		s_pUpdateAttribute = (UpdateProcThreadAttributeProc)
+			GetProcAddress(hKernel, "UpdateProcThreadAttribute");
+		s_pDeleteAttributeList = (DeleteProcThreadAttributeListProc)
+			GetProcAddress(hKernel, "DeleteProcThreadAttributeList");
+		if(!s_pInitializeAttributeList || !s_pUpdateAttribute || !s_pDeleteAttributeList)
+			s_pInitializeAttributeList = NULL;
+	}
+} s_inheritInit;
+
+// Inheritable copies of a child's stdin, stdout and stderr, and the
+// attribute list that names them. Without handle lists the copies are
+// made and closed under s_inheritLock.
+class CInheritedHandles
+{
+public:
+	CInheritedHandles(void) : m_nCopies(0), m_bList(false), m_bLocked(false) {}
+	~CInheritedHandles(void) { Close(); }
+
+	int Create(HANDLE hStdin, HANDLE hStdout, HANDLE hStderr)
+	{
+		if(!s_pInitializeAttributeList) {
+			EnterCriticalSection(&s_inheritLock);
+			m_bLocked = true;
+		}
+
+		// A handle given twice, stdout and a merged stderr, gets one copy.
+		// The list must not name a handle twice.
+		HANDLE handles[3] = { hStdin, hStdout, hStderr };
+		for(int i = 0; i < 3; ++i) {
+			int j;
+			for(j = 0; j < i && handles[j] != handles[i]; ++j)
+				;
+			if(j < i) {
+				m_handles[i] = m_handles[j];
+				continue;
+			}
+			if(!DuplicateHandle(GetCurrentProcess(), handles[i], GetCurrentProcess(),
+				&m_handles[i], 0, TRUE, DUPLICATE_SAME_ACCESS))
+				return RTERROR;
+			m_copies[m_nCopies++] = m_handles[i];
+		}
+		if(!s_pInitializeAttributeList)
+			return RTNORM;
+
+		SIZE_T nSize = 0;
+		s_pInitializeAttributeList(NULL, 1, 0, &nSize);
+		m_attributes.resize(nSize);
+		if(!nSize || !s_pInitializeAttributeList(&m_attributes[0], 1, 0, &nSize))
+			return RTERROR;
+		m_bList = true;
+		if(!s_pUpdateAttribute(&m_attributes[0], 0, SHELL_PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+			m_copies, m_nCopies * sizeof(HANDLE), NULL, NULL))
+			return RTERROR;
+		return RTNORM;
+	}
+
+	HANDLE Get(int nHandle) const { return m_handles[nHandle]; }
+	LPVOID GetAttributeList(void) { return m_bList ? &m_attributes[0] : NULL; }
+
+	// The child has its own copies once CreateProcess has returned.
+	void Close(void)
+	{
+		if(m_bList) {
+			s_pDeleteAttributeList(&m_attributes[0]);
+			m_bList = false;
+		}
+		while(m_nCopies)
+			::CloseHandle(m_copies[--m_nCopies]);
+		if(m_bLocked) {
+			LeaveCriticalSection(&s_inheritLock);
+			m_bLocked = false;
+		}
+	}
+
+private:
+	CInheritedHandles(const CInheritedHandles &);
+	CInheritedHandles & operator=(const CInheritedHandles &);
+
+	HANDLE m_handles[3];			// what the child gets as stdin, stdout and stderr
+	HANDLE m_copies[3];				// the distinct copies, to list and close
+	int m_nCopies;
+	std::vector<char> m_attributes;	// the attribute list
+	bool m_bList;					// m_attributes has been initialized
+	bool m_bLocked;					// s_inheritLock is held
+};
+
+// Starts the stages. The first reads the shell's stdin pipe and the last
+// writes its stdout pipe. In between, each stage writes a pipe the next
+// one reads, and nothing on our side touches that data.
+int CShellPipe::StartStages( size_t nStages, const TCHAR * const * ppApplicationNames,
+							const TCHAR * const * ppCommandLines )
+{
+	HANDLE hStderr = m_options.bMerged ? m_hChildWrite.Handle() : m_hChildError.Handle();
+	HANDLE hProcess = NULL;
+	if(nStages == 1) {
+		if(CreateChildProcess(ppApplicationNames[0], ppCommandLines[0], m_hChildRead.Handle(),
+			m_hChildWrite.Handle(), hStderr, hProcess) != RTNORM)
+			return SetErrorReturnCode();
+		m_hProcess = hProcess;
+		return RTNORM;
+	}
+
+	// Each stage only gets its own three handles, a stage holding the
+	// write end of a later stage's stdin would keep that stage from ever
+	// seeing the end of its input.
+	CShellHandle hStdin;	// read end of the pipe from the previous stage
+	for(size_t i = 0; i < nStages; ++i) {
+		bool bLast = i + 1 == nStages;
+		CShellHandle hNextStdin, hStdout;
+		if(!bLast && !CreatePipe(&hNextStdin.Handle(), &hStdout.Handle(), NULL, m_options.nPipeSize))
+			return SetErrorReturnCode();
+
+		if(CreateChildProcess(ppApplicationNames[i], ppCommandLines[i],
+			i ? hStdin.Handle() : m_hChildRead.Handle(),
+			bLast ? m_hChildWrite.Handle() : hStdout.Handle(), hStderr, hProcess) != RTNORM)
+			return SetErrorReturnCode();
+
+		if(bLast)
+			m_hProcess = hProcess;
+		else
+			m_stages.push_back(hProcess);
+
+		// the stages have their own copies of the pipe between them
+		hStdin.CloseHandle();
+		hStdin = hNextStdin.Handle();
+		hNextStdin.Handle() = NULL;
+	}
+	return RTNORM;
+}
+
+// Create a child process that uses the given handles for STDIN, STDOUT and STDERR.
+BOOL CShellPipe::CreateChildProcess( const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine,
+									HANDLE hStdin, HANDLE hStdout, HANDLE hStderr, HANDLE & hProcess )
 {
 	// Set up members of the PROCESS_INFORMATION structure. 
-//	PROCESS_INFORMATION pi;
-	memset(&m_pi, 0, sizeof(PROCESS_INFORMATION));
+	PROCESS_INFORMATION pi;
+	memset(&pi, 0, sizeof(PROCESS_INFORMATION));
 
 	// Set up members of the STARTUPINFO structure. 
 	// This structure specifies the STDIN and STDOUT handles for redirection.
-	STARTUPINFO si;
-	memset(&si, 0, sizeof(STARTUPINFO));
-	si.cb = sizeof(STARTUPINFO);
-	si.hStdError = m_hChildError.Handle();
-	si.hStdOutput = m_hChildWrite.Handle();
-	si.hStdInput = m_hChildRead.Handle();
-	si.dwFlags = STARTF_USESTDHANDLES;
+	// They are filled in with the inheritable copies further down.
+	ShellStartupInfoEx si;
+	memset(&si, 0, sizeof(ShellStartupInfoEx));
+	si.StartupInfo.cb = sizeof(STARTUPINFO);
+	si.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
 
 	// Expand environment variables in application name, so %ComSpec% would
-	// be expanded to c:\Windows\System32\cmd.exe or what ever the value is.	
-    TString sAppName;
-	if(ExpandEnvironmentString(pcszApplicationName, sAppName) != RTNORM) {
-		if(pcszApplicationName && !sAppName.size())
-			return RTERROR;
+	// be expanded to c:\Windows\System32\cmd.exe or what ever the value is.
+	// The same names are opened over and over, so the expansions are cached.
+	TString sAppName, sDirectory;
+	if(pcszApplicationName && g_shellEnvironment.Expand(pcszApplicationName, sAppName) != RTNORM)
+		return SetErrorReturnCode();
+	if(!m_options.sDirectory.empty() &&
+		g_shellEnvironment.Expand(m_options.sDirectory.c_str(), sDirectory) != RTNORM)
+		return SetErrorReturnCode();
+
+	// A child with variables of its own gets the cached block for them,
+	// otherwise it inherits AutoCAD's environment.
+	std::vector<TCHAR> environment;
+	DWORD dwCreationFlags = CREATE_SUSPENDED /*CREATE_NEW_CONSOLE*/;
+	if(!m_options.environment.empty()) {
+		if(g_shellEnvironment.GetBlock(m_options.environment, environment) != RTNORM)
+			return SetErrorReturnCode();
+#ifdef _UNICODE
+		dwCreationFlags |= CREATE_UNICODE_ENVIRONMENT;
+#endif
 	}
 
-    TString sBuffer = pcszCommandLine;
-    sBuffer.resize(_ENVIRONMENT_VARIABLE_LIMIT);    
+	// CreateProcess wants a writable command line, but never makes it
+	// longer, so a copy of the string will do.
+	TString sBuffer = pcszCommandLine ? pcszCommandLine : _T("");
+
+	// The child inherits copies of its three handles and nothing else.
+	// Where Windows has handle lists (Vista and later) the list names
+	// the copies, so a process another thread starts meanwhile can't
+	// get them. On XP every inheritable handle goes to every child, so
+	// the copies only exist while s_inheritLock is held, which every
+	// child started here takes.
+	CInheritedHandles inherited;
+	if(inherited.Create(hStdin, hStdout, hStderr) != RTNORM)
+		return SetErrorReturnCode();
+	si.StartupInfo.hStdInput = inherited.Get(0);
+	si.StartupInfo.hStdOutput = inherited.Get(1);
+	si.StartupInfo.hStdError = inherited.Get(2);
+	si.lpAttributeList = inherited.GetAttributeList();
+	if(si.lpAttributeList) {
+		si.StartupInfo.cb = sizeof(ShellStartupInfoEx);
+		dwCreationFlags |= SHELL_EXTENDED_STARTUPINFO_PRESENT;
+	}
 
-	// Create the child process. 
-	BOOL bVal = CreateProcess(sAppName.c_str(), &sBuffer[0], NULL, NULL, TRUE,
-		0 /*CREATE_NEW_CONSOLE*/, NULL, NULL, &si, &m_pi);
+	// Create the child process. It starts suspended so it can be put in
+	// the job before it gets a chance to start processes of its own.
+	BOOL bVal = CreateProcess(sAppName.empty() ? NULL : sAppName.c_str(),
+		sBuffer.empty() ? NULL : &sBuffer[0], NULL, NULL, TRUE, dwCreationFlags,
+		environment.empty() ? NULL : &environment[0],
+		sDirectory.empty() ? NULL : sDirectory.c_str(), &si.StartupInfo, &pi);
+	DWORD dwError = GetLastError();
+	inherited.Close();
 
-	if(!bVal)
+	if(!bVal) {
+		SetLastError(dwError);
 		return SetErrorReturnCode();
+	}
 
-	// Close handles to the child process and its primary thread.
-	// Some applications might keep these handles to monitor the status
-	// of the child process, for example. 
-	CloseHandle(m_pi.hProcess);
-	CloseHandle(m_pi.hThread);
+	// A stage that can't join the others' job is never resumed, the
+	// shell fails and closing the job ends the stages already running.
+	if(AssignJob(pi.hProcess) != RTNORM) {
+		DWORD dwError = GetLastError();
+		TerminateProcess(pi.hProcess, ERROR_CANCELLED);
+		CloseHandle(pi.hThread);
+		CloseHandle(pi.hProcess);
+		SetLastError(dwError);
+		return SetErrorReturnCode();
+	}
+
+	// Keep the process handle to wait for, inspect and terminate the child.
+	hProcess = pi.hProcess;
+	ResumeThread(pi.hThread);
+	CloseHandle(pi.hThread);
 
 	return RTNORM;
 }
 
+// Puts the child in a job object that terminates everything in it when
+// the job handle is closed, so the whole process tree of the shell can
+// be killed and nothing outlives its CShellPipe. Failing to create the
+// job, or to put the first stage in it, is not an error, an AutoCAD
+// already running in a job that forbids nested jobs just gets the old
+// behaviour. Closing the job then is safe, nothing else is in it yet.
+// Once the first stage is in the job every later stage has to be too,
+// or KillShell would miss it.
+int CShellPipe::AssignJob( HANDLE hProcess )
+{
+	bool bFirst = m_stages.empty() && !m_hProcess.IsValid();
+	if(bFirst) {
+		m_hJob = CreateJobObject(NULL, NULL);
+		if(!m_hJob.IsValid())
+			return RTNORM;
+
+		JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+		memset(&limits, 0, sizeof(limits));
+		limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+		if(!SetInformationJobObject(m_hJob.Handle(), JobObjectExtendedLimitInformation,
+			&limits, sizeof(limits))) {
+			m_hJob.CloseHandle();
+			return RTNORM;
+		}
+	} else if(!m_hJob.IsValid())
+		return RTNORM; // the first stage runs without a job, so do the rest
+
+	if(AssignProcessToJobObject(m_hJob.Handle(), hProcess))
+		return RTNORM;
+	if(bFirst) {
+		m_hJob.CloseHandle();
+		return RTNORM;
+	}
+	return RTERROR;
+}
+
 // Writes pcszString to the child process's pipe for STDIN.
 // This function can be called repeatedly to write more data,
 // up until ReadShellPipe is called, at which point the
@@ -177,28 +714,77 @@ BOOL CShellPipe::CreateChildProcess( const TCHAR * pcszApplicationName, const TC
 // 
 int CShellPipe::WriteShellData( const TCHAR * pcszString )
 {
-#ifdef _UNICODE
-	// convert unicode to ASCII
-	DWORD dwWritten;
-	DWORD nBufLength = WideCharToMultiByte(CP_UTF8, 0, pcszString, -1, 0, 0, NULL, NULL);
-    std::string sBuf;
-    sBuf.resize(nBufLength);
-    // Use strlen so terminating NULL in not written to the buffer. Otherwise
-    // string will include /r/n conversion and that is not wanted.
-    // version of the string will include /r/n, and that is not wanted.
-	WideCharToMultiByte(CP_UTF8, 0, pcszString, -1, &sBuf[0], nBufLength, NULL, NULL);
-	BOOL bVal = WriteFile(m_hParentWrite.Handle(), sBuf.c_str(), strlen(sBuf.c_str()), &dwWritten, NULL);
-	if(!bVal) {
-		return SetErrorReturnCode();
+	m_sWriteBuffer.erase();
+	m_stdinEncoder.Encode(pcszString, _tcslen(pcszString), m_sWriteBuffer);
+	DWORD nWritten;
+	return WriteBuffer(nWritten);
+}
+
+int CShellPipe::WriteShellData( const std::vector<const TCHAR *> & strings, DWORD & nWritten )
+{
+	// Encode everything first, so it all goes in one write. The
+	// terminating NULLs are not written.
+	m_sWriteBuffer.erase();
+	for(size_t i = 0; i < strings.size(); ++i)
+		m_stdinEncoder.Encode(strings[i], _tcslen(strings[i]), m_sWriteBuffer);
+	return WriteBuffer(nWritten);
+}
+
+int CShellPipe::WriteShellBinary( const char * pBytes, size_t nBytes, DWORD & nWritten )
+{
+	m_sWriteBuffer.assign(pBytes, nBytes);
+	return WriteBuffer(nWritten);
+}
+
+int CShellPipe::WriteBuffer( DWORD & nWritten )
+{
+	nWritten = 0;
+	if(m_bDeferred) {
+		// stdin is part of a cached shell's key, keep it until the first read
+		m_sDeferredInput += m_sWriteBuffer;
+		nWritten = (DWORD) m_sWriteBuffer.size();
+		SetLastShellError(0);
+		return RTNORM;
 	}
-	return RTNORM;
-#else
-	DWORD dwWritten;
-	if(!WriteFile(m_hParentWrite.Handle(), pcszString, strlen(pcszString), &dwWritten, NULL)) {
-		return SetErrorReturnCode();
+	if(m_writer.IsRunning()) {
+		if(m_writer.IsClosing()) {
+			// same as writing to a closed pipe
+			SetLastShellError(ERROR_INVALID_HANDLE);
+			return RTERROR;
+		}
+		// Only waits when the queue is full and the policy is to block,
+		// in slices short enough to notice ESC quickly.
+		DWORD dwWait = m_options.bCheckUserBreak ? USER_BREAK_INTERVAL : INFINITE;
+		for(;;) {
+			DWORD nQueued;
+			int nResult = m_writer.Write(m_sWriteBuffer.data() + nWritten,
+				(DWORD) m_sWriteBuffer.size() - nWritten, nQueued, dwWait);
+			nWritten += nQueued;
+			if(nResult == RTERROR) {
+				// either an earlier write failed or the queue is full
+				DWORD dwError = m_writer.GetError();
+				SetLastShellError(dwError ? dwError : ERROR_BUSY);
+				return RTERROR;
+			}
+			if(nResult == RTNORM) {
+				SetLastShellError(0);
+				return RTNORM;
+			}
+			if(UserBreak())
+				return RTERROR;
+		}
+	}
+
+	// a blocking pipe write only returns early on errors
+	while(nWritten < m_sWriteBuffer.size()) {
+		DWORD dwWritten;
+		if(!WriteFile(m_hParentWrite.Handle(), m_sWriteBuffer.data() + nWritten,
+			(DWORD) m_sWriteBuffer.size() - nWritten, &dwWritten, NULL)) {
+			return SetErrorReturnCode();
+		}
+		nWritten += dwWritten;
 	}
 	return RTNORM;
-#endif
 }
 
 
@@ -207,39 +793,640 @@ int CShellPipe::WriteShellData( const TCHAR * pcszString )
 // and write to sResults. This function can be called
 // repeatedly to get more data. If no more data to read
 // then it returns RTERROR
-int CShellPipe::ReadShellData( TString & sResults )
+int CShellPipe::ReadShellData( TString & sResults, DWORD dwTimeout )
+{
+	return ReadStream(kStdout, sResults, dwTimeout);
+}
+
+// Same as ReadShellData for the child process's STDERR.
+int CShellPipe::ReadShellError( TString & sResults )
+{
+	return ReadStream(kStderr, sResults, INFINITE);
+}
+
+int CShellPipe::ReadShellBinary( std::string & sBytes, DWORD nMax )
+{
+	sBytes.erase();
+	if(m_nAheadHead == m_sReadAhead.size()) {
+		DWORD dwRead;
+		int nResult = FillReadAhead(std::max<DWORD>(m_options.nReadAhead, nMax), dwRead);
+		if(nResult != RTNORM)
+			return nResult;
+	}
+
+	DWORD dwRead = (DWORD) std::min<size_t>(m_sReadAhead.size() - m_nAheadHead, nMax);
+	sBytes.assign(m_sReadAhead.data() + m_nAheadHead, dwRead);
+	m_nAheadHead += dwRead;
+	m_nLineScanned = 0;
+
+	SetLastShellError(0);
+	return RTNORM;
+}
+
+int CShellPipe::ReadShellBinary( const TCHAR * pcszPath, ULONGLONG & nBytes )
+{
+	nBytes = 0;
+	CShellHandle hFile;
+	hFile = CreateFile(pcszPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(hFile.Handle() == INVALID_HANDLE_VALUE) {
+		hFile.Handle() = NULL;
+		return SetErrorReturnCode();
+	}
+
+	// start with anything the text reads left behind
+	DWORD dwRead;
+	while(m_nAheadHead < m_sReadAhead.size()
+		|| FillReadAhead(std::max<DWORD>(m_options.nReadAhead, READ_ALL_SIZE), dwRead) == RTNORM) {
+		DWORD dwWrite = (DWORD) (m_sReadAhead.size() - m_nAheadHead), dwWritten;
+		if(!WriteFile(hFile.Handle(), m_sReadAhead.data() + m_nAheadHead, dwWrite, &dwWritten, NULL))
+			return SetErrorReturnCode();
+		m_nAheadHead += dwWrite;
+		nBytes += dwWrite;
+	}
+	m_nLineScanned = 0;
+
+	// Running out of data is how the loop normally ends, same as ReadShellAll.
+	DWORD dwError = GetLastShellError();
+	if(dwError != ERROR_BROKEN_PIPE && dwError != ERROR_HANDLE_EOF && dwError != 0)
+		return RTERROR;
+
+	SetLastShellError(0);
+	return RTNORM;
+}
+
+// Gets the number of stdout bytes that can be read without blocking.
+int CShellPipe::ShellDataAvailable( DWORD & nBytes )
+{
+	// a cached shell still running has nothing to read without waiting
+	nBytes = 0;
+	int nResult = ResolveCached(0);
+	if(nResult == RTNONE) {
+		SetLastShellError(0);
+		return RTNORM;
+	}
+	if(nResult != RTNORM)
+		return RTERROR;
+	nBytes = (DWORD) (m_sReadAhead.size() - m_nAheadHead);
+
+	if(m_options.bPumped) {
+		nBytes += m_stdout.GetSize();
+		if(!nBytes && m_stdout.IsEof()) {
+			SetLastShellError(m_stdout.GetError());
+			return RTERROR;
+		}
+		return RTNORM;
+	}
+
+	DWORD nAvailable = 0;
+	if(!PeekNamedPipe(m_hParentRead.Handle(), NULL, 0, NULL, &nAvailable, NULL)) {
+		if(nBytes)
+			return RTNORM;
+		return SetErrorReturnCode(); // the child has closed stdout
+	}
+	nBytes += nAvailable;
+	return RTNORM;
+}
+
+int CShellPipe::ReadStream( Stream stream, TString & sResults, DWORD dwTimeout )
+{
+	// Stdout is read a whole read-ahead buffer at a time and handed out
+	// in pieces small enough for acedRetStr. A piece holding nothing but
+	// the start of a character decodes to nothing, so keep going.
+	CTextDecoder & decoder = stream == kStdout ? m_stdoutDecoder : m_stderrDecoder;
+	char buffer[ADS_BUFFER_SIZE];
+	do {
+		DWORD dwRead;
+		int nResult = RTNORM;
+		if(stream == kStderr)
+			nResult = ReadBytes(stream, buffer, ADS_BUFFER_SIZE - 1, dwRead, dwTimeout);
+		else if(m_nAheadHead == m_sReadAhead.size())
+			nResult = FillReadAhead(m_options.nReadAhead, dwRead, dwTimeout);
+
+		if(nResult == RTERROR && decoder.GetPending() && IsEndOfStream(GetLastShellError())) {
+			// the stream ended in the middle of a character
+			decoder.Decode(NULL, 0, sResults, true);
+			break;
+		}
+		if(nResult != RTNORM) {
+			sResults.erase();
+			return nResult;
+		}
+
+		if(stream == kStderr)
+			decoder.Decode(buffer, dwRead, sResults);
+		else {
+			dwRead = (DWORD) std::min<size_t>(m_sReadAhead.size() - m_nAheadHead, ADS_BUFFER_SIZE - 1);
+			decoder.Decode(m_sReadAhead.data() + m_nAheadHead, dwRead, sResults);
+			m_nAheadHead += dwRead;
+			m_nLineScanned = 0;
+		}
+	} while(sResults.empty());
+	
+	SetLastShellError(0);
+	return RTNORM;
+}
+
+int CShellPipe::FillReadAhead( DWORD nMax, DWORD & nRead, DWORD dwTimeout )
 {
+	if(m_nAheadHead == m_sReadAhead.size()) {
+		m_sReadAhead.erase();
+		m_nAheadHead = 0;
+	} else if(m_nAheadHead) {
+		m_sReadAhead.erase(0, m_nAheadHead);
+		m_nAheadHead = 0;
+	}
+
+	// erase and resize keep the capacity, so this only allocates
+	// until the buffer has grown to its working size
+	size_t nSize = m_sReadAhead.size();
+	m_sReadAhead.resize(nSize + nMax);
+	int nResult = ReadBytes(kStdout, &m_sReadAhead[nSize], nMax, nRead, dwTimeout);
+	if(nResult != RTNORM)
+		nRead = 0;
+	m_sReadAhead.resize(nSize + nRead);
+	return nResult;
+}
+
+// Reads stdout until the child closes it, then splits the text into
+// strings short enough to hand back to Autolisp, or into lines.
+int CShellPipe::ReadShellAll( std::vector<TString> & results, bool bLines )
+{
+	results.clear();
+
+	// start with anything ReadShellData or ReadShellLines left behind
 	DWORD dwRead;
-    std::string sBuf;
-    sBuf.resize(ADS_BUFFER_SIZE);
+	while(FillReadAhead(std::max<DWORD>(m_options.nReadAhead, READ_ALL_SIZE), dwRead) == RTNORM)
+		;
+	m_nLineScanned = 0;
+	DWORD dwTotal = (DWORD) m_sReadAhead.size();
+
+	// Running out of data is how the loop normally ends. Anything
+	// other than a broken pipe at that point is a real error.
+	DWORD dwError = GetLastShellError();
+	if(dwError != ERROR_BROKEN_PIPE && dwError != ERROR_HANDLE_EOF && dwError != 0)
+		return RTERROR;
+	if(!dwTotal)
+		return RTERROR;
 
-	// Close the write end of the pipes before reading from the 
-	// read end of the pipe, to control child process execution.
+	if(bLines) {
+		// split the raw bytes, then convert each line
+		const char * p = m_sReadAhead.data(), * pEnd = p + dwTotal;
+		while(p < pEnd) {
+			size_t nLength;
+			const char * pNext;
+			FindLine(p, p, pEnd, true, nLength, pNext);
+			results.push_back(TString());
+			m_stdoutDecoder.Decode(p, nLength, results.back(), true);
+			p = pNext;
+		}
+	} else {
+		TString sText;
+		m_stdoutDecoder.Decode(m_sReadAhead.data(), dwTotal, sText, true);
+		for(TString::size_type nStart = 0; nStart < sText.size(); nStart += ADS_BUFFER_SIZE - 1)
+			results.push_back(sText.substr(nStart, ADS_BUFFER_SIZE - 1));
+	}
+	// stdout has ended, so give back what may be a very large buffer
+	std::string().swap(m_sReadAhead);
+	m_nAheadHead = 0;
+
+	SetLastShellError(0);
+	return RTNORM;
+}
+
+// Returns complete lines of stdout. Bytes after the last line feed are
+// kept in m_sReadAhead until the rest of their line arrives.
+int CShellPipe::ReadShellLines( std::vector<TString> & lines, int nMaxLines )
+{
+	lines.clear();
+	if(nMaxLines <= 0)
+		nMaxLines = INT_MAX;
+
+	bool bEof = false;
+	for(;;) {
+		// Hand out the complete lines already in the read-ahead buffer.
+		// m_nLineScanned skips bytes already known not to hold a '\n'.
+		const char * pBegin = m_sReadAhead.data() + m_nAheadHead;
+		const char * pEnd = m_sReadAhead.data() + m_sReadAhead.size();
+		const char * p = pBegin;
+		const char * pScan = pBegin + m_nLineScanned;
+		while((int) lines.size() < nMaxLines && p < pEnd) {
+			size_t nLength;
+			const char * pNext;
+			if(!FindLine(p, pScan, pEnd, bEof, nLength, pNext))
+				break;
+			lines.push_back(TString());
+			m_stdoutDecoder.Decode(p, nLength, lines.back(), true);
+			p = pScan = pNext;
+		}
+		m_nAheadHead += p - pBegin;
+		m_nLineScanned = (lines.size() < (size_t) nMaxLines) ? m_sReadAhead.size() - m_nAheadHead : 0;
+		// in UTF-16 a "\n" in the last byte read may yet turn out to be a line feed
+		if(m_nLineScanned && m_options.encoding == kEncodingUtf16)
+			--m_nLineScanned;
+
+		if(!lines.empty()) {
+			SetLastShellError(0);
+			return RTNORM;
+		}
+		if(bEof)
+			return RTERROR;
+
+		// no complete line yet, read some more. FillReadAhead moves
+		// the partial line to the front, m_nLineScanned still applies.
+		DWORD dwRead;
+		int nResult = FillReadAhead(std::max<DWORD>(m_options.nReadAhead, READ_ALL_SIZE), dwRead);
+		if(nResult != RTNORM) {
+			// Only the end of the stream makes the partial line left the
+			// last line. After ESC or an error it waits for the next call.
+			if(nResult != RTERROR || !IsEndOfStream(GetLastShellError()))
+				return nResult;
+			bEof = true;
+		}
+	}
+}
+
+bool CShellPipe::FindLine( const char * pLine, const char * pScan, const char * pEnd, bool bEof,
+						  size_t & nLength, const char *& pNext ) const
+{
+	const char * pNewline = FindNewline(pScan, pEnd);
+	if(m_options.encoding == kEncodingUtf16) {
+		// Skip 0x0A bytes that are half of another character. Bytes the
+		// decoder still holds from an earlier read count for the offset.
+		size_t nOffset = m_stdoutDecoder.GetPending();
+		while(pNewline != pEnd && ((pNewline - pLine + nOffset) % 2 || pNewline + 1 == pEnd || pNewline[1]))
+			pNewline = FindNewline(pNewline + 1, pEnd);
+		if(pNewline == pEnd && !bEof)
+			return false;
+
+		nLength = pNewline - pLine;
+		if(nLength >= 2 && pNewline[-2] == '\r' && !pNewline[-1])
+			nLength -= 2;
+		pNext = pNewline == pEnd ? pEnd : pNewline + 2;
+		return true;
+	}
+
+	if(pNewline == pEnd && !bEof)
+		return false;
+	nLength = LineLength(pLine, pNewline);
+	pNext = pNewline == pEnd ? pEnd : pNewline + 1;
+	return true;
+}
+
+int CShellPipe::ReadBytes( Stream stream, char * pBuf, DWORD nMax, DWORD & nRead, DWORD dwTimeout )
+{
+	nRead = 0;
+	DWORD dwStart = GetTickCount();
+	int nResolved = ResolveCached(dwTimeout);
+	if(nResolved != RTNORM)
+		return nResolved;
+
+	// Close stdin before reading, to control child process execution.
 	// The pipe is assumed to have enough buffer space to hold the
 	// data the child process has already written to it.
-	if(!m_hChildWrite.CloseHandle())
+	// Full duplex shells keep stdin open until CloseShellInput.
+	if(!m_options.bDuplex && CloseShellInput() != RTNORM) // needs to be closed if writing to pipe was done
+		return RTERROR;  // (thread will hang otherwise. Safe to just close it.
+
+	if(m_options.bPumped) {
+		// Wait in slices short enough to notice ESC quickly.
+		CShellBuffer & buffer = stream == kStdout ? m_stdout : m_stderr;
+		for(;;) {
+			DWORD dwLeft = TimeLeft(dwStart, dwTimeout);
+			DWORD dwWait = m_options.bCheckUserBreak ? std::min<DWORD>(dwLeft, USER_BREAK_INTERVAL) : dwLeft;
+			int nResult = buffer.Read(pBuf, nMax, nRead, dwWait);
+			if(nResult == RTERROR)
+				SetLastShellError(buffer.GetError());
+			if(nResult != RTNONE)
+				return nResult;
+			if(UserBreak())
+				return RTERROR;
+			if(dwWait == dwLeft)
+				return RTNONE;
+		}
+	}
+
+	CShellHandle & hPipe = stream == kStdout ? m_hParentRead : m_hParentError;
+	if(!hPipe.IsValid()) {
+		// merged shells have no separate stderr pipe, captured streams no pipe at all
+		SetLastShellError(ERROR_INVALID_HANDLE);
+		return RTERROR;
+	}
+
+	if(dwTimeout != INFINITE || m_options.bCheckUserBreak) {
+		// A ReadFile on an anonymous pipe can't time out or be cancelled,
+		// so poll until data arrives. Once PeekNamedPipe fails the stream
+		// has ended, and the ReadFile below returns that error.
+		DWORD nAvailable = 0;
+		while(PeekNamedPipe(hPipe.Handle(), NULL, 0, NULL, &nAvailable, NULL) && !nAvailable) {
+			if(UserBreak())
+				return RTERROR;
+			DWORD dwLeft = TimeLeft(dwStart, dwTimeout);
+			if(!dwLeft)
+				return RTNONE;
+			Sleep(std::min<DWORD>(POLL_INTERVAL, dwLeft));
+		}
+		if(nAvailable && nAvailable < nMax)
+			nMax = nAvailable;
+	}
+
+	if(!ReadFile(hPipe.Handle(), pBuf, nMax, &nRead, NULL) || nRead == 0)
+		return SetErrorReturnCode();
+	return RTNORM;
+}
+
+int CShellPipe::StartPump( void )
+{
+	m_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if(!m_hStopEvent.IsValid())
 		return SetErrorReturnCode();
-	if(!m_hParentWrite.CloseHandle()) // needs to be closed if writing to pipe was done
-		return SetErrorReturnCode();  // (thread will hang otherwise. Safe to just close it.
 
-	if(!ReadFile(m_hParentRead.Handle(), &sBuf[0], ADS_BUFFER_SIZE - 1, &dwRead, NULL) || dwRead == 0)
+	unsigned nThreadId;
+	m_hPumpThread = (HANDLE) _beginthreadex(NULL, 0, PumpThread, this, 0, &nThreadId);
+	if(!m_hPumpThread.IsValid())
 		return SetErrorReturnCode();
-	sBuf[dwRead] = _T('\0');
-#ifdef _UNICODE
-    DWORD dwSize = MultiByteToWideChar(CP_UTF8, 0, sBuf.c_str(), -1, 0, 0);
-    sResults.resize(dwSize);
-    MultiByteToWideChar(CP_UTF8, 0, sBuf.c_str(), -1, &sResults[0], dwSize);
-#else
-    sResults = sBuf.c_str();
-#endif
-	
-	m_dwLastError = 0;
 	return RTNORM;
 }
 
+void CShellPipe::StopPump( void )
+{
+	if(!m_hPumpThread.IsValid())
+		return;
+	SetEvent(m_hStopEvent.Handle());
+	WaitForSingleObject(m_hPumpThread.Handle(), INFINITE);
+	m_hPumpThread.CloseHandle();
+	m_hStopEvent.CloseHandle();
+}
+
+// One pipe read end serviced by the pump thread
+struct PumpStream
+{
+	HANDLE hPipe;			// overlapped read end
+	CShellBuffer * pBuffer;	// where the bytes go
+	OVERLAPPED ov;
+	CShellHandle hEvent;	// signaled when the pending read completes
+	bool bPending;			// a read has been issued and not yet completed
+	bool bFull;				// waiting for the reader to make room in pBuffer
+	std::vector<char> buffer;
+};
+
+// Drains the child's stdout and stderr into m_stdout and m_stderr until
+// the child closes its ends of the pipes or StopPump is called. A single
+// wait covers the stop event and every outstanding read. A stream whose
+// buffer is at its limit gets no read until the reader makes room, the
+// wait covers that too.
+unsigned __stdcall CShellPipe::PumpThread( void * pParam )
+{
+	CShellPipe * pThis = (CShellPipe *) pParam;
+
+	// captured streams have no pipe to pump
+	PumpStream streams[2];
+	int nStreams = 0;
+	if(pThis->m_hParentRead.IsValid()) {
+		streams[nStreams].hPipe = pThis->m_hParentRead.Handle();
+		streams[nStreams++].pBuffer = &pThis->m_stdout;
+	} else
+		pThis->m_stdout.SetEof(ERROR_INVALID_HANDLE);
+	if(pThis->m_hParentError.IsValid()) {
+		streams[nStreams].hPipe = pThis->m_hParentError.Handle();
+		streams[nStreams++].pBuffer = &pThis->m_stderr;
+	} else
+		pThis->m_stderr.SetEof(ERROR_INVALID_HANDLE);
+
+	int i;
+	// read as much at once as the reader takes at once
+	for(i = 0; i < nStreams; ++i) {
+		streams[i].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		streams[i].bPending = false;
+		streams[i].buffer.resize(std::max<DWORD>(pThis->m_options.nReadAhead, PUMP_BUFFER_SIZE));
+	}
+
+	int nOpen = nStreams;
+	while(nOpen) {
+		// Issue a read on every open stream that doesn't have one
+		// outstanding. Reads that complete at once are handled here.
+		HANDLE hWaits[3];
+		int nWaitStream[3];
+		DWORD nWaits = 0;
+		hWaits[nWaits++] = pThis->m_hStopEvent.Handle();
+
+		for(i = 0; i < nStreams; ++i) {
+			PumpStream & s = streams[i];
+			s.bFull = false;
+			while(s.hPipe && !s.bPending) {
+				if(s.pBuffer->IsFull()) {
+					s.bFull = true;
+					break;
+				}
+				memset(&s.ov, 0, sizeof(OVERLAPPED));
+				s.ov.hEvent = s.hEvent.Handle();
+				DWORD dwRead = 0;
+				if(ReadFile(s.hPipe, &s.buffer[0], (DWORD) s.buffer.size(), &dwRead, &s.ov)) {
+					s.pBuffer->Append(&s.buffer[0], dwRead);
+					continue;
+				}
+				DWORD dwError = GetLastError();
+				if(dwError == ERROR_IO_PENDING) {
+					s.bPending = true;
+					break;
+				}
+				// A broken pipe is the normal way for the stream to end.
+				s.pBuffer->SetEof(dwError);
+				s.hPipe = NULL;
+				--nOpen;
+			}
+			if(s.bPending) {
+				nWaitStream[nWaits] = i;
+				hWaits[nWaits++] = s.hEvent.Handle();
+			} else if(s.bFull) {
+				nWaitStream[nWaits] = i;
+				hWaits[nWaits++] = s.pBuffer->GetRoomEvent();
+			}
+		}
+		if(!nOpen)
+			break;
+
+		DWORD dwWait = WaitForMultipleObjects(nWaits, hWaits, FALSE, INFINITE);
+		if(dwWait <= WAIT_OBJECT_0 || dwWait >= WAIT_OBJECT_0 + nWaits)
+			break; // asked to stop, or the wait itself failed
+
+		PumpStream & s = streams[nWaitStream[dwWait - WAIT_OBJECT_0]];
+		if(s.bFull)
+			continue; // there is room again, the next read is issued above
+		s.bPending = false;
+		DWORD dwRead = 0;
+		if(GetOverlappedResult(s.hPipe, &s.ov, &dwRead, FALSE))
+			s.pBuffer->Append(&s.buffer[0], dwRead);
+		else {
+			s.pBuffer->SetEof(GetLastError());
+			s.hPipe = NULL;
+			--nOpen;
+		}
+	}
+
+	// Cancel anything still outstanding, the buffers must not be
+	// written once this thread has returned.
+	for(i = 0; i < nStreams; ++i) {
+		PumpStream & s = streams[i];
+		if(!s.hPipe)
+			continue;
+		if(s.bPending) {
+			DWORD dwRead;
+			CancelIo(s.hPipe);
+			GetOverlappedResult(s.hPipe, &s.ov, &dwRead, TRUE);
+		}
+		s.pBuffer->SetEof(ERROR_OPERATION_ABORTED);
+	}
+	return 0;
+}
+
+// Replaces every occurrence of pcszName in s by pcszValue.
+static void ReplaceAll( TString & s, const TCHAR * pcszName, const TCHAR * pcszValue )
+{
+	size_t nName = _tcslen(pcszName), nValue = _tcslen(pcszValue);
+	for(TString::size_type nPos = s.find(pcszName); nPos != TString::npos;
+		nPos = s.find(pcszName, nPos + nValue))
+		s.replace(nPos, nName, pcszValue);
+}
+
+// Runs one command in a long lived shell. The command is followed by
+// a command that prints a unique sentinel and the exit status, and
+// everything read before the sentinel is the command's output. The
+// sentinel command gets the sentinel in two halves that it prints as
+// one, so a shell echoing the command line never shows the sentinel.
+int CShellPipe::ExecInShell( const TCHAR * pcszCommand, std::vector<TString> & lines, int & nExitCode )
+{
+	lines.clear();
+	nExitCode = -1;
+
+	// Without duplex the first read would close stdin and end the session.
+	// Stderr must be drained while stdout is read up to the sentinel, or a
+	// command that fills the stderr pipe blocks and the sentinel never comes.
+	if(!m_options.bDuplex || (!m_options.bPumped && !m_options.bMerged
+		&& m_options.sStderrFile.empty())) {
+		SetLastShellError(ERROR_INVALID_FUNCTION);
+		return RTERROR;
+	}
+
+	static LONG nSerial = 0;
+	TCHAR szFirst[32], szSecond[32], szSentinel[64];
+	_stprintf(szFirst, _T("__RUNSHELL_%08x"), GetCurrentProcessId());
+	_stprintf(szSecond, _T("_%08x__"), InterlockedIncrement(&nSerial));
+	_stprintf(szSentinel, _T("%s%s"), szFirst, szSecond);
+
+	TString sCommand = pcszCommand;
+	sCommand += _T("\r\n");
+	TString sSentinelCommand = m_options.sSentinelCommand;
+	ReplaceAll(sSentinelCommand, _T("%SENTINEL1%"), szFirst);
+	ReplaceAll(sSentinelCommand, _T("%SENTINEL2%"), szSecond);
+	ReplaceAll(sSentinelCommand, _T("%SENTINEL%"), szSentinel);
+	sCommand += sSentinelCommand;
+	sCommand += _T("\r\n");
+
+	if(WriteShellData(sCommand.c_str()) != RTNORM)
+		return RTERROR;
+
+	std::vector<TString> line;
+	while(ReadShellLines(line, 1) == RTNORM) {
+		// A sentinel command given whole, with %SENTINEL%, is echoed with
+		// the sentinel in it, but followed by the command's text instead
+		// of the exit status.
+		TString::size_type nPos = line[0].find(szSentinel);
+		const TCHAR * pcszStatus = nPos == TString::npos ? NULL
+			: line[0].c_str() + nPos + _tcslen(szSentinel);
+		while(pcszStatus && *pcszStatus == _T(' '))
+			++pcszStatus;
+		if(!pcszStatus || (*pcszStatus != _T('-') && !_istdigit(*pcszStatus))) {
+			lines.push_back(line[0]);
+			continue;
+		}
+		// output that didn't end with a line end shares the sentinel's line
+		if(nPos)
+			lines.push_back(line[0].substr(0, nPos));
+		nExitCode = _ttoi(pcszStatus);
+		SetLastShellError(0);
+		return RTNORM;
+	}
+	// the shell ended before printing the sentinel
+	return RTERROR;
+}
+
+int CShellPipe::FlushShellInput( DWORD dwTimeout )
+{
+	if(!m_writer.IsRunning())
+		return RTNORM;
+
+	// Wait in slices short enough to notice ESC quickly.
+	DWORD dwStart = GetTickCount();
+	for(;;) {
+		DWORD dwLeft = TimeLeft(dwStart, dwTimeout);
+		DWORD dwWait = m_options.bCheckUserBreak ? std::min<DWORD>(dwLeft, USER_BREAK_INTERVAL) : dwLeft;
+		int nResult = m_writer.Flush(dwWait);
+		if(nResult == RTERROR)
+			SetLastShellError(m_writer.GetError());
+		if(nResult != RTNONE)
+			return nResult;
+		if(UserBreak())
+			return RTERROR;
+		if(dwWait == dwLeft)
+			return RTNONE;
+	}
+}
+
+int CShellPipe::WriteShellFile( const TCHAR * pcszPath, ULONGLONG nOffset, ULONGLONG nLength )
+{
+	// only the writer thread can keep writing after this returns
+	if(m_writer.QueueFile(pcszPath, nOffset, nLength) != RTNORM)
+		return SetErrorReturnCode();
+	SetLastShellError(0);
+	return RTNORM;
+}
+
+int CShellPipe::GetShellFileProgress( ULONGLONG & nSent, ULONGLONG & nTotal )
+{
+	int nResult = m_writer.GetFileProgress(nSent, nTotal);
+	if(nResult == RTERROR) {
+		DWORD dwError = m_writer.GetError();
+		SetLastShellError(dwError ? dwError : ERROR_INVALID_FUNCTION);
+	}
+	return nResult;
+}
+
+int CShellPipe::CloseShellInput(void)
+{
+	if(m_writer.IsRunning()) {
+		// The writer thread closes stdin once the child has what is
+		// queued. Waiting for that here would hang on a child that fills
+		// its stdout while nothing reads it.
+		m_writer.CloseWhenDone();
+		return RTNORM;
+	}
+	if(!m_hParentWrite.CloseHandle())
+		return SetErrorReturnCode();
+	return RTNORM;
+}
+
+// Closes the pipes, then waits for the child to exit. Closing the pipes
+// first means a child blocked reading stdin or writing its output sees
+// the end of the stream instead of waiting for us forever.
 int CShellPipe::CloseShell(void)
 {
-    WaitForSingleObject(m_pi.hProcess, INFINITE);
+	ClosePipes();
+	if(WaitShell(INFINITE) != RTNORM)
+		return RTERROR;
+
+	SetLastShellError(0);
+	return RTNORM;
+}
+
+void CShellPipe::ClosePipes(void)
+{
+	// a cached shell that was never read is never started, and one
+	// stopped before it ended isn't stored
+	m_bDeferred = false;
+	m_bCaching = false;
+	StopPump();
+	m_writer.Stop();
 
 	m_hChildError.CloseHandle();
 	m_hChildWrite.CloseHandle();
@@ -247,27 +1434,155 @@ int CShellPipe::CloseShell(void)
 	m_hParentWrite.CloseHandle();
 	m_hParentRead.CloseHandle();
 	m_hParentError.CloseHandle();
+}
+
+int CShellPipe::GetShellExitCode( DWORD & dwExitCode )
+{
+	if(ResolveCached(0) == RTERROR)
+		return RTERROR;
+	if(m_bCacheHit) {
+		dwExitCode = m_cachedExitCodes.back();
+		return RTNORM;
+	}
+	if(!m_hProcess.IsValid()) {
+		SetLastShellError(ERROR_INVALID_HANDLE);
+		return RTERROR;
+	}
+	// STILL_ACTIVE is also a valid exit code, so ask if it has exited
+	if(WaitForSingleObject(m_hProcess.Handle(), 0) != WAIT_OBJECT_0)
+		return RTNONE;
+	if(!GetExitCodeProcess(m_hProcess.Handle(), &dwExitCode))
+		return SetErrorReturnCode();
+	return RTNORM;
+}
+
+int CShellPipe::GetShellExitCodes( std::vector<DWORD> & exitCodes, std::vector<bool> & exited )
+{
+	exitCodes.clear();
+	exited.clear();
+	if(ResolveCached(0) == RTERROR)
+		return RTERROR;
+	if(m_bCacheHit) {
+		exitCodes = m_cachedExitCodes;
+		exited.assign(exitCodes.size(), true);
+		return RTNORM;
+	}
+	if(!m_hProcess.IsValid()) {
+		SetLastShellError(ERROR_INVALID_HANDLE);
+		return RTERROR;
+	}
+
+	int nResult = RTNORM;
+	for(size_t i = 0; i <= m_stages.size(); ++i) {
+		HANDLE hProcess = i < m_stages.size() ? m_stages[i] : m_hProcess.Handle();
+		DWORD dwExitCode = 0;
+		bool bExited = WaitForSingleObject(hProcess, 0) == WAIT_OBJECT_0;
+		if(bExited && !GetExitCodeProcess(hProcess, &dwExitCode))
+			return SetErrorReturnCode();
+		if(!bExited)
+			nResult = RTNONE;
+		exitCodes.push_back(dwExitCode);
+		exited.push_back(bExited);
+	}
+	return nResult;
+}
 
-	m_dwLastError = 0;
+int CShellPipe::KillShell( UINT nExitCode )
+{
+	if(m_bDeferred || m_bCacheHit) {
+		// nothing is running, a cached shell not started yet never will be
+		if(m_bDeferred) {
+			m_bDeferred = false;
+			m_stdout.SetEof(ERROR_OPERATION_ABORTED);
+			m_stderr.SetEof(ERROR_OPERATION_ABORTED);
+		}
+		SetLastShellError(0);
+		return RTNORM;
+	}
+	if(m_hJob.IsValid()) {
+		if(!TerminateJobObject(m_hJob.Handle(), nExitCode))
+			return SetErrorReturnCode();
+	} else if(m_hProcess.IsValid()) {
+		for(size_t i = 0; i < m_stages.size(); ++i)
+			TerminateProcess(m_stages[i], nExitCode);
+		if(!TerminateProcess(m_hProcess.Handle(), nExitCode))
+			return SetErrorReturnCode();
+	} else {
+		SetLastShellError(ERROR_INVALID_HANDLE);
+		return RTERROR;
+	}
+	SetLastShellError(0);
 	return RTNORM;
 }
 
+int CShellPipe::WaitShell( DWORD dwTimeout )
+{
+	// A cached shell is started, but its output is only stored here if
+	// it has all arrived once the processes have exited.
+	if(ResolveCached(0) == RTERROR)
+		return RTERROR;
+	int nResult = WaitStages(dwTimeout);
+	if(nResult == RTNORM && ResolveCached(0) == RTERROR)
+		return RTERROR;
+	return nResult;
+}
+
+int CShellPipe::WaitStages( DWORD dwTimeout )
+{
+	if(!m_hProcess.IsValid())
+		return RTNORM;
+
+	// a pipeline has ended once every stage has
+	HANDLE hProcesses[MAXIMUM_WAIT_OBJECTS];
+	DWORD nProcesses = 0;
+	for(size_t i = 0; i < m_stages.size(); ++i)
+		hProcesses[nProcesses++] = m_stages[i];
+	hProcesses[nProcesses++] = m_hProcess.Handle();
+
+	DWORD dwStart = GetTickCount();
+	for(;;) {
+		DWORD dwLeft = TimeLeft(dwStart, dwTimeout);
+		DWORD dwWait = m_options.bCheckUserBreak ? std::min<DWORD>(dwLeft, USER_BREAK_INTERVAL) : dwLeft;
+		DWORD dwResult = WaitForMultipleObjects(nProcesses, hProcesses, TRUE, dwWait);
+		if(dwResult < WAIT_OBJECT_0 + nProcesses)
+			return RTNORM;
+		if(dwResult != WAIT_TIMEOUT)
+			return SetErrorReturnCode();
+		if(UserBreak())
+			return RTERROR;
+		if(dwWait == dwLeft)
+			return RTNONE;
+	}
+}
+
+bool CShellPipe::UserBreak( void )
+{
+	if(!m_options.bCheckUserBreak || !acedUsrBrk())
+		return false;
+
+	if(m_options.bKillOnBreak)
+		KillShell(ERROR_CANCELLED);
+	SetLastShellError(ERROR_CANCELLED);
+	return true;
+}
+
 DWORD CShellPipe::GetLastShellError( TString & sResult )
 {
 	TCHAR * pszMsgBuffer = NULL;
+	DWORD dwLastError = GetLastShellError();
 
 	if(FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-		NULL, m_dwLastError, 0,
+		NULL, dwLastError, 0,
 		(LPTSTR) &pszMsgBuffer,
 		0, NULL) == 0)
 	{
 		sResult = _T("Problem formating string. Last Shell Error value returned as RTLONG");
-		return m_dwLastError;
+		return dwLastError;
 	}
 
     sResult = pszMsgBuffer;
     LocalFree(pszMsgBuffer);
     trim<TString>(sResult);
     
-	return m_dwLastError;
+	return dwLastError;
 }
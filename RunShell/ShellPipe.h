@@ -23,7 +23,10 @@
 
 
 #pragma once
+#include <vector>
 #include "ShellHandle.h"
+#include "ShellBuffer.h"
+#include "ShellOptions.h"
 
 /**
 *	\brief Defines the class link this application with a child shell
@@ -33,6 +36,7 @@ class CShellPipe
 {
 	enum { ADS_BUFFER_SIZE = 504 };	/**< Buffer size ARX docs say acedRetStr supports
 									*/
+	enum Stream { kStdout, kStderr };	/**< The child output streams */
 public:
 	CShellPipe(void);
 	~CShellPipe(void);
@@ -41,6 +45,7 @@ public:
 	*	\brief Opens a shell instance
 	*	\param[in] pcszApplicationName the application the child process will run
 	*	\param[in] pcszCommandLine the command line parameters for the child process
+	*	\param[in] options controls how the child's streams are handled
 	*	\returns RTNORM if successful, otherwise RTERROR
 	*
 	*	Function initializes a child process.  To create a DOS command shell the string
@@ -61,22 +66,155 @@ public:
 	*	\todo make pcszApplication name work with the %COMSPEC% enviornment variable. Right
 	*	 now it isn't being expanded.
 	*/
-	int OpenShell(const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine );
+	int OpenShell(const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine,
+		const CShellOptions & options = CShellOptions());
+
+	/**
+	*	\brief Starts several programs with the stdout of each going to the stdin of the next
+	*	\param[in] applicationNames the application of each stage
+	*	\param[in] commandLines the command line of each stage
+	*	\param[in] options how to run the stages, as for OpenShell
+	*	\returns RTNORM if successful, otherwise RTERROR.
+	*
+	*	Each stage is started directly, and the stages are connected by pipes
+	*	of their own, so no cmd.exe relays the data between them. The shell
+	*	writes to the first stage's stdin, reads the last stage's stdout, and
+	*	the stderr of every stage. All stages share the shell's job, and the
+	*	shell has ended once every stage has.
+	*
+	*	\code
+	*	(setq handle (openshellpipeline '(("%comspec%" "/c dir") ("%systemroot%\\system32\\sort.exe" "sort /r"))))
+	*	\endcode
+	*/
+	int OpenPipeline(const std::vector<const TCHAR *> & applicationNames,
+		const std::vector<const TCHAR *> & commandLines, const CShellOptions & options = CShellOptions());
+
+	/**
+	*	\brief Starts a program directly with a list of arguments
+	*	\param[in] pcszProgram the program, found like CreateProcess finds it
+	*	\param[in] arguments the arguments, each passed to the program unchanged
+	*	\param[in] options as for OpenShell
+	*	\returns RTNORM if successful, otherwise RTERROR.
+	*
+	*	Builds the command line by quoting each argument, so no "%comspec% /c"
+	*	is needed to run a single program and no cmd.exe is started.
+	*
+	*	\code
+	*	(setq handle (openprocessargs "findstr" '("/n" "two words" "c:\\my files\\a.txt")))
+	*	\endcode
+	*/
+	int OpenProcessArgs(const TCHAR * pcszProgram, const std::vector<const TCHAR *> & arguments,
+		const CShellOptions & options = CShellOptions());
 
 	/**
 	*	\brief Reads the child process stdout
 	*	\param[out] sResults the value read from the child process stdout
+	*	\param[in] dwTimeout milliseconds to wait for data
 	*	\returns RTNORM if successful and can be called again to read more data,
-	*	otherwise RTERROR for errors or if nothing left to read.
+	*	RTNONE if no data arrived within dwTimeout, otherwise RTERROR for errors
+	*	or if nothing left to read.
 	*	
-	*	Reads ADS_BUFFER_SIZE chars of data from the child process stdout and places the result
-	*	into sResult.
+	*	Reads up to ADS_BUFFER_SIZE - 1 chars of data from the child process stdout and places
+	*	the result into sResult. The bytes are sliced from a read-ahead buffer, which is refilled
+	*	with one read of CShellOptions::nReadAhead bytes when it runs empty. If the shell was
+	*	opened pumped that read is served by the buffer the pump thread fills, otherwise it is
+	*	read straight from the pipe.
 	*
 	*	\code
 	*	(setq s (readshelldata handle)) ;; handle obtained from ADS OpenShell function
+	*	(setq s (readshelldata handle 0)) ;; "" if there is nothing to read yet
+	*	\endcode
+	*/
+	int ReadShellData(TString & sResults, DWORD dwTimeout = INFINITE);
+
+	/**
+	*	\brief Gets the number of stdout bytes that can be read without waiting
+	*	\param[out] nBytes number of bytes waiting to be read
+	*	\returns RTNORM if successful, otherwise RTERROR for errors or if the
+	*	child has closed stdout and nothing is left to read.
+	*
+	*	Never blocks, so Autolisp can poll several shells and only read from
+	*	the ones that have output.
+	*
+	*	\code
+	*	(setq n (shelldataavailable handle)) ;; handle obtained from ADS OpenShell function
+	*	\endcode
+	*/
+	int ShellDataAvailable(DWORD & nBytes);
+
+	/**
+	*	\brief Reads the child process stdout until it is closed
+	*	\param[out] results the output, split into strings
+	*	\param[in] bLines true to split the output into lines, false to split
+	*	it into strings of ADS_BUFFER_SIZE - 1 chars.
+	*	\returns RTNORM if successful, otherwise RTERROR for errors or if
+	*	there was nothing to read.
+	*
+	*	Reads in large blocks and converts the whole output once, so the
+	*	entire output can be returned to Autolisp with one acedRetList.
+	*	Line ends ("\n" or "\r\n") are removed in line mode.
+	*
+	*	\code
+	*	(setq lines (readshellall handle "lines")) ;; handle obtained from ADS OpenShell function
 	*	\endcode
 	*/
-	int ReadShellData(TString & sResults);
+	int ReadShellAll(std::vector<TString> & results, bool bLines);
+
+	/**
+	*	\brief Reads complete lines from the child process stdout
+	*	\param[out] lines the lines read, without their line ends
+	*	\param[in] nMaxLines the most lines to return, 0 for no limit
+	*	\returns RTNORM if at least one line was read, otherwise RTERROR for
+	*	errors or if nothing left to read.
+	*
+	*	Blocks until at least one whole line is available, then returns every
+	*	whole line read so far. Bytes after the last line end are carried over
+	*	to the next call, so a line is never split. When the child closes stdout
+	*	a final line without a line end is returned as well.
+	*
+	*	\code
+	*	(setq lines (readshelllines handle 100)) ;; handle obtained from ADS OpenShell function
+	*	\endcode
+	*/
+	int ReadShellLines(std::vector<TString> & lines, int nMaxLines);
+
+	/**
+	*	\brief Reads the child process stderr
+	*	\param[out] sResults the value read from the child process stderr
+	*	\returns RTNORM if successful and can be called again to read more data,
+	*	otherwise RTERROR for errors or if nothing left to read.
+	*
+	*	Works like ReadShellData. Pumped shells drain stderr at the same time
+	*	as stdout, so a chatty child can't hang on a full stderr pipe. Shells
+	*	opened merged have no separate stderr and always return RTERROR.
+	*
+	*	\code
+	*	(setq s (readshellerror handle)) ;; handle obtained from ADS OpenShell function
+	*	\endcode
+	*/
+	int ReadShellError(TString & sResults);
+
+	/**
+	*	\brief Reads the child process stdout as bytes
+	*	\param[out] sBytes the bytes read, exactly as the child wrote them
+	*	\param[in] nMax most bytes to read
+	*	\returns RTNORM if successful and can be called again to read more data,
+	*	otherwise RTERROR for errors or if nothing left to read.
+	*
+	*	For output that is not text, NULs included. Shares the read-ahead
+	*	buffer with the text reads, so the two can be mixed.
+	*/
+	int ReadShellBinary(std::string & sBytes, DWORD nMax);
+
+	/**
+	*	\brief Writes the rest of the child process stdout to a file
+	*	\param[in] pcszPath the file, created or overwritten
+	*	\param[out] nBytes number of bytes written to the file
+	*	\returns RTNORM if stdout was read to its end, otherwise RTERROR
+	*
+	*	The bytes go to the file exactly as the child wrote them.
+	*/
+	int ReadShellBinary(const TCHAR * pcszPath, ULONGLONG & nBytes);
 
 	/**
 	*	\brief Writes the string to child process stdin
@@ -88,32 +226,272 @@ public:
 	*	This function can be called repeatedly to write more data,
 	*	up until ReadShellPipe has been called, at which point the
 	*	write pipe as been closed and no further writing to the pipe
-	*	is allowed.
+	*	is allowed. Shells opened full duplex keep the pipe open until
+	*	CloseShellInput is called, so writes and reads can alternate.
 	*/
 	int WriteShellData(const TCHAR * pcszString);
 
+	/**
+	*	\brief Writes several strings to child process stdin at once
+	*	\param[in] strings the strings to write, one after the other
+	*	\param[out] nWritten the number of bytes written
+	*	\returns RTNORM if successful, otherwise RTERROR for errors.
+	*
+	*	The strings are encoded in CShellOptions::encoding into a buffer the
+	*	shell keeps between calls, then written with a single WriteFile.
+	*/
+	int WriteShellData(const std::vector<const TCHAR *> & strings, DWORD & nWritten);
+
+	/**
+	*	\brief Waits until everything written to stdin has reached the child
+	*	\param[in] dwTimeout milliseconds to wait
+	*	\returns RTNORM once the write queue is empty, RTNONE on timeout,
+	*	otherwise RTERROR for errors or if the user pressed ESC.
+	*
+	*	Only shells opened with CShellOptions::nWriteQueue queue their writes,
+	*	for other shells this returns RTNORM at once.
+	*/
+	int FlushShellInput(DWORD dwTimeout = INFINITE);
+
+	/**
+	*	\brief Writes bytes to the child process stdin as they are
+	*	\param[in] pBytes the bytes
+	*	\param[in] nBytes the number of bytes
+	*	\param[out] nWritten number of bytes written
+	*	\returns RTNORM if successful, otherwise RTERROR for errors.
+	*
+	*	The binary counterpart of WriteShellData, nothing is converted.
+	*/
+	int WriteShellBinary(const char * pBytes, size_t nBytes, DWORD & nWritten);
+
+	/**
+	*	\brief Streams a file to the child process stdin
+	*	\param[in] pcszPath the file
+	*	\param[in] nOffset where in the file to start
+	*	\param[in] nLength number of bytes to write, 0 for the rest of the file
+	*	\returns RTNORM if the file is being written, otherwise RTERROR for
+	*	errors.
+	*
+	*	The writer thread of a shell opened with CShellOptions::nWriteQueue
+	*	reads the file and writes its bytes as they are, without the text
+	*	conversion WriteShellData does. Returns at once, track the transfer
+	*	with GetShellFileProgress and wait for it with FlushShellInput.
+	*	CloseShellInput, and the first read of a shell that isn't full
+	*	duplex, don't wait for it either, the writer thread closes stdin
+	*	after the file, so the output can be read while it is written.
+	*/
+	int WriteShellFile(const TCHAR * pcszPath, ULONGLONG nOffset = 0, ULONGLONG nLength = 0);
+
+	/**
+	*	\brief Gets how far the file from WriteShellFile has got
+	*	\param[out] nSent bytes written so far
+	*	\param[out] nTotal bytes to write
+	*	\returns RTNORM once the whole file is written, RTNONE while it is
+	*	being written, otherwise RTERROR if no file was written or it failed.
+	*/
+	int GetShellFileProgress(ULONGLONG & nSent, ULONGLONG & nTotal);
+
+	/**
+	*	\brief Runs a command in a long lived shell and returns just its output
+	*	\param[in] pcszCommand the command to run
+	*	\param[out] lines the lines the command wrote to stdout
+	*	\param[out] nExitCode the exit status the shell reported for the command
+	*	\returns RTNORM if successful, otherwise RTERROR for errors or if the
+	*	shell ended before the command finished. ERROR_INVALID_FUNCTION if the
+	*	shell isn't duplex, or its stderr is a pipe nothing drains.
+	*
+	*	The shell must be opened full duplex with a command line that keeps it
+	*	reading commands from stdin, for cmd.exe "/q /k" (/q keeps cmd.exe from
+	*	echoing the commands). It must also be pumped or merged, or write
+	*	stderr to a file, since only stdout is read while waiting for the
+	*	sentinel. The command is written followed by a command
+	*	that prints a unique sentinel and the exit status, see
+	*	CShellOptions::sSentinelCommand, and the output is read up to the sentinel.
+	*	The sentinel command carries the sentinel split in two, so an echoed
+	*	command line is not mistaken for it.
+	*
+	*	\code
+	*	(setq handle (openshell "%comspec%" "/q /k" "duplex" "pumped"))
+	*	(setq result (execinshell handle "dir /b")) ;; (exitcode line1 line2 ...)
+	*	\endcode
+	*/
+	int ExecInShell(const TCHAR * pcszCommand, std::vector<TString> & lines, int & nExitCode);
+
+	/**
+	*	\brief Closes the child process stdin
+	*	\returns RTNORM if successful, otherwise RTERROR.
+	*
+	*	The child sees the end of its input, which is how filters such as
+	*	sort know to produce their output. One-shot shells do this on the
+	*	first read, full duplex shells only when this function is called.
+	*	With a write queue stdin is closed by the writer thread once the
+	*	queue is written, and this returns without waiting for that.
+	*
+	*	\code
+	*	(closeshellinput handle) ;; handle obtained from ADS OpenShell function
+	*	\endcode
+	*/
+	int CloseShellInput(void);
+
 	/**
 	*	\brief Closes a previously opened shell
-	*	\returns RTNORM, always.
+	*	\returns RTNORM if successful, otherwise RTERROR if the user pressed ESC
+	*	before the child exited.
 	*
-	*	Closes all the member CShellHandle variables.
+	*	Closes all the member CShellHandle variables, then waits for the child
+	*	process to exit.
 	*/
 	int CloseShell(void);
 
+	/**
+	*	\brief Closes the pipes without waiting for the child
+	*
+	*	The first half of CloseShell. A child blocked on its stdin or its
+	*	output sees the end of the stream and can exit on its own, see
+	*	CShellReaper.
+	*/
+	void ClosePipes(void);
+
+	/**
+	*	\brief Sets whether blocking calls check for ESC
+	*
+	*	Must be turned off before a shell opened on the AutoCAD main thread
+	*	is used from another thread, see CShellOptions::bCheckUserBreak.
+	*/
+	void SetCheckUserBreak(bool bCheckUserBreak) { m_options.bCheckUserBreak = bCheckUserBreak; }
+
+	/**
+	*	\brief Waits for the child process to exit
+	*	\param[in] dwTimeout milliseconds to wait
+	*	\returns RTNORM once the child has exited, RTNONE on timeout, otherwise
+	*	RTERROR for errors or if the user pressed ESC.
+	*
+	*	\code
+	*	(waitshell handle 5000) ;; handle obtained from ADS OpenShell function
+	*	\endcode
+	*/
+	int WaitShell(DWORD dwTimeout);
+
+	/**
+	*	\brief Gets the exit code of the child process
+	*	\param[out] dwExitCode the exit code
+	*	\returns RTNORM if the child has exited, RTNONE if it is still running,
+	*	otherwise RTERROR.
+	*
+	*	\code
+	*	(getshellexitcode handle) ;; handle obtained from ADS OpenShell function
+	*	\endcode
+	*/
+	int GetShellExitCode(DWORD & dwExitCode);
+
+	/**
+	*	\brief Gets the exit code of every stage of a pipeline
+	*	\param[out] exitCodes the exit code of each stage
+	*	\param[out] exited whether each stage has exited, its exit code
+	*	is only valid if it has
+	*	\returns RTNORM if every stage has exited, RTNONE if some are still
+	*	running, otherwise RTERROR.
+	*
+	*	A shell from OpenShell is a pipeline of one stage.
+	*/
+	int GetShellExitCodes(std::vector<DWORD> & exitCodes, std::vector<bool> & exited);
+
+	/**
+	*	\brief Terminates the child process and every process it started
+	*	\param[in] nExitCode the exit code the processes end with
+	*	\returns RTNORM if successful, otherwise RTERROR.
+	*
+	*	Terminates the job object the child runs in. If the job couldn't be
+	*	created only the child itself is terminated.
+	*
+	*	\code
+	*	(killshell handle) ;; handle obtained from ADS OpenShell function
+	*	\endcode
+	*/
+	int KillShell(UINT nExitCode);
+
+	/**
+	*	\brief Gets the last error of this thread, with its text
+	*
+	*	Every thread has its own last error, so the shells of the pool,
+	*	batch, job and reaper threads don't change what Autolisp sees.
+	*/
 	static DWORD GetLastShellError(TString & sResult);
 
+	/**	\brief Gets the last error of this thread */
+	static DWORD GetLastShellError(void);
+
+	/**	\brief Sets the error GetLastShellError reports on this thread, also for failures found outside CShellPipe */
+	static void SetLastShellError(DWORD dwError);
+
 private:
 
+	/**
+	*	\brief Creates the pipes and starts the stages, called by OpenShell
+	*	and OpenPipeline
+	*/
+	int OpenStages(size_t nStages, const TCHAR * const * ppApplicationNames,
+		const TCHAR * const * ppCommandLines, const CShellOptions & options);
+
+	/**
+	*	\brief Looks up or runs a cached shell, called before its output is needed
+	*	\param[in] dwTimeout milliseconds to wait for a miss to end
+	*	\returns RTNORM if the output is ready to read, RTNONE if a miss is
+	*	still running after dwTimeout, otherwise RTERROR
+	*
+	*	Does nothing unless the shell was opened with CShellOptions::bCached.
+	*	The first call starts it with StartCached. A miss that is running
+	*	is stored in g_shellCache once its streams and stages have ended.
+	*	Calls that must not block pass 0. ESC during the wait leaves an
+	*	ordinary pumped shell.
+	*/
+	int ResolveCached(DWORD dwTimeout);
+
+	/**
+	*	\brief Looks up a cached shell, or starts it on a miss
+	*	\returns RTNORM if it was found or started, otherwise RTERROR
+	*
+	*	A hit fills m_stdout and m_stderr from g_shellCache. A miss starts
+	*	the stages and writes the stdin held back so far. If they can't be
+	*	started nothing is left behind and the shell stays deferred.
+	*/
+	int StartCached(void);
+
+	/**
+	*	\brief Waits for every stage to exit, WaitShell without the cache
+	*/
+	int WaitStages(DWORD dwTimeout);
+
+	/**
+	*	\brief Starts each stage with its standard handles
+	*
+	*	Called by OpenStages once the shell's own pipes exist.
+	*/
+	int StartStages(size_t nStages, const TCHAR * const * ppApplicationNames,
+		const TCHAR * const * ppCommandLines);
+
 	/**
 	*	\brief Initializes and creates a child process
+	*	\param[in] hStdin, hStdout, hStderr the child's standard handles.
+	*	The child gets inheritable copies of them, and no other handle.
+	*	\param[out] hProcess the child process
 	*
-	*	Called by OpenShell
+	*	Called by StartStages
 	*
 	*	\code
 	*	(closeshell handle) ;; handle from openshell
 	*	\endcode
 	*/
-	BOOL CreateChildProcess(const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine);
+	BOOL CreateChildProcess(const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine,
+		HANDLE hStdin, HANDLE hStdout, HANDLE hStderr, HANDLE & hProcess);
+
+	/**
+	*	\brief Puts a child process in the shell's job object
+	*	\param[in] hProcess the process, created suspended
+	*	\returns RTNORM if the process is in the job, or the shell runs
+	*	without one, otherwise RTERROR with the error in GetLastError.
+	*/
+	int AssignJob(HANDLE hProcess);
 
 	/**
 	*	\brief Called whenever an error occurs
@@ -126,6 +504,96 @@ private:
 	*/
 	int SetErrorReturnCode(void);
 
+	/**
+	*	\brief Reads one ADS_BUFFER_SIZE string from one of the child output streams
+	*	\param[in] stream the stream to read
+	*	\param[out] sResults the value read
+	*	\param[in] dwTimeout milliseconds to wait for data
+	*	\returns RTNORM if successful, RTNONE on timeout, otherwise RTERROR
+	*/
+	int ReadStream(Stream stream, TString & sResults, DWORD dwTimeout);
+
+	/**
+	*	\brief Reads raw bytes from one of the child output streams
+	*	\param[in] stream the stream to read
+	*	\param[out] pBuf receives the bytes
+	*	\param[in] nMax size of pBuf
+	*	\param[out] nRead number of bytes placed in pBuf
+	*	\param[in] dwTimeout milliseconds to wait for data
+	*	\returns RTNORM if bytes were read, RTNONE if nothing arrived within
+	*	dwTimeout, otherwise RTERROR for errors or if nothing left to read.
+	*
+	*	Common code for every function that reads output. Closes stdin on the
+	*	first call, then reads from the pump buffer or directly from the pipe.
+	*/
+	int ReadBytes(Stream stream, char * pBuf, DWORD nMax, DWORD & nRead,
+		DWORD dwTimeout = INFINITE);
+
+	/**
+	*	\brief Appends up to nMax bytes of stdout to m_sReadAhead
+	*	\param[in] nMax most bytes to read
+	*	\param[out] nRead number of bytes appended
+	*	\param[in] dwTimeout milliseconds to wait for data
+	*	\returns the result of ReadBytes
+	*
+	*	Drops the bytes already handed out first. Once m_sReadAhead has grown
+	*	to its working size, no more memory is allocated.
+	*/
+	int FillReadAhead(DWORD nMax, DWORD & nRead, DWORD dwTimeout = INFINITE);
+
+	/**
+	*	\brief Writes m_sWriteBuffer to the child's stdin
+	*	\param[out] nWritten the number of bytes written
+	*	\returns RTNORM if successful, otherwise RTERROR
+	*
+	*	m_sWriteBuffer keeps its capacity between writes, so writing only
+	*	allocates until it has grown to the size of the largest write.
+	*/
+	int WriteBuffer(DWORD & nWritten);
+
+	/**
+	*	\brief Finds the end of a line of raw stdout bytes
+	*	\param[in] pLine first byte of the line
+	*	\param[in] pScan where to start looking for the line feed
+	*	\param[in] pEnd one past the last byte read
+	*	\param[in] bEof true if no more bytes will follow, so the bytes left
+	*	are the last line
+	*	\param[out] nLength bytes in the line without its line end
+	*	\param[out] pNext first byte of the next line
+	*	\returns true if a line was found, false if the line is not complete yet
+	*
+	*	Knows the line end of every CShellOptions::encoding, in UTF-16 it is
+	*	"\n" followed by a 0 byte at an even offset.
+	*/
+	bool FindLine(const char * pLine, const char * pScan, const char * pEnd, bool bEof,
+		size_t & nLength, const char *& pNext) const;
+
+	/**
+	*	\brief Checks whether the user pressed ESC
+	*	\returns true if the blocking call should be cancelled
+	*
+	*	Called between the short waits every blocking call is split into, so
+	*	ESC is noticed within USER_BREAK_INTERVAL milliseconds. Terminates the
+	*	child when the shell was opened with CShellOptions::bKillOnBreak.
+	*/
+	bool UserBreak(void);
+
+	/**
+	*	\brief Starts the thread that drains the child's output into m_stdout and m_stderr
+	*	\returns RTNORM if successful, otherwise RTERROR
+	*/
+	int StartPump(void);
+
+	/**
+	*	\brief Signals the pump thread to stop and waits for it to exit
+	*/
+	void StopPump(void);
+
+	/**
+	*	\brief Pump thread entry point, pParam is the owning CShellPipe
+	*/
+	static unsigned __stdcall PumpThread(void * pParam);
+
 	CShellHandle m_hChildError;	/**< Child handle */
 	CShellHandle m_hChildWrite;	/**< Child handle */
 	CShellHandle m_hChildRead;	/**< Child handle */
@@ -133,7 +601,32 @@ private:
 	CShellHandle m_hParentRead;	/**< Child handle */
 	CShellHandle m_hParentError;	/**< Child handle */
 
-    PROCESS_INFORMATION m_pi;
+	CShellHandle m_hProcess;	/**< The child process, the last stage of a pipeline,
+								*	 kept until the shell is deleted */
+	std::vector<HANDLE> m_stages;	/**< The other stages of a pipeline, closed with the shell */
+	CShellHandle m_hJob;		/**< Job holding the child's process tree, closing it kills the tree */
+
+	CShellOptions m_options;	/**< Options the shell was opened with */
+	CShellBuffer m_stdout;		/**< Child's stdout, filled by the pump thread or from g_shellCache */
+	CShellBuffer m_stderr;		/**< Child's stderr, filled by the pump thread */
+	CShellHandle m_hPumpThread;	/**< Pump thread, only valid for pumped shells */
+	CShellHandle m_hStopEvent;	/**< Set to ask the pump thread to exit */
+
+	std::string m_sReadAhead;	/**< Raw stdout bytes read but not yet returned */
+	size_t m_nAheadHead;		/**< Offset of the first byte of m_sReadAhead not yet returned */
+	size_t m_nLineScanned;		/**< Bytes after m_nAheadHead known to hold no line feed */
+	CTextDecoder m_stdoutDecoder;	/**< Decodes stdout, keeps characters split between reads */
+	CTextDecoder m_stderrDecoder;	/**< Decodes stderr */
+	CTextEncoder m_stdinEncoder;	/**< Encodes what is written to stdin */
+	std::string m_sWriteBuffer;		/**< Encoded stdin bytes, reused by every write */
+	CShellWriter m_writer;			/**< Writes stdin when opened with a write queue */
 
-	static DWORD m_dwLastError;	/**< Records the last error one of the functions triggered. */
+	bool m_bDeferred;				/**< A cached shell that hasn't been started yet */
+	bool m_bCaching;				/**< A cache miss that is stored once it has ended */
+	bool m_bCacheHit;				/**< The output came from g_shellCache, no process was started */
+	TString m_sCacheKey;			/**< Key of a cached shell, set by StartCached */
+	std::vector<TString> m_deferredApplications;	/**< Stages of a cached shell, for ResolveCached */
+	std::vector<TString> m_deferredCommandLines;
+	std::string m_sDeferredInput;	/**< Encoded stdin held back until a cached shell starts */
+	std::vector<DWORD> m_cachedExitCodes;	/**< Exit code of each stage of a cache hit */
 };
@@ -0,0 +1,297 @@
+/**	\file ShellPool.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellPool.cpp															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+#include "StdAfx.h"
+#include "ShellPool.h"
+#include <process.h>
+#include <vector>
+#include <algorithm>
+
+// How often the refill thread looks for expired idle shells
+#define POOL_CHECK_INTERVAL 1000
+
+// A failing start is retried after POOL_RETRY_DELAY, doubled for every
+// failure in a row up to POOL_MAX_RETRY_DELAY, and given up on after
+// POOL_MAX_FAILURES until the pool is configured again.
+#define POOL_RETRY_DELAY 1000
+#define POOL_MAX_RETRY_DELAY 60000
+#define POOL_MAX_FAILURES 8
+
+// Initialize to NULL. The first SetShellPool call creates the
+// pool, it is deleted during the kUnloadAppMsg message.
+CShellPool * g_pShellPool = NULL;
+
+CShellPool::CShellPool(void)
+{
+	InitializeCriticalSection(&m_cs);
+	m_nHits = 0;
+	m_nMisses = 0;
+	m_nFailures = 0;
+	m_dwLastFailure = 0;
+	m_hWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	unsigned nThreadId;
+	m_hThread = (HANDLE) _beginthreadex(NULL, 0, RefillThread, this, 0, &nThreadId);
+}
+
+CShellPool::~CShellPool(void)
+{
+	if(m_hThread.IsValid()) {
+		SetEvent(m_hStopEvent.Handle());
+		WaitForSingleObject(m_hThread.Handle(), INFINITE);
+	}
+
+	for(Pools::iterator it = m_pools.begin(); it != m_pools.end(); ++it) {
+		std::deque<IdleShell> & idle = it->second.idle;
+		for(std::deque<IdleShell>::iterator itIdle = idle.begin(); itIdle != idle.end(); ++itIdle)
+			delete itIdle->pShell;
+	}
+	DeleteCriticalSection(&m_cs);
+}
+
+TString CShellPool::MakeKey( const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine,
+							 const CShellOptions & options )
+{
+	TString sKey = pcszApplicationName;
+	sKey += _T('\n');
+	sKey += pcszCommandLine;
+	sKey += _T('\n');
+	sKey += options.bPumped ? _T('p') : _T('-');
+	sKey += options.bMerged ? _T('m') : _T('-');
+	sKey += options.bDuplex ? _T('d') : _T('-');
+	sKey += options.bCached ? _T('c') : _T('-');
+	sKey += options.bCheckUserBreak ? _T('b') : _T('-');
+	sKey += options.bKillOnBreak ? _T('k') : _T('-');
+	TCHAR szSizes[112];
+	_stprintf(szSizes, _T("%lu,%lu,%lu,%d,%lu,%d,%d,%d,"), options.nReadAhead, options.nBufferLimit, options.nPipeSize,
+		(int) options.encoding, options.nWriteQueue, (int) options.writeFull,
+		(int) options.environment.size(), (int) options.dependencies.size());
+	sKey += szSizes;
+	sKey += options.sSentinelCommand;
+	sKey += _T('\n');
+	sKey += options.sStdoutFile;
+	sKey += _T('\n');
+	sKey += options.sStderrFile;
+	sKey += _T('\n');
+	sKey += options.sDirectory;
+	for(size_t i = 0; i < options.environment.size(); ++i) {
+		sKey += _T('\n');
+		sKey += options.environment[i];
+	}
+	for(size_t i = 0; i < options.dependencies.size(); ++i) {
+		sKey += _T('\n');
+		sKey += options.dependencies[i];
+	}
+	return sKey;
+}
+
+int CShellPool::Configure( const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine,
+						  const CShellOptions & options, int nSize, DWORD dwIdleMs )
+{
+	if(nSize < 0)
+		return RTERROR;
+
+	TString sKey = MakeKey(pcszApplicationName, pcszCommandLine, options);
+	std::deque<IdleShell> removed;
+
+	EnterCriticalSection(&m_cs);
+	if(!nSize) {
+		Pools::iterator it = m_pools.find(sKey);
+		if(it != m_pools.end()) {
+			removed.swap(it->second.idle);
+			m_pools.erase(it);
+		}
+	} else {
+		Pool & pool = m_pools[sKey];
+		if(pool.sApplicationName.empty()) {
+			pool.sApplicationName = pcszApplicationName;
+			pool.sCommandLine = pcszCommandLine;
+			pool.options = options;
+			pool.nStarting = 0;
+		}
+		// configuring a pool again gives a failing one another try
+		pool.nFailures = 0;
+		pool.nSize = nSize;
+		pool.dwIdleMs = dwIdleMs;
+		// shrink right away, the refill thread only grows pools
+		while((int) pool.idle.size() > nSize) {
+			removed.push_back(pool.idle.front());
+			pool.idle.pop_front();
+		}
+	}
+	LeaveCriticalSection(&m_cs);
+
+	for(std::deque<IdleShell>::iterator it = removed.begin(); it != removed.end(); ++it)
+		delete it->pShell;
+
+	SetEvent(m_hWakeEvent.Handle());
+	return RTNORM;
+}
+
+CShellPipe * CShellPool::Acquire( const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine,
+								 const CShellOptions & options )
+{
+	TString sKey = MakeKey(pcszApplicationName, pcszCommandLine, options);
+	CShellPipe * pShell = NULL;
+
+	EnterCriticalSection(&m_cs);
+	Pools::iterator it = m_pools.find(sKey);
+	bool bPooled = it != m_pools.end();
+	if(bPooled) {
+		std::deque<IdleShell> & idle = it->second.idle;
+		if(!idle.empty()) {
+			// hand out the oldest, it is the closest to expiring
+			pShell = idle.front().pShell;
+			idle.pop_front();
+			InterlockedIncrement(&m_nHits);
+		} else
+			InterlockedIncrement(&m_nMisses);
+	}
+	LeaveCriticalSection(&m_cs);
+
+	if(bPooled)
+		SetEvent(m_hWakeEvent.Handle());
+	return pShell;
+}
+
+int CShellPool::GetIdleCount( void ) const
+{
+	int nIdle = 0;
+	EnterCriticalSection(&m_cs);
+	for(Pools::const_iterator it = m_pools.begin(); it != m_pools.end(); ++it)
+		nIdle += (int) it->second.idle.size();
+	LeaveCriticalSection(&m_cs);
+	return nIdle;
+}
+
+void CShellPool::Refill( void )
+{
+	std::vector<CShellPipe *> expired;
+	std::vector<TString> toStart;
+	DWORD dwNow = GetTickCount();
+
+	// Work out what needs doing while holding the lock, then do the
+	// slow parts (closing and starting processes) without it.
+	EnterCriticalSection(&m_cs);
+	for(Pools::iterator it = m_pools.begin(); it != m_pools.end(); ++it) {
+		Pool & pool = it->second;
+		while(!pool.idle.empty() && dwNow - pool.idle.front().dwStarted > pool.dwIdleMs) {
+			expired.push_back(pool.idle.front().pShell);
+			pool.idle.pop_front();
+		}
+		if(pool.nFailures) {
+			// after a failure only one start at a time, once its delay is up
+			DWORD dwDelay = POOL_RETRY_DELAY;
+			for(int i = 1; i < pool.nFailures && dwDelay < POOL_MAX_RETRY_DELAY; ++i)
+				dwDelay *= 2;
+			if(dwDelay > POOL_MAX_RETRY_DELAY)
+				dwDelay = POOL_MAX_RETRY_DELAY;
+			if(pool.nFailures >= POOL_MAX_FAILURES || pool.nStarting
+				|| dwNow - pool.dwFailed < dwDelay)
+				continue;
+			if((int) pool.idle.size() < pool.nSize) {
+				toStart.push_back(it->first);
+				++pool.nStarting;
+			}
+			continue;
+		}
+		for(int i = (int) pool.idle.size() + pool.nStarting; i < pool.nSize; ++i) {
+			toStart.push_back(it->first);
+			++pool.nStarting;
+		}
+	}
+	LeaveCriticalSection(&m_cs);
+
+	for(std::vector<CShellPipe *>::iterator itExpired = expired.begin(); itExpired != expired.end(); ++itExpired)
+		delete *itExpired;
+
+	std::vector<TString> failed;
+	for(std::vector<TString>::iterator itKey = toStart.begin(); itKey != toStart.end(); ++itKey) {
+		if(WaitForSingleObject(m_hStopEvent.Handle(), 0) == WAIT_OBJECT_0)
+			return;
+
+		// copy the arguments, the pool may be changed while the shell starts
+		TString sApplicationName, sCommandLine;
+		CShellOptions options;
+		EnterCriticalSection(&m_cs);
+		Pools::iterator it = m_pools.find(*itKey);
+		bool bFound = it != m_pools.end();
+		if(bFound) {
+			sApplicationName = it->second.sApplicationName;
+			sCommandLine = it->second.sCommandLine;
+			options = it->second.options;
+		}
+		// once a start failed the rest of the round is left to the retry
+		if(bFound && std::find(failed.begin(), failed.end(), *itKey) != failed.end()) {
+			if(it->second.nStarting > 0)
+				--it->second.nStarting;
+			bFound = false;
+		}
+		LeaveCriticalSection(&m_cs);
+		if(!bFound)
+			continue;
+
+		CShellPipe * pShell = new CShellPipe;
+		if(pShell->OpenShell(sApplicationName.c_str(), sCommandLine.c_str(), options) != RTNORM) {
+			m_dwLastFailure = CShellPipe::GetLastShellError();
+			InterlockedIncrement(&m_nFailures);
+			failed.push_back(*itKey);
+			delete pShell;
+			pShell = NULL;
+		}
+
+		EnterCriticalSection(&m_cs);
+		it = m_pools.find(*itKey);
+		if(it != m_pools.end()) {
+			if(it->second.nStarting > 0)
+				--it->second.nStarting;
+			if(pShell)
+				it->second.nFailures = 0;
+			else if(it->second.nFailures < POOL_MAX_FAILURES) {
+				++it->second.nFailures;
+				it->second.dwFailed = GetTickCount();
+			}
+			if(pShell && (int) it->second.idle.size() < it->second.nSize) {
+				IdleShell idle = { pShell, GetTickCount() };
+				it->second.idle.push_back(idle);
+				pShell = NULL;
+			}
+		}
+		LeaveCriticalSection(&m_cs);
+		delete pShell; // pool was removed or shrunk meanwhile
+	}
+}
+
+unsigned __stdcall CShellPool::RefillThread( void * pParam )
+{
+	CShellPool * pThis = (CShellPool *) pParam;
+	HANDLE hWaits[2] = { pThis->m_hStopEvent.Handle(), pThis->m_hWakeEvent.Handle() };
+
+	for(;;) {
+		DWORD dwWait = WaitForMultipleObjects(2, hWaits, FALSE, POOL_CHECK_INTERVAL);
+		if(dwWait != WAIT_OBJECT_0 + 1 && dwWait != WAIT_TIMEOUT)
+			break;
+		pThis->Refill();
+	}
+	return 0;
+}
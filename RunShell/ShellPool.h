@@ -0,0 +1,125 @@
+/**	\file ShellPool.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellPool.h																*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+#include <deque>
+#include "ShellPipe.h"
+
+/**	\brief Keeps pre-started shells ready for OpenShell
+*	\note THERE SHOULD ONLY BE ONE INSTANCE OF THIS CLASS
+*
+*	Starting a child process costs tens of milliseconds. For an application
+*	and command line that are opened over and over again (typically an
+*	interpreter that reads its commands from stdin) a pool of idle, already
+*	started shells can be configured. OpenShell takes a shell from the pool
+*	when one matches, and a background thread starts a replacement.
+*
+*	Idle shells that have waited longer than the configured idle time are
+*	closed and replaced, so a pool never hands out a stale process.
+*
+*	A shell that fails to start is retried after a delay that doubles with
+*	every failure in a row. After POOL_MAX_FAILURES the pool stops trying
+*	until it is configured again, the error is kept for GetShellStats.
+*/
+class CShellPool
+{
+public:
+	CShellPool(void);
+
+	/**	\brief Stops the refill thread and closes every idle shell */
+	~CShellPool(void);
+
+	/**	\brief Creates, changes or removes the pool for an application
+	*	\param[in] pcszApplicationName the application, as given to OpenShell
+	*	\param[in] pcszCommandLine the command line, as given to OpenShell
+	*	\param[in] options the options, as given to OpenShell
+	*	\param[in] nSize number of idle shells to keep ready, 0 removes the pool
+	*	\param[in] dwIdleMs how long an idle shell is kept before it is replaced
+	*	\returns RTNORM if successful, otherwise RTERROR
+	*/
+	int Configure(const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine,
+		const CShellOptions & options, int nSize, DWORD dwIdleMs);
+
+	/**	\brief Takes an idle shell from the pool
+	*	\returns a started CShellPipe the caller now owns, or NULL if there is
+	*	no pool for these arguments or it is empty.
+	*
+	*	Counts a hit or a miss when a pool is configured for the arguments.
+	*/
+	CShellPipe * Acquire(const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine,
+		const CShellOptions & options);
+
+	LONG GetHits(void) const { return m_nHits; }		/**< Acquire calls served from a pool */
+	LONG GetMisses(void) const { return m_nMisses; }	/**< Acquire calls that found a pool empty */
+	LONG GetFailures(void) const { return m_nFailures; }	/**< Pooled shells that failed to start */
+	DWORD GetLastFailure(void) const { return m_dwLastFailure; }	/**< Error of the last shell that failed to start */
+
+	/**	\brief Number of idle shells in every pool */
+	int GetIdleCount(void) const;
+
+private:
+	CShellPool(const CShellPool &);
+	CShellPool & operator=(const CShellPool &);
+
+	struct IdleShell
+	{
+		CShellPipe * pShell;
+		DWORD dwStarted;	/**< GetTickCount when the shell was started */
+	};
+
+	struct Pool
+	{
+		TString sApplicationName;
+		TString sCommandLine;
+		CShellOptions options;
+		int nSize;
+		DWORD dwIdleMs;
+		int nStarting;					/**< Shells the refill thread is starting */
+		int nFailures;					/**< Starts that failed in a row */
+		DWORD dwFailed;					/**< GetTickCount of the last failed start */
+		std::deque<IdleShell> idle;
+	};
+	typedef std::map<TString, Pool> Pools;
+
+	/**	\brief Builds the key a pool is stored under */
+	static TString MakeKey(const TCHAR * pcszApplicationName, const TCHAR * pcszCommandLine,
+		const CShellOptions & options);
+
+	/**	\brief Closes expired idle shells and starts the missing ones */
+	void Refill(void);
+
+	static unsigned __stdcall RefillThread(void * pParam);
+
+	mutable CRITICAL_SECTION m_cs;	/**< Guards m_pools */
+	Pools m_pools;
+	CShellHandle m_hThread;			/**< The refill thread */
+	CShellHandle m_hWakeEvent;		/**< Set to make the refill thread run now */
+	CShellHandle m_hStopEvent;		/**< Set to stop the refill thread */
+	LONG m_nHits;
+	LONG m_nMisses;
+	LONG m_nFailures;
+	DWORD m_dwLastFailure;
+};
+
+extern CShellPool * g_pShellPool;	// created by the first SetShellPool call
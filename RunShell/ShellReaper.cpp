@@ -0,0 +1,164 @@
+/**	\file ShellReaper.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellReaper.cpp															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+#include "StdAfx.h"
+#include "ShellReaper.h"
+#include "ShellJobs.h"
+#include <process.h>
+
+// How long a child gets to exit after its pipes are closed
+#define REAPER_GRACE_PERIOD 2000
+// How often the reaper thread looks at the shells it holds
+#define REAPER_CHECK_INTERVAL 100
+
+// Initialize to NULL. Created during the kInitAppMsg message and
+// deleted during the kUnloadAppMsg message. Drawings closed while
+// it is NULL delete their shells themselves.
+CShellReaper * g_pShellReaper = NULL;
+
+CShellReaper::CShellReaper(void)
+{
+	InitializeCriticalSection(&m_cs);
+	m_nExited = 0;
+	m_nKilled = 0;
+	m_dwHandlesBefore = 0;
+	m_dwHandlesAfter = 0;
+	m_hWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	unsigned nThreadId;
+	m_hThread = (HANDLE) _beginthreadex(NULL, 0, ReaperThread, this, 0, &nThreadId);
+}
+
+CShellReaper::~CShellReaper(void)
+{
+	if(m_hThread.IsValid()) {
+		SetEvent(m_hStopEvent.Handle());
+		WaitForSingleObject(m_hThread.Handle(), INFINITE);
+	}
+	// AutoCAD is unloading us, there is no time for a grace period
+	Sweep(true);
+	DeleteCriticalSection(&m_cs);
+}
+
+void CShellReaper::Reap( const std::vector<CShellPipe *> & shells, CShellJobQueue * pJobs )
+{
+	if(shells.empty() && !pJobs)
+		return;
+
+	DWORD dwHandles = 0;
+	GetProcessHandleCount(GetCurrentProcess(), &dwHandles);
+
+	EnterCriticalSection(&m_cs);
+	m_dwHandlesBefore = dwHandles;
+	for(size_t i = 0; i < shells.size(); ++i) {
+		// acedUsrBrk may only be called from the main thread
+		shells[i]->SetCheckUserBreak(false);
+		DyingShell dying = { shells[i], 0, false };
+		m_dying.push_back(dying);
+	}
+	if(pJobs)
+		m_jobs.push_back(pJobs);
+	LeaveCriticalSection(&m_cs);
+
+	// without a thread the shells are finished right away
+	if(!m_hThread.IsValid())
+		Sweep(true);
+	else
+		SetEvent(m_hWakeEvent.Handle());
+}
+
+int CShellReaper::GetPending( void ) const
+{
+	EnterCriticalSection(&m_cs);
+	int nPending = (int) (m_dying.size() + m_jobs.size());
+	LeaveCriticalSection(&m_cs);
+	return nPending;
+}
+
+bool CShellReaper::Sweep( bool bForce )
+{
+	// Closing, waiting and deleting are done without the lock, so
+	// Reap never waits for them.
+	std::vector<DyingShell> dying, left;
+	std::vector<CShellJobQueue *> jobs;
+	EnterCriticalSection(&m_cs);
+	dying.swap(m_dying);
+	jobs.swap(m_jobs);
+	LeaveCriticalSection(&m_cs);
+	if(dying.empty() && jobs.empty())
+		return false;
+
+	// A queue kills its running jobs and waits for its worker threads,
+	// which is the wait the drawing mustn't do on the main thread.
+	for(size_t i = 0; i < jobs.size(); ++i)
+		delete jobs[i];
+
+	for(size_t i = 0; i < dying.size(); ++i) {
+		DyingShell & shell = dying[i];
+		if(!shell.bClosed) {
+			shell.pShell->ClosePipes();
+			shell.dwClosed = GetTickCount();
+			shell.bClosed = true;
+		}
+
+		int nResult = shell.pShell->WaitShell(0);
+		if(nResult == RTNORM)
+			InterlockedIncrement(&m_nExited);
+		else if(nResult == RTNONE && !bForce && GetTickCount() - shell.dwClosed < REAPER_GRACE_PERIOD) {
+			left.push_back(shell);
+			continue;
+		} else {
+			// the job object takes the child's whole process tree with it
+			shell.pShell->KillShell(ERROR_PROCESS_ABORTED);
+			InterlockedIncrement(&m_nKilled);
+		}
+		delete shell.pShell;
+	}
+
+	EnterCriticalSection(&m_cs);
+	m_dying.insert(m_dying.end(), left.begin(), left.end());
+	bool bLeft = !m_dying.empty() || !m_jobs.empty();
+	if(!bLeft) {
+		DWORD dwHandles = 0;
+		GetProcessHandleCount(GetCurrentProcess(), &dwHandles);
+		m_dwHandlesAfter = dwHandles;
+	}
+	LeaveCriticalSection(&m_cs);
+	return bLeft;
+}
+
+unsigned __stdcall CShellReaper::ReaperThread( void * pParam )
+{
+	CShellReaper * pThis = (CShellReaper *) pParam;
+	HANDLE hWaits[2] = { pThis->m_hStopEvent.Handle(), pThis->m_hWakeEvent.Handle() };
+	bool bLeft = false;
+	for(;;) {
+		// only wake up on a timer while there are shells to look at
+		DWORD dwWait = WaitForMultipleObjects(2, hWaits, FALSE,
+			bLeft ? REAPER_CHECK_INTERVAL : INFINITE);
+		if(dwWait != WAIT_OBJECT_0 + 1 && dwWait != WAIT_TIMEOUT)
+			break; // asked to stop, or the wait itself failed
+		bLeft = pThis->Sweep(false);
+	}
+	return 0;
+}
@@ -0,0 +1,98 @@
+/**	\file ShellReaper.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellReaper.h															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+#include <vector>
+#include "ShellPipe.h"
+
+class CShellJobQueue;
+
+/**	\brief Finishes the shells of a closed drawing on a background thread
+*	\note THERE SHOULD ONLY BE ONE INSTANCE OF THIS CLASS
+*
+*	When a drawing closes, its open shells are handed over here instead
+*	of being closed on the AutoCAD main thread. The reaper thread closes
+*	their pipes, so a child blocked on its stdin or its output can exit on
+*	its own, then gives each child a grace period. A child still running
+*	after that is terminated with its process tree, and every CShellPipe
+*	is deleted, so none of its handles outlive the drawing. The drawing's
+*	job queue is deleted here too, as it waits for its worker threads.
+*
+*	The process handle count is taken when shells are handed over and
+*	again once they are all gone, so a leak shows up in GetShellStats.
+*/
+class CShellReaper
+{
+public:
+	CShellReaper(void);
+
+	/**	\brief Stops the reaper thread, terminates and deletes every shell left */
+	~CShellReaper(void);
+
+	/**	\brief Takes over shells and a job queue, returns without waiting for them
+	*	\param[in] shells the shells, now owned by the reaper
+	*	\param[in] pJobs the job queue, now owned by the reaper, may be NULL
+	*
+	*	Must be called on the thread the shells were opened on.
+	*/
+	void Reap(const std::vector<CShellPipe *> & shells, CShellJobQueue * pJobs);
+
+	int GetPending(void) const;								/**< Shells and job queues not deleted yet */
+	LONG GetExited(void) const { return m_nExited; }		/**< Shells whose child exited within the grace period */
+	LONG GetKilled(void) const { return m_nKilled; }		/**< Shells whose child had to be terminated */
+	DWORD GetHandlesBefore(void) const { return m_dwHandlesBefore; }	/**< Process handle count at the last Reap */
+	DWORD GetHandlesAfter(void) const { return m_dwHandlesAfter; }		/**< Process handle count when the shells were last all gone */
+
+private:
+	CShellReaper(const CShellReaper &);
+	CShellReaper & operator=(const CShellReaper &);
+
+	struct DyingShell
+	{
+		CShellPipe * pShell;
+		DWORD dwClosed;		/**< GetTickCount when its pipes were closed, the grace period starts */
+		bool bClosed;		/**< ClosePipes has been called */
+	};
+
+	/**	\brief Closes new shells, deletes ended ones and terminates those past the grace period
+	*	\param[in] bForce terminate every shell still running
+	*	\returns true while shells are left
+	*/
+	bool Sweep(bool bForce);
+
+	static unsigned __stdcall ReaperThread(void * pParam);
+
+	mutable CRITICAL_SECTION m_cs;	/**< Guards m_dying and m_jobs */
+	std::vector<DyingShell> m_dying;
+	std::vector<CShellJobQueue *> m_jobs;
+	CShellHandle m_hThread;			/**< The reaper thread */
+	CShellHandle m_hWakeEvent;		/**< Set when shells are handed over */
+	CShellHandle m_hStopEvent;		/**< Set to stop the reaper thread */
+	LONG m_nExited;
+	LONG m_nKilled;
+	DWORD m_dwHandlesBefore;
+	DWORD m_dwHandlesAfter;
+};
+
+extern CShellReaper * g_pShellReaper;	// created during kInitAppMsg, deleted during kUnloadAppMsg
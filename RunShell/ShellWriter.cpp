@@ -0,0 +1,421 @@
+/**	\file ShellWriter.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellWriter.cpp															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+#include "StdAfx.h"
+#include "ShellWriter.h"
+#include <process.h>
+#include <algorithm>
+
+#define WRITE_CHUNK_SIZE 65536	// most bytes given to one WriteFile
+#define FILE_CHUNK_SIZE 1048576	// bytes read from a queued file at once
+
+CShellWriter::CShellWriter(void)
+{
+	InitializeCriticalSection(&m_cs);
+	m_nLimit = 0;
+	m_policy = kWriteFullBlock;
+	m_nInFlight = 0;
+	m_nDropped = 0;
+	m_dwError = 0;
+	m_nBeforeFile = 0;
+	m_bFile = false;
+	m_bClose = false;
+	m_nFileSent = 0;
+	m_nFileTotal = 0;
+}
+
+CShellWriter::~CShellWriter(void)
+{
+	Stop();
+	DeleteCriticalSection(&m_cs);
+}
+
+int CShellWriter::Start( HANDLE hPipe, DWORD nLimit, WriteFullPolicy policy )
+{
+	m_hPipe = hPipe;
+	m_bClose = false;
+	m_nLimit = nLimit;
+	m_policy = policy;
+
+	// all manual reset, each stays signaled for as long as its state lasts
+	m_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	m_hDataEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	m_hSpaceEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
+	m_hIdleEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
+	if(!m_hStopEvent.IsValid() || !m_hDataEvent.IsValid() || !m_hSpaceEvent.IsValid()
+		|| !m_hIdleEvent.IsValid())
+		return RTERROR;
+
+	unsigned nThreadId;
+	m_hThread = (HANDLE) _beginthreadex(NULL, 0, WriterThread, this, 0, &nThreadId);
+	if(!m_hThread.IsValid())
+		return RTERROR;
+	return RTNORM;
+}
+
+void CShellWriter::Stop( void )
+{
+	if(m_hThread.IsValid()) {
+		SetEvent(m_hStopEvent.Handle());
+		WaitForSingleObject(m_hThread.Handle(), INFINITE);
+		m_hThread.CloseHandle();
+
+		m_queue.clear();
+		m_writing.clear();
+		m_nInFlight = 0;
+		m_nBeforeFile = 0;
+		if(m_hFile.IsValid()) {
+			m_hFile.CloseHandle();
+			if(!m_dwError)
+				m_dwError = ERROR_OPERATION_ABORTED;
+		}
+		SetEvent(m_hSpaceEvent.Handle());
+		SetEvent(m_hIdleEvent.Handle());
+	}
+	// the writer thread may have closed it already
+	m_hPipe.CloseHandle();
+}
+
+void CShellWriter::CloseWhenDone( void )
+{
+	EnterCriticalSection(&m_cs);
+	m_bClose = true;
+	// wake the writer thread, it may have nothing left to write
+	SetEvent(m_hDataEvent.Handle());
+	LeaveCriticalSection(&m_cs);
+}
+
+bool CShellWriter::IsClosing( void ) const
+{
+	EnterCriticalSection(&m_cs);
+	bool bClose = m_bClose;
+	LeaveCriticalSection(&m_cs);
+	return bClose;
+}
+
+int CShellWriter::Write( const char * pData, DWORD nSize, DWORD & nQueued, DWORD dwTimeout )
+{
+	nQueued = 0;
+	DWORD dwStart = GetTickCount();
+	for(;;) {
+		EnterCriticalSection(&m_cs);
+		if(m_dwError || m_bClose) {
+			LeaveCriticalSection(&m_cs);
+			return RTERROR;
+		}
+
+		DWORD nUsed = (DWORD) m_queue.size() + m_nInFlight;
+		DWORD nRoom = nUsed < m_nLimit ? m_nLimit - nUsed : 0;
+		if(nSize - nQueued > nRoom && m_policy != kWriteFullBlock) {
+			// fail and drop are all or nothing
+			if(m_policy == kWriteFullDrop)
+				m_nDropped += nSize;
+			LeaveCriticalSection(&m_cs);
+			return m_policy == kWriteFullDrop ? RTNORM : RTERROR;
+		}
+
+		DWORD nCopy = std::min(nRoom, nSize - nQueued);
+		if(nCopy) {
+			m_queue.insert(m_queue.end(), pData + nQueued, pData + nQueued + nCopy);
+			nQueued += nCopy;
+			SetEvent(m_hDataEvent.Handle());
+			ResetEvent(m_hIdleEvent.Handle());
+		}
+		if(nRoom == nCopy)
+			ResetEvent(m_hSpaceEvent.Handle());
+		LeaveCriticalSection(&m_cs);
+
+		if(nQueued == nSize)
+			return RTNORM;
+
+		DWORD dwElapsed = GetTickCount() - dwStart;
+		if(dwTimeout != INFINITE && dwElapsed >= dwTimeout)
+			return RTNONE;
+		if(WaitForSingleObject(m_hSpaceEvent.Handle(),
+			dwTimeout == INFINITE ? INFINITE : dwTimeout - dwElapsed) == WAIT_TIMEOUT)
+			return RTNONE;
+	}
+}
+
+int CShellWriter::QueueFile( const TCHAR * pcszPath, ULONGLONG nOffset, ULONGLONG nLength )
+{
+	if(!m_hThread.IsValid()) {
+		SetLastError(ERROR_INVALID_FUNCTION);
+		return RTERROR;
+	}
+
+	CShellHandle hFile;
+	hFile = CreateFile(pcszPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(hFile.Handle() == INVALID_HANDLE_VALUE) {
+		hFile.Handle() = NULL;
+		return RTERROR;
+	}
+
+	// a file that is shorter than asked for is written up to its end
+	LARGE_INTEGER size, offset;
+	offset.QuadPart = (LONGLONG) nOffset;
+	if(!GetFileSizeEx(hFile.Handle(), &size) || !SetFilePointerEx(hFile.Handle(), offset, NULL, FILE_BEGIN))
+		return RTERROR;
+	ULONGLONG nAvailable = (ULONGLONG) size.QuadPart > nOffset ? (ULONGLONG) size.QuadPart - nOffset : 0;
+	if(!nLength || nLength > nAvailable)
+		nLength = nAvailable;
+
+	EnterCriticalSection(&m_cs);
+	DWORD dwError = m_hFile.IsValid() ? ERROR_BUSY : m_bClose ? ERROR_INVALID_HANDLE : m_dwError;
+	if(!dwError) {
+		m_hFile = hFile.Handle();
+		hFile.Handle() = NULL;
+		m_bFile = true;
+		m_nFileSent = 0;
+		m_nFileTotal = nLength;
+		m_nBeforeFile = (DWORD) m_queue.size();
+		SetEvent(m_hDataEvent.Handle());
+		ResetEvent(m_hIdleEvent.Handle());
+	}
+	LeaveCriticalSection(&m_cs);
+
+	if(dwError) {
+		SetLastError(dwError);
+		return RTERROR;
+	}
+	return RTNORM;
+}
+
+int CShellWriter::GetFileProgress( ULONGLONG & nSent, ULONGLONG & nTotal ) const
+{
+	EnterCriticalSection(&m_cs);
+	nSent = m_nFileSent;
+	nTotal = m_nFileTotal;
+	int nResult = RTNONE;
+	if(!m_bFile || m_dwError)
+		nResult = RTERROR;
+	else if(!m_hFile.IsValid())
+		nResult = RTNORM;
+	LeaveCriticalSection(&m_cs);
+	return nResult;
+}
+
+int CShellWriter::Flush( DWORD dwTimeout )
+{
+	if(!m_hThread.IsValid())
+		return RTNORM;
+	if(WaitForSingleObject(m_hIdleEvent.Handle(), dwTimeout) == WAIT_TIMEOUT)
+		return RTNONE;
+	return GetError() ? RTERROR : RTNORM;
+}
+
+DWORD CShellWriter::GetQueued( void ) const
+{
+	EnterCriticalSection(&m_cs);
+	DWORD nQueued = (DWORD) m_queue.size() + m_nInFlight;
+	LeaveCriticalSection(&m_cs);
+	return nQueued;
+}
+
+DWORD CShellWriter::GetDropped( void ) const
+{
+	EnterCriticalSection(&m_cs);
+	DWORD nDropped = m_nDropped;
+	LeaveCriticalSection(&m_cs);
+	return nDropped;
+}
+
+DWORD CShellWriter::GetError( void ) const
+{
+	EnterCriticalSection(&m_cs);
+	DWORD dwError = m_dwError;
+	LeaveCriticalSection(&m_cs);
+	return dwError;
+}
+
+// Takes everything queued at once by swapping it with the empty
+// m_writing buffer, so Write can keep queuing while it is written.
+// While a file is queued only the bytes queued before it are taken,
+// then the file, and the bytes queued after it on the next round.
+// A failed write doesn't end the thread, it still has to close the
+// pipe when asked to.
+unsigned __stdcall CShellWriter::WriterThread( void * pParam )
+{
+	CShellWriter * pThis = (CShellWriter *) pParam;
+	HANDLE hWaits[2] = { pThis->m_hStopEvent.Handle(), pThis->m_hDataEvent.Handle() };
+
+	while(WaitForMultipleObjects(2, hWaits, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+		EnterCriticalSection(&pThis->m_cs);
+		bool bFile = pThis->m_hFile.IsValid();
+		if(bFile) {
+			std::vector<char>::iterator itEnd = pThis->m_queue.begin() + pThis->m_nBeforeFile;
+			pThis->m_writing.assign(pThis->m_queue.begin(), itEnd);
+			pThis->m_queue.erase(pThis->m_queue.begin(), itEnd);
+			pThis->m_nBeforeFile = 0;
+		} else
+			pThis->m_writing.swap(pThis->m_queue);
+		pThis->m_nInFlight = (DWORD) pThis->m_writing.size();
+		if(!bFile)
+			ResetEvent(pThis->m_hDataEvent.Handle());
+		LeaveCriticalSection(&pThis->m_cs);
+
+		if(!pThis->WriteQueued())
+			break;
+		if(bFile && !pThis->WriteQueuedFile())
+			break;
+
+		// SetError empties the queue, so a failed write closes too
+		EnterCriticalSection(&pThis->m_cs);
+		bool bClose = pThis->m_bClose && pThis->m_queue.empty() && !pThis->m_hFile.IsValid();
+		LeaveCriticalSection(&pThis->m_cs);
+		if(bClose) {
+			pThis->m_hPipe.CloseHandle();
+			break;
+		}
+	}
+	return 0;
+}
+
+bool CShellWriter::WriteQueued( void )
+{
+	CShellHandle hEvent;
+	hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	DWORD dwError = 0;
+	size_t nHead = 0;
+	while(nHead < m_writing.size()) {
+		DWORD nChunk = (DWORD) std::min<size_t>(m_writing.size() - nHead, WRITE_CHUNK_SIZE);
+		DWORD dwWritten = 0;
+		int nResult = WritePipe(hEvent.Handle(), &m_writing[nHead], nChunk, dwWritten, dwError);
+		if(nResult == RTNONE)
+			return false;
+		if(nResult == RTERROR)
+			break;
+		nHead += dwWritten;
+
+		EnterCriticalSection(&m_cs);
+		m_nInFlight -= dwWritten;
+		SetEvent(m_hSpaceEvent.Handle());
+		LeaveCriticalSection(&m_cs);
+	}
+	m_writing.clear();
+
+	EnterCriticalSection(&m_cs);
+	if(dwError)
+		SetError(dwError);
+	m_nInFlight = 0;
+	SetEvent(m_hSpaceEvent.Handle());
+	if(m_queue.empty() && !m_hFile.IsValid())
+		SetEvent(m_hIdleEvent.Handle());
+	LeaveCriticalSection(&m_cs);
+	return true;
+}
+
+bool CShellWriter::WriteQueuedFile( void )
+{
+	// a failed write before the file has closed it already
+	if(!m_hFile.IsValid())
+		return true;
+
+	CShellHandle hEvent;
+	hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	m_fileBuffer.resize(FILE_CHUNK_SIZE);
+
+	// Only this thread changes m_nFileSent and m_nFileTotal while the
+	// file is open, so they can be read without the lock here.
+	DWORD dwError = 0;
+	while(!dwError && m_nFileSent < m_nFileTotal) {
+		DWORD nRead = 0;
+		DWORD nChunk = (DWORD) std::min<ULONGLONG>(m_nFileTotal - m_nFileSent, FILE_CHUNK_SIZE);
+		if(!ReadFile(m_hFile.Handle(), &m_fileBuffer[0], nChunk, &nRead, NULL)) {
+			dwError = GetLastError();
+			break;
+		}
+		if(!nRead) {
+			// the file got shorter since it was queued
+			EnterCriticalSection(&m_cs);
+			m_nFileTotal = m_nFileSent;
+			LeaveCriticalSection(&m_cs);
+			break;
+		}
+
+		DWORD nHead = 0;
+		while(nHead < nRead) {
+			DWORD dwWritten = 0;
+			int nResult = WritePipe(hEvent.Handle(), &m_fileBuffer[nHead], nRead - nHead, dwWritten, dwError);
+			if(nResult == RTNONE)
+				return false;
+			if(nResult == RTERROR)
+				break;
+			nHead += dwWritten;
+
+			EnterCriticalSection(&m_cs);
+			m_nFileSent += dwWritten;
+			LeaveCriticalSection(&m_cs);
+		}
+	}
+	std::vector<char>().swap(m_fileBuffer);
+
+	EnterCriticalSection(&m_cs);
+	m_hFile.CloseHandle();
+	if(dwError)
+		SetError(dwError);
+	if(m_queue.empty())
+		SetEvent(m_hIdleEvent.Handle());
+	LeaveCriticalSection(&m_cs);
+	return true;
+}
+
+int CShellWriter::WritePipe( HANDLE hEvent, const char * pData, DWORD nSize, DWORD & nWritten, DWORD & dwError )
+{
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(OVERLAPPED));
+	ov.hEvent = hEvent;
+	nWritten = 0;
+	if(WriteFile(m_hPipe.Handle(), pData, nSize, &nWritten, &ov))
+		return RTNORM;
+
+	dwError = GetLastError();
+	if(dwError != ERROR_IO_PENDING)
+		return RTERROR;
+	dwError = 0;
+
+	// The child may not be reading, so the write can take
+	// forever. Stop must still be able to end the thread.
+	HANDLE hWaits[2] = { m_hStopEvent.Handle(), hEvent };
+	if(WaitForMultipleObjects(2, hWaits, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+		CancelIo(m_hPipe.Handle());
+		GetOverlappedResult(m_hPipe.Handle(), &ov, &nWritten, TRUE);
+		return RTNONE;
+	}
+	if(!GetOverlappedResult(m_hPipe.Handle(), &ov, &nWritten, FALSE)) {
+		dwError = GetLastError();
+		return RTERROR;
+	}
+	return RTNORM;
+}
+
+void CShellWriter::SetError( DWORD dwError )
+{
+	// usually the child has exited, so nothing more can be written
+	m_dwError = dwError;
+	m_queue.clear();
+	m_nBeforeFile = 0;
+	m_hFile.CloseHandle();
+}
@@ -0,0 +1,179 @@
+/**	\file ShellWriter.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellWriter.h															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+#include <vector>
+#include "ShellHandle.h"
+
+/**	\brief What CShellWriter::Write does when the queue is full */
+enum WriteFullPolicy
+{
+	kWriteFullBlock,	/**< Wait for the writer thread to make room */
+	kWriteFullFail,		/**< Fail the write, nothing is queued */
+	kWriteFullDrop		/**< Drop the write, nothing is queued */
+};
+
+/**	\brief Writes to a child's stdin from a background thread
+*
+*	Write copies the bytes into a bounded queue and returns, and the writer
+*	thread feeds the queue to the pipe. A child that stops reading its
+*	stdin then blocks the writer thread instead of the caller.
+*
+*	A file can be queued too, and the writer thread streams it to the pipe
+*	with large reads, in order with the bytes queued before and after it.
+*
+*	The pipe must be opened for overlapped I/O, so Stop can interrupt a
+*	write the child is not reading. The writer owns the pipe, so CloseWhenDone
+*	can have the writer thread close it once the child has everything.
+*/
+class CShellWriter
+{
+public:
+	CShellWriter(void);
+
+	/**	\brief Stops the writer thread, anything still queued is dropped */
+	~CShellWriter(void);
+
+	/**	\brief Starts the writer thread
+	*	\param[in] hPipe the overlapped write end of the pipe, owned by the
+	*	writer from now on, even if Start fails.
+	*	\param[in] nLimit most bytes queued at once
+	*	\param[in] policy what Write does when the queue is full
+	*	\returns RTNORM if successful, otherwise RTERROR
+	*/
+	int Start(HANDLE hPipe, DWORD nLimit, WriteFullPolicy policy);
+
+	/**	\brief Stops the writer thread and closes the pipe, anything still queued is dropped */
+	void Stop(void);
+
+	/**	\brief Has the writer thread close the pipe once everything queued is written
+	*
+	*	Returns at once, so the caller never waits on a child that isn't
+	*	reading its stdin. Write and QueueFile fail from now on.
+	*/
+	void CloseWhenDone(void);
+
+	/**	\brief true once CloseWhenDone has been called */
+	bool IsClosing(void) const;
+
+	/**	\brief true between Start and Stop */
+	bool IsRunning(void) { return m_hThread.IsValid(); }
+
+	/**	\brief Queues bytes to be written
+	*	\param[in] pData the bytes
+	*	\param[in] nSize number of bytes in pData
+	*	\param[out] nQueued number of bytes queued
+	*	\param[in] dwTimeout milliseconds to wait for room, blocking policy only
+	*	\returns RTNORM if the bytes were queued or dropped, RTNONE if there
+	*	was no room for all of them within dwTimeout, otherwise RTERROR if
+	*	the queue is full and the policy is to fail, or an earlier write failed.
+	*
+	*	With the blocking policy as many bytes are queued as there is room
+	*	for, and the caller passes the rest again after an RTNONE.
+	*/
+	int Write(const char * pData, DWORD nSize, DWORD & nQueued, DWORD dwTimeout);
+
+	/**	\brief Queues a file to be written
+	*	\param[in] pcszPath the file
+	*	\param[in] nOffset where in the file to start
+	*	\param[in] nLength number of bytes to write, 0 for the rest of the file
+	*	\returns RTNORM if successful, otherwise RTERROR if the file can't be
+	*	opened, a file is already being written or an earlier write failed.
+	*
+	*	The bytes are written as they are, without any conversion. The queue
+	*	limit does not apply to them.
+	*/
+	int QueueFile(const TCHAR * pcszPath, ULONGLONG nOffset, ULONGLONG nLength);
+
+	/**	\brief Gets how far the file queued with QueueFile has got
+	*	\param[out] nSent bytes of the file written so far
+	*	\param[out] nTotal bytes of the file to write
+	*	\returns RTNORM once the whole file is written, RTNONE while it is
+	*	still being written, otherwise RTERROR if no file was queued or a
+	*	write failed.
+	*/
+	int GetFileProgress(ULONGLONG & nSent, ULONGLONG & nTotal) const;
+
+	/**	\brief Waits until everything queued has been written
+	*	\param[in] dwTimeout milliseconds to wait
+	*	\returns RTNORM once the queue is empty, RTNONE on timeout, otherwise
+	*	RTERROR if a write failed.
+	*/
+	int Flush(DWORD dwTimeout);
+
+	DWORD GetQueued(void) const;	/**< Bytes queued or being written */
+	DWORD GetDropped(void) const;	/**< Bytes dropped because the queue was full */
+	DWORD GetError(void) const;		/**< Error of the write that failed, or 0 */
+
+private:
+	CShellWriter(const CShellWriter &);
+	CShellWriter & operator=(const CShellWriter &);
+
+	static unsigned __stdcall WriterThread(void * pParam);
+
+	/**	\brief Writes m_writing, called on the writer thread
+	*	\returns false if Stop was called
+	*/
+	bool WriteQueued(void);
+
+	/**	\brief Writes m_hFile, called on the writer thread
+	*	\returns false if Stop was called
+	*/
+	bool WriteQueuedFile(void);
+
+	/**	\brief Writes bytes to the pipe, called on the writer thread
+	*	\param[in] hEvent event for the overlapped write
+	*	\param[out] nWritten bytes written
+	*	\returns RTNORM if some bytes were written, RTNONE if Stop was
+	*	called, otherwise RTERROR with the error in dwError.
+	*/
+	int WritePipe(HANDLE hEvent, const char * pData, DWORD nSize, DWORD & nWritten, DWORD & dwError);
+
+	/**	\brief Records a failed write and drops everything queued, m_cs must be held */
+	void SetError(DWORD dwError);
+
+	CShellHandle m_hPipe;			/**< Only used by the writer thread while it runs */
+	DWORD m_nLimit;
+	WriteFullPolicy m_policy;
+
+	mutable CRITICAL_SECTION m_cs;	/**< Guards the members below */
+	std::vector<char> m_queue;		/**< Queued bytes */
+	DWORD m_nInFlight;				/**< Bytes the writer thread took and hasn't written yet */
+	DWORD m_nDropped;
+	DWORD m_dwError;
+	DWORD m_nBeforeFile;			/**< Bytes at the front of m_queue that go before m_hFile */
+	bool m_bFile;					/**< A file was queued, m_hFile is open until it is written */
+	bool m_bClose;					/**< Close m_hPipe once the queue and the file are written */
+	ULONGLONG m_nFileSent;
+	ULONGLONG m_nFileTotal;
+
+	std::vector<char> m_writing;	/**< The bytes being written, swapped with m_queue */
+	std::vector<char> m_fileBuffer;	/**< Holds each piece read from m_hFile */
+	CShellHandle m_hFile;			/**< The file being written */
+	CShellHandle m_hThread;
+	CShellHandle m_hStopEvent;		/**< Set to stop the writer thread */
+	CShellHandle m_hDataEvent;		/**< Signaled while m_queue holds bytes or a file is waiting */
+	CShellHandle m_hSpaceEvent;		/**< Signaled while the queue has room */
+	CShellHandle m_hIdleEvent;		/**< Signaled while nothing is queued or in flight */
+};
@@ -0,0 +1,331 @@
+/**	\file TextDecoder.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	TextDecoder.cpp															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+#include "StdAfx.h"
+#include "TextDecoder.h"
+#include <emmintrin.h>
+
+#define REPLACEMENT_CHAR 0xFFFD
+
+#ifdef _UNICODE
+// Widens the ASCII bytes at the start of pBytes into pOut, 16 at a time.
+// Returns the number of bytes widened, which stops at the first byte
+// with the high bit set.
+static size_t WidenAscii(const char * pBytes, size_t nBytes, wchar_t * pOut)
+{
+	size_t i = 0;
+	const __m128i zero = _mm_setzero_si128();
+	while(nBytes - i >= 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *) (pBytes + i));
+		if(_mm_movemask_epi8(block))
+			break; // not all ASCII, the loop below finds where it stops
+		_mm_storeu_si128((__m128i *) (pOut + i), _mm_unpacklo_epi8(block, zero));
+		_mm_storeu_si128((__m128i *) (pOut + i + 8), _mm_unpackhi_epi8(block, zero));
+		i += 16;
+	}
+	for(; i < nBytes && !(pBytes[i] & 0x80); ++i)
+		pOut[i] = (wchar_t) pBytes[i];
+	return i;
+}
+
+// Narrows the ASCII characters at the start of pText into pOut, 16 at a
+// time. Returns the number of characters narrowed, which stops at the
+// first one above 0x7F.
+static size_t NarrowAscii(const wchar_t * pText, size_t nLength, char * pOut)
+{
+	size_t i = 0;
+	const __m128i highBits = _mm_set1_epi16((short) 0xFF80);
+	const __m128i zero = _mm_setzero_si128();
+	while(nLength - i >= 16) {
+		__m128i lo = _mm_loadu_si128((const __m128i *) (pText + i));
+		__m128i hi = _mm_loadu_si128((const __m128i *) (pText + i + 8));
+		__m128i test = _mm_and_si128(_mm_or_si128(lo, hi), highBits);
+		if(_mm_movemask_epi8(_mm_cmpeq_epi16(test, zero)) != 0xFFFF)
+			break; // not all ASCII, the loop below finds where it stops
+		_mm_storeu_si128((__m128i *) (pOut + i), _mm_packus_epi16(lo, hi));
+		i += 16;
+	}
+	for(; i < nLength && pText[i] < 0x80; ++i)
+		pOut[i] = (char) pText[i];
+	return i;
+}
+#else
+// Gets the number of ASCII bytes at the start of pBytes, checked 16 at a time
+static size_t AsciiLength(const char * pBytes, size_t nBytes)
+{
+	size_t i = 0;
+	while(nBytes - i >= 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *) (pBytes + i));
+		if(_mm_movemask_epi8(block))
+			break;
+		i += 16;
+	}
+	for(; i < nBytes && !(pBytes[i] & 0x80); ++i)
+		;
+	return i;
+}
+#endif
+
+// Gets the code page of an encoding, 0 for UTF-16
+static UINT EncodingCodePage(TextEncoding encoding)
+{
+	switch(encoding) {
+	case kEncodingOem:
+		return GetOEMCP();
+	case kEncodingAnsi:
+		return GetACP();
+	case kEncodingUtf16:
+		return 0;
+	default:
+		return CP_UTF8;
+	}
+}
+
+CTextDecoder::CTextDecoder( TextEncoding encoding )
+{
+	SetEncoding(encoding);
+}
+
+void CTextDecoder::SetEncoding( TextEncoding encoding )
+{
+	m_encoding = encoding;
+	m_nPending = 0;
+	m_nCodePage = EncodingCodePage(encoding);
+
+	CPINFO info;
+	m_bDoubleByte = m_nCodePage && m_nCodePage != CP_UTF8
+		&& GetCPInfo(m_nCodePage, &info) && info.MaxCharSize > 1;
+}
+
+void CTextDecoder::Decode( const char * pBytes, size_t nBytes, TString & sResults, bool bFlush )
+{
+	sResults.erase();
+
+	// Finish the character the last piece ended in. Bytes are moved over
+	// one at a time, a character is never more than 4 bytes.
+	while(m_nPending) {
+		while(nBytes && m_nPending < sizeof(m_pending) && CompleteLength(m_pending, m_nPending) < m_nPending) {
+			m_pending[m_nPending++] = *pBytes++;
+			--nBytes;
+		}
+		size_t nComplete = CompleteLength(m_pending, m_nPending);
+		if(!nBytes && bFlush)
+			nComplete = m_nPending;
+		else if(!nComplete && m_nPending == sizeof(m_pending))
+			nComplete = 1; // can never be completed, let it be replaced
+		if(!nComplete)
+			return; // the whole piece went into the incomplete character
+
+		Append(m_pending, nComplete, sResults);
+		m_nPending -= nComplete;
+		memmove(m_pending, m_pending + nComplete, m_nPending);
+	}
+
+	size_t nComplete = bFlush ? nBytes : CompleteLength(pBytes, nBytes);
+	Append(pBytes, nComplete, sResults);
+	m_nPending = nBytes - nComplete;
+	memcpy(m_pending, pBytes + nComplete, m_nPending);
+}
+
+size_t CTextDecoder::CompleteLength( const char * pBytes, size_t nBytes ) const
+{
+	const unsigned char * p = (const unsigned char *) pBytes;
+
+	if(m_encoding == kEncodingUtf16) {
+		// whole code units, and a high surrogate waits for its low surrogate
+		size_t nLength = nBytes & ~(size_t) 1;
+		if(nLength >= 2 && p[nLength - 1] >= 0xD8 && p[nLength - 1] <= 0xDB)
+			nLength -= 2;
+		return nLength;
+	}
+
+	if(m_encoding == kEncodingUtf8) {
+		// find the lead byte of the last character, at most 4 bytes back,
+		// and check all of its continuation bytes are there
+		for(size_t i = nBytes; i > 0 && nBytes - i < 4; ) {
+			unsigned char c = p[--i];
+			if((c & 0xC0) != 0x80) {
+				size_t nCharLength = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+				return i + nCharLength > nBytes ? i : nBytes;
+			}
+		}
+		return nBytes; // stray continuation bytes, MultiByteToWideChar replaces them
+	}
+
+	if(!m_bDoubleByte)
+		return nBytes;
+
+	// A trail byte can look like a lead byte, so walk the characters
+	// from the start, which is always the start of a character.
+	size_t i = 0;
+	while(i < nBytes) {
+		if(IsDBCSLeadByteEx(m_nCodePage, p[i])) {
+			if(i + 1 == nBytes)
+				return i;
+			i += 2;
+		} else
+			++i;
+	}
+	return nBytes;
+}
+
+#ifdef _UNICODE
+void CTextDecoder::Append( const char * pBytes, size_t nBytes, TString & sResults )
+{
+	if(!nBytes)
+		return;
+
+	size_t nStart = sResults.size();
+	if(m_encoding == kEncodingUtf16) {
+		// already UTF-16, only a stray last byte needs any work
+		size_t nChars = nBytes / 2;
+		sResults.resize(nStart + nChars);
+		memcpy(&sResults[nStart], pBytes, nChars * sizeof(wchar_t));
+		if(nBytes & 1)
+			sResults += (wchar_t) REPLACEMENT_CHAR;
+		return;
+	}
+
+	// No byte gives more than one UTF-16 code unit (4 byte UTF-8 gives
+	// two), so this is always big enough and one conversion call does.
+	sResults.resize(nStart + nBytes);
+	wchar_t * pOut = &sResults[nStart];
+	size_t nAscii = WidenAscii(pBytes, nBytes, pOut);
+	int nWide = 0;
+	if(nAscii < nBytes) {
+		nWide = MultiByteToWideChar(m_nCodePage, 0, pBytes + nAscii, (int) (nBytes - nAscii),
+			pOut + nAscii, (int) (nBytes - nAscii));
+	}
+	sResults.resize(nStart + nAscii + nWide);
+}
+#else
+void CTextDecoder::Append( const char * pBytes, size_t nBytes, TString & sResults )
+{
+	if(!nBytes)
+		return;
+
+	if(m_encoding == kEncodingAnsi) {
+		sResults.append(pBytes, nBytes);
+		return;
+	}
+
+	// ASCII is the same in every code page except UTF-16
+	size_t nAscii = m_encoding == kEncodingUtf16 ? 0 : AsciiLength(pBytes, nBytes);
+	sResults.append(pBytes, nAscii);
+	pBytes += nAscii;
+	nBytes -= nAscii;
+	if(!nBytes)
+		return;
+
+	// the rest goes to UTF-16 first, then to the ANSI code page
+	if(m_encoding == kEncodingUtf16) {
+		m_sWide.resize(nBytes / 2);
+		if(!m_sWide.empty())
+			memcpy(&m_sWide[0], pBytes, m_sWide.size() * sizeof(wchar_t));
+		if(nBytes & 1)
+			m_sWide += (wchar_t) REPLACEMENT_CHAR;
+	} else {
+		m_sWide.resize(nBytes);
+		int nWide = MultiByteToWideChar(m_nCodePage, 0, pBytes, (int) nBytes, &m_sWide[0], (int) nBytes);
+		m_sWide.resize(nWide);
+	}
+	if(m_sWide.empty())
+		return;
+
+	// a double byte ANSI code page takes at most 2 bytes per character
+	size_t nStart = sResults.size();
+	sResults.resize(nStart + m_sWide.size() * 2);
+	int nAnsi = WideCharToMultiByte(CP_ACP, 0, m_sWide.data(), (int) m_sWide.size(),
+		&sResults[nStart], (int) m_sWide.size() * 2, NULL, NULL);
+	sResults.resize(nStart + nAnsi);
+}
+#endif
+
+
+CTextEncoder::CTextEncoder( TextEncoding encoding )
+{
+	SetEncoding(encoding);
+}
+
+void CTextEncoder::SetEncoding( TextEncoding encoding )
+{
+	m_encoding = encoding;
+	m_nCodePage = EncodingCodePage(encoding);
+}
+
+#ifdef _UNICODE
+void CTextEncoder::Encode( const TCHAR * pcszText, size_t nLength, std::string & sBytes )
+{
+	if(!nLength)
+		return;
+
+	size_t nStart = sBytes.size();
+	if(m_encoding == kEncodingUtf16) {
+		sBytes.resize(nStart + nLength * sizeof(wchar_t));
+		memcpy(&sBytes[nStart], pcszText, nLength * sizeof(wchar_t));
+		return;
+	}
+
+	// UTF-8 takes at most 3 bytes per UTF-16 code unit, the OEM and ANSI
+	// code pages 2, so one conversion call does.
+	sBytes.resize(nStart + nLength * 3);
+	char * pOut = &sBytes[nStart];
+	size_t nAscii = NarrowAscii(pcszText, nLength, pOut);
+	int nNarrow = 0;
+	if(nAscii < nLength) {
+		nNarrow = WideCharToMultiByte(m_nCodePage, 0, pcszText + nAscii, (int) (nLength - nAscii),
+			pOut + nAscii, (int) ((nLength - nAscii) * 3), NULL, NULL);
+	}
+	sBytes.resize(nStart + nAscii + nNarrow);
+}
+#else
+void CTextEncoder::Encode( const TCHAR * pcszText, size_t nLength, std::string & sBytes )
+{
+	if(m_encoding == kEncodingAnsi) {
+		sBytes.append(pcszText, nLength);
+		return;
+	}
+
+	size_t nAscii = m_encoding == kEncodingUtf16 ? 0 : AsciiLength(pcszText, nLength);
+	sBytes.append(pcszText, nAscii);
+	pcszText += nAscii;
+	nLength -= nAscii;
+	if(!nLength)
+		return;
+
+	// the rest goes to UTF-16 first, then to the shell's encoding
+	m_sWide.resize(nLength);
+	int nWide = MultiByteToWideChar(CP_ACP, 0, pcszText, (int) nLength, &m_sWide[0], (int) nLength);
+	size_t nStart = sBytes.size();
+	if(m_encoding == kEncodingUtf16) {
+		sBytes.resize(nStart + nWide * sizeof(wchar_t));
+		if(nWide)
+			memcpy(&sBytes[nStart], m_sWide.data(), nWide * sizeof(wchar_t));
+		return;
+	}
+	sBytes.resize(nStart + nWide * 3);
+	int nNarrow = WideCharToMultiByte(m_nCodePage, 0, m_sWide.data(), nWide,
+		&sBytes[nStart], nWide * 3, NULL, NULL);
+	sBytes.resize(nStart + nNarrow);
+}
+#endif
@@ -0,0 +1,121 @@
+/**	\file TextDecoder.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	TextDecoder.h															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+
+/**	\brief Encodings of the text on a child's pipes */
+enum TextEncoding
+{
+	kEncodingUtf8,	/**< UTF-8, the default */
+	kEncodingOem,	/**< The OEM code page, what cmd.exe built-ins write to a pipe */
+	kEncodingAnsi,	/**< The ANSI code page */
+	kEncodingUtf16	/**< UTF-16 little endian, what "cmd /u" writes */
+};
+
+/**	\brief Converts the bytes read from a child into TString a piece at a time
+*
+*	The child's output arrives in pieces that can end in the middle of a
+*	character. The decoder keeps such an incomplete character and puts it
+*	in front of the next piece, so every character is converted whole.
+*
+*	Runs of ASCII are widened directly, 16 bytes at a time with SSE2, and
+*	only the rest goes through MultiByteToWideChar, in a single call into
+*	a buffer sized for the worst case.
+*/
+class CTextDecoder
+{
+public:
+	CTextDecoder(TextEncoding encoding = kEncodingUtf8);
+
+	/**	\brief Sets the encoding, and drops any incomplete character */
+	void SetEncoding(TextEncoding encoding);
+	TextEncoding GetEncoding(void) const { return m_encoding; }
+
+	/**	\brief Converts the next piece of the stream
+	*	\param[in] pBytes the bytes
+	*	\param[in] nBytes the number of bytes
+	*	\param[out] sResults receives the text
+	*	\param[in] bFlush true if no more bytes follow, so an incomplete
+	*	character at the end is converted as it is instead of kept.
+	*
+	*	sResults keeps its capacity, so a string reused for every call stops
+	*	allocating once it is large enough.
+	*/
+	void Decode(const char * pBytes, size_t nBytes, TString & sResults, bool bFlush = false);
+
+	/**	\brief Number of bytes of an incomplete character kept from the last piece */
+	size_t GetPending(void) const { return m_nPending; }
+
+	/**	\brief Drops any incomplete character */
+	void Reset(void) { m_nPending = 0; }
+
+private:
+	/**	\brief Gets the number of bytes at the start of pBytes that hold whole characters */
+	size_t CompleteLength(const char * pBytes, size_t nBytes) const;
+
+	/**	\brief Converts whole characters and appends them to sResults */
+	void Append(const char * pBytes, size_t nBytes, TString & sResults);
+
+	TextEncoding m_encoding;
+	UINT m_nCodePage;		/**< Code page for MultiByteToWideChar, 0 for UTF-16 */
+	bool m_bDoubleByte;		/**< m_nCodePage has lead bytes, such as 932 */
+	char m_pending[4];		/**< The incomplete character at the end of the last piece */
+	size_t m_nPending;
+#ifndef _UNICODE
+	std::wstring m_sWide;	/**< Wide text on its way to the ANSI code page */
+#endif
+};
+
+/**	\brief Converts TString into the bytes written to a child's stdin
+*
+*	The counterpart of CTextDecoder. Runs of ASCII are narrowed directly,
+*	16 characters at a time with SSE2, and only the rest goes through
+*	WideCharToMultiByte, in a single call into a buffer sized for the
+*	worst case.
+*/
+class CTextEncoder
+{
+public:
+	CTextEncoder(TextEncoding encoding = kEncodingUtf8);
+
+	void SetEncoding(TextEncoding encoding);
+	TextEncoding GetEncoding(void) const { return m_encoding; }
+
+	/**	\brief Converts text and appends it to sBytes
+	*	\param[in] pcszText the text
+	*	\param[in] nLength the number of TCHARs in pcszText
+	*	\param[in,out] sBytes the bytes are appended to it
+	*
+	*	sBytes keeps its capacity, so a buffer reused for every call stops
+	*	allocating once it is large enough.
+	*/
+	void Encode(const TCHAR * pcszText, size_t nLength, std::string & sBytes);
+
+private:
+	TextEncoding m_encoding;
+	UINT m_nCodePage;		/**< Code page for WideCharToMultiByte, 0 for UTF-16 */
+#ifndef _UNICODE
+	std::wstring m_sWide;	/**< ANSI text on its way to the other encodings */
+#endif
+};
@@ -0,0 +1,91 @@
+/**	\file Base64Tests.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	Base64Tests.cpp															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#include "StdAfx.h"
+#include "RunShellTests.h"
+#include "..\RunShell\Base64.h"
+#include "..\RunShell\CommandLine.h"
+
+void TestBase64( void )
+{
+	// the test vectors of RFC 4648
+	const char * ppBytes[] = { "", "f", "fo", "foo", "foob", "fooba", "foobar" };
+	const TCHAR * ppText[] = { _T(""), _T("Zg=="), _T("Zm8="), _T("Zm9v"), _T("Zm9vYg=="),
+		_T("Zm9vYmE="), _T("Zm9vYmFy") };
+	for(size_t i = 0; i < sizeof(ppBytes) / sizeof(ppBytes[0]); ++i) {
+		TString sText;
+		Base64Encode(ppBytes[i], strlen(ppBytes[i]), sText);
+		CHECK(sText == ppText[i]);
+		std::string sBytes;
+		CHECK(Base64Decode(ppText[i], _tcslen(ppText[i]), sBytes));
+		CHECK(sBytes == ppBytes[i]);
+	}
+
+	// every byte value, NULs included, at every length of the last group
+	std::string sAll;
+	for(int i = 0; i < 256 + 3; ++i)
+		sAll += (char) (i * 7);
+	for(size_t nLength = 0; nLength <= sAll.size(); ++nLength) {
+		TString sText;
+		Base64Encode(sAll.data(), nLength, sText);
+		CHECK(sText.size() == (nLength + 2) / 3 * 4);
+		std::string sBytes;
+		CHECK(Base64Decode(sText.c_str(), sText.size(), sBytes));
+		CHECK(sBytes == sAll.substr(0, nLength));
+	}
+
+	// appends, skips white space and refuses what isn't base64
+	TString sText = _T("x");
+	Base64Encode("foo", 3, sText);
+	CHECK(sText == _T("xZm9v"));
+	std::string sBytes = "x";
+	CHECK(Base64Decode(_T(" Zm9v\r\nYmFy\t"), 12, sBytes));
+	CHECK(sBytes == "xfoobar");
+	CHECK(!Base64Decode(_T("Zm9v!"), 5, sBytes));
+	CHECK(!Base64Decode(_T("Zg==Zg=="), 8, sBytes));
+	CHECK(!Base64Decode(_T("Zg==="), 5, sBytes));
+}
+
+void TestCommandLine( void )
+{
+	struct { const TCHAR * pcszArgument; const TCHAR * pcszQuoted; } args[] = {
+		{ _T("plain"), _T("plain") },
+		{ _T(""), _T("\"\"") },
+		{ _T("two words"), _T("\"two words\"") },
+		{ _T("say \"hi\""), _T("\"say \\\"hi\\\"\"") },
+		{ _T("c:\\dir\\"), _T("c:\\dir\\") },
+		{ _T("c:\\my dir\\"), _T("\"c:\\my dir\\\\\"") },
+		{ _T("a\\\\\"b"), _T("\"a\\\\\\\\\\\"b\"") },
+	};
+	for(size_t i = 0; i < sizeof(args) / sizeof(args[0]); ++i) {
+		TString sCommandLine;
+		AppendArgument(args[i].pcszArgument, sCommandLine);
+		CHECK(sCommandLine == args[i].pcszQuoted);
+	}
+
+	TString sCommandLine;
+	AppendProgramName(_T("c:\\program files\\app.exe"), sCommandLine);
+	AppendArgument(_T("x"), sCommandLine);
+	CHECK(sCommandLine == _T("\"c:\\program files\\app.exe\" x"));
+}
@@ -0,0 +1,158 @@
+/**	\file HandleTableTests.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	HandleTableTests.cpp													*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#include "StdAfx.h"
+#include "RunShellTests.h"
+#include "..\RunShell\HandleTable.h"
+#include "..\RunShell\ShellPipe.h"
+
+// the limits HandleTable.cpp packs into a handle
+#define MAX_SLOTS 4096
+#define MAX_GENERATION 4095
+#define MIN_FREE_SLOTS 256
+
+#define BENCH_HANDLES 1000000
+
+void TestHandleTable( void )
+{
+	CHandleTable table;
+	DWORD dwError = 0;
+
+	// handles are positive, distinct and find their slot
+	int nFirst = table.Add();
+	int nSecond = table.Add();
+	CHECK(nFirst > 0 && nSecond > 0 && nFirst != nSecond);
+	CHECK(table.Find(nFirst, dwError) == CHandleTable::IndexOf(nFirst));
+	CHECK(table.Find(nSecond, dwError) == CHandleTable::IndexOf(nSecond));
+	CHECK(table.Find(0, dwError) < 0 && dwError == ERROR_INVALID_HANDLE);
+	CHECK(table.Find(-1, dwError) < 0);
+
+	// a freed handle is stale, and its slot is not reused right away
+	table.Free(table.Find(nFirst, dwError));
+	CHECK(table.Find(nFirst, dwError) < 0 && dwError == ERROR_INVALID_HANDLE);
+	int nThird = table.Add();
+	CHECK(CHandleTable::IndexOf(nThird) != CHandleTable::IndexOf(nFirst));
+
+	// another table's handle is told apart
+	CHandleTable other;
+	CHECK(other.GetTag() != table.GetTag());
+	int nOther = other.Add();
+	CHECK(table.Find(nOther, dwError) < 0 && dwError == ERROR_ACCESS_DENIED);
+
+	// fill the table, then Add fails
+	std::vector<int> handles;
+	handles.push_back(nSecond);
+	handles.push_back(nThird);
+	for(;;) {
+		int nHandle = table.Add();
+		if(!nHandle)
+			break;
+		handles.push_back(nHandle);
+	}
+	CHECK(handles.size() == MAX_SLOTS);
+	CHECK(table.GetFreeCount() == 0);
+	// once every slot was used, a free one is reused however few are free
+	int nLast = handles.back();
+	CHECK(CHandleTable::IndexOf(nLast) == CHandleTable::IndexOf(nFirst));
+	CHECK(nLast != nFirst);
+
+	// slots freed first are reused first, once MIN_FREE_SLOTS are free
+	CHandleTable fifo;
+	std::vector<int> fifoHandles;
+	for(int i = 0; i < MIN_FREE_SLOTS; ++i)
+		fifoHandles.push_back(fifo.Add());
+	for(int i = 0; i < MIN_FREE_SLOTS; ++i)
+		fifo.Free(fifo.Find(fifoHandles[i], dwError));
+	int nReused = fifo.Add();
+	CHECK(CHandleTable::IndexOf(nReused) == CHandleTable::IndexOf(fifoHandles[0]));
+	CHECK(nReused != fifoHandles[0]);
+
+	// one slot reused over and over goes through every generation before
+	// a handle repeats, and never hands out 0
+	int nSlot = CHandleTable::IndexOf(nLast);
+	int nHandle = nLast;
+	bool bRepeated = false;
+	for(int i = 1; i <= MAX_GENERATION; ++i) {
+		table.Free(table.Find(nHandle, dwError));
+		CHECK(table.Find(nHandle, dwError) < 0);
+		nHandle = table.Add();
+		CHECK(nHandle > 0);
+		CHECK(CHandleTable::IndexOf(nHandle) == nSlot);
+		if(nHandle == nLast) {
+			bRepeated = true;
+			CHECK(i == MAX_GENERATION);
+		}
+	}
+	CHECK(bRepeated);
+	CHECK(table.Find(nLast, dwError) == nSlot);
+
+	// Clear makes every handle stale
+	table.Clear();
+	for(size_t i = 0; i < handles.size(); ++i)
+		CHECK(table.Find(handles[i], dwError) < 0);
+	CHECK(table.GetFreeCount() == MAX_SLOTS);
+
+	// tags come back only after every other tag was handed out
+	CHandleTable first;
+	int nTag = first.GetTag();
+	int nTables = 1;
+	for(;;) {
+		CHandleTable next;
+		if(next.GetTag() == nTag)
+			break;
+		CHECK(next.GetTag() > 0);
+		++nTables;
+	}
+	CHECK(nTables == 127);
+}
+
+// What opening, using and closing a shell costs in the handle table,
+// against allocating and freeing the CShellPipe itself. A few shells
+// stay open throughout, like in a drawing.
+void BenchHandleTable( void )
+{
+	CHandleTable table;
+	for(int i = 0; i < 16; ++i)
+		table.Add();
+
+	double dStart = GetMilliseconds();
+	DWORD dwError = 0;
+	int nFound = 0;
+	for(int i = 0; i < BENCH_HANDLES; ++i) {
+		int nHandle = table.Add();
+		int nIndex = table.Find(nHandle, dwError);
+		nFound += nIndex >= 0;
+		table.Free(nIndex);
+	}
+	double dTable = GetMilliseconds() - dStart;
+	CHECK(nFound == BENCH_HANDLES);
+
+	dStart = GetMilliseconds();
+	for(int i = 0; i < BENCH_HANDLES; ++i)
+		delete new CShellPipe;
+	double dShells = GetMilliseconds() - dStart;
+
+	printf("%d handles: Add, Find and Free %.1f ns each, new and delete CShellPipe %.1f ns each\n",
+		BENCH_HANDLES, dTable * 1000000 / BENCH_HANDLES, dShells * 1000000 / BENCH_HANDLES);
+}
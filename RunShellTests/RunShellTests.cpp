@@ -0,0 +1,158 @@
+/**	\file RunShellTests.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	RunShellTests.cpp														*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#include "StdAfx.h"
+#include "RunShellTests.h"
+#include "..\RunShell\CommandLine.h"
+
+// Unit tests and benchmarks of the parts of RunShell that don't need
+// AutoCAD. Without arguments the tests run and the exit code is the
+// number of failed checks. "/bench" runs the benchmarks too, "/exit"
+// returns right away and is what the spawn benchmark starts.
+//
+// The shell tests start this executable again as their child. "/sleep"
+// followed by milliseconds waits, "/write" followed by a byte count
+// writes that much of GetChildByte to stdout, and "/read" reads stdin to
+// the end and writes how many bytes it got. The child does them in the
+// order given and exits with 0.
+
+static int g_nFailures = 0;
+static TString g_sSelf;
+
+int acedUsrBrk( void )
+{
+	return 0;
+}
+
+void ReportFailure( const char * pcszFile, int nLine, const char * pcszExpression )
+{
+	++g_nFailures;
+	printf("%s(%d): check failed: %s\n", pcszFile, nLine, pcszExpression);
+}
+
+double GetMilliseconds( void )
+{
+	static LARGE_INTEGER frequency;
+	if(!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart * 1000.0 / frequency.QuadPart;
+}
+
+char GetChildByte( DWORD nOffset )
+{
+	return nOffset % 64 == 63 ? '\n' : (char) ('a' + nOffset % 26);
+}
+
+void GetChildCommandLine( const TCHAR * pcszArguments, TString & sApplicationName, TString & sCommandLine )
+{
+	sApplicationName = g_sSelf;
+	sCommandLine.erase();
+	AppendProgramName(g_sSelf.c_str(), sCommandLine);
+	sCommandLine += _T(" ");
+	sCommandLine += pcszArguments;
+}
+
+// Writes nBytes of GetChildByte to stdout, unbuffered and untranslated
+static int WriteChildBytes( DWORD nBytes )
+{
+	HANDLE hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
+	char buffer[4096];
+	for(DWORD nOffset = 0; nOffset < nBytes; ) {
+		DWORD nChunk = nBytes - nOffset < sizeof(buffer) ? nBytes - nOffset : sizeof(buffer);
+		for(DWORD i = 0; i < nChunk; ++i)
+			buffer[i] = GetChildByte(nOffset + i);
+		DWORD dwWritten;
+		if(!WriteFile(hStdout, buffer, nChunk, &dwWritten, NULL))
+			return 1;
+		nOffset += dwWritten;
+	}
+	return 0;
+}
+
+// Reads stdin until it is closed, then writes the byte count to stdout
+static int ReadChildBytes( void )
+{
+	HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+	char buffer[4096];
+	ULONGLONG nBytes = 0;
+	DWORD dwRead;
+	while(ReadFile(hStdin, buffer, sizeof(buffer), &dwRead, NULL) && dwRead)
+		nBytes += dwRead;
+	int nLength = sprintf(buffer, "%I64u", nBytes);
+	DWORD dwWritten;
+	return WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), buffer, nLength, &dwWritten, NULL) ? 0 : 1;
+}
+
+int _tmain(int argc, TCHAR * argv[])
+{
+	bool bBench = false, bChild = false;
+	for(int i = 1; i < argc; ++i) {
+		if(!_tcsicmp(argv[i], _T("/exit")))
+			return 0;
+		if(!_tcsicmp(argv[i], _T("/bench")))
+			bBench = true;
+		else if(!_tcsicmp(argv[i], _T("/sleep")) && i + 1 < argc) {
+			bChild = true;
+			Sleep(_tcstoul(argv[++i], NULL, 10));
+		} else if(!_tcsicmp(argv[i], _T("/write")) && i + 1 < argc) {
+			bChild = true;
+			if(WriteChildBytes(_tcstoul(argv[++i], NULL, 10)))
+				return 1;
+		} else if(!_tcsicmp(argv[i], _T("/read"))) {
+			bChild = true;
+			if(ReadChildBytes())
+				return 1;
+		}
+	}
+	if(bChild)
+		return 0;
+
+	if(FindProgram(argv[0], g_sSelf) != RTNORM) {
+		printf("can't find this executable, error %lu\n", GetLastError());
+		return 1;
+	}
+
+	TestTextDecoder();
+	TestLineScanner();
+	TestBase64();
+	TestCommandLine();
+	TestHandleTable();
+	TestShellBuffer();
+	TestShellPipe();
+	TestShellBatch();
+	TestShellJobs();
+	printf("%d check(s) failed\n", g_nFailures);
+
+	if(bBench) {
+		BenchTextDecoder();
+		BenchSpawn(argv[0]);
+		BenchReadShellAll();
+		BenchReadAhead();
+		BenchWriteLines();
+		BenchHandleTable();
+	}
+	return g_nFailures;
+}
@@ -0,0 +1,67 @@
+/**	\file RunShellTests.h
+*	\brief
+*/
+
+/****************************************************************************/
+/*	RunShellTests.h															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#pragma once
+
+/**	\brief Counts a failed check and prints where it is
+*	\param[in] pcszFile the source file of the check
+*	\param[in] nLine the line of the check
+*	\param[in] pcszExpression the expression that was false
+*/
+void ReportFailure(const char * pcszFile, int nLine, const char * pcszExpression);
+
+/**	\brief Checks an expression, a false one is reported and the test goes on */
+#define CHECK(expression) ((expression) ? (void) 0 : ReportFailure(__FILE__, __LINE__, #expression))
+
+/**	\brief Gets a time in milliseconds from the performance counter, for benchmarks */
+double GetMilliseconds(void);
+
+/**	\brief The byte at nOffset of what a "/write" child writes, lower case
+*	letters with a line feed every 64 bytes
+*/
+char GetChildByte(DWORD nOffset);
+
+/**	\brief Makes the command line that starts this executable as a child
+*	\param[in] pcszArguments the child mode and its arguments, like "/write 1000"
+*	\param[out] sApplicationName receives the full path of this executable
+*	\param[out] sCommandLine receives the command line
+*/
+void GetChildCommandLine(const TCHAR * pcszArguments, TString & sApplicationName, TString & sCommandLine);
+
+void TestTextDecoder(void);		/**< TextDecoderTests.cpp */
+void TestLineScanner(void);		/**< TextDecoderTests.cpp */
+void TestBase64(void);			/**< Base64Tests.cpp */
+void TestCommandLine(void);		/**< Base64Tests.cpp */
+void TestHandleTable(void);		/**< HandleTableTests.cpp */
+void TestShellBuffer(void);		/**< ShellPipeTests.cpp */
+void TestShellPipe(void);		/**< ShellPipeTests.cpp */
+void TestShellBatch(void);		/**< ShellBatchTests.cpp */
+void TestShellJobs(void);		/**< ShellBatchTests.cpp */
+
+void BenchTextDecoder(void);	/**< TextDecoderTests.cpp */
+void BenchSpawn(const TCHAR * pcszSelf);	/**< SpawnBench.cpp */
+void BenchReadShellAll(void);	/**< ShellPipeTests.cpp */
+void BenchReadAhead(void);		/**< ShellPipeTests.cpp */
+void BenchWriteLines(void);		/**< ShellPipeTests.cpp */
+void BenchHandleTable(void);	/**< HandleTableTests.cpp */
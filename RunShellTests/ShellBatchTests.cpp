@@ -0,0 +1,141 @@
+/**	\file ShellBatchTests.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellBatchTests.cpp														*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#include "StdAfx.h"
+#include "RunShellTests.h"
+#include "..\RunShell\ShellBatch.h"
+#include "..\RunShell\ShellJobs.h"
+
+#define BATCH_COMMANDS 16
+#define LONG_SLEEP 2000
+#define JOB_TIMEOUT 30000
+
+// Every fourth command sleeps before it writes. The others write at once,
+// and must finish long before the sleepers, which they would not if a
+// sleeper had been started holding a copy of their stdout.
+static void MakeCommands( std::vector<CShellCommand> & commands, std::vector<DWORD> & sizes )
+{
+	commands.resize(BATCH_COMMANDS);
+	sizes.resize(BATCH_COMMANDS);
+	for(int i = 0; i < BATCH_COMMANDS; ++i) {
+		sizes[i] = 1000 + i * 4093;
+		TCHAR szArguments[64];
+		if(i % 4 == 0)
+			_stprintf(szArguments, _T("/sleep %d /write %lu"), LONG_SLEEP, sizes[i]);
+		else
+			_stprintf(szArguments, _T("/write %lu"), sizes[i]);
+		GetChildCommandLine(szArguments, commands[i].sApplicationName, commands[i].sCommandLine);
+	}
+}
+
+// Checks a command's output is nBytes of what a "/write" child writes
+static void CheckCommandOutput( const CShellCommand & command, DWORD nBytes )
+{
+	DWORD nOffset = 0, nWrong = 0;
+	for(size_t i = 0; i < command.output.size(); ++i) {
+		const TString & sPiece = command.output[i];
+		for(TString::size_type j = 0; j < sPiece.size(); ++j) {
+			if(sPiece[j] != (TCHAR) GetChildByte(nOffset + (DWORD) j))
+				++nWrong;
+		}
+		nOffset += (DWORD) sPiece.size();
+	}
+	CHECK(nOffset == nBytes);
+	CHECK(nWrong == 0);
+}
+
+void TestShellBatch( void )
+{
+	std::vector<CShellCommand> commands;
+	std::vector<DWORD> sizes;
+	MakeCommands(commands, sizes);
+
+	CShellBatch batch(commands, 8);
+	CHECK(batch.Run() == RTNORM);
+	for(int i = 0; i < BATCH_COMMANDS; ++i) {
+		const CShellCommand & command = commands[i];
+		CHECK(command.nResult == RTNORM && !command.bCancelled && command.dwExitCode == 0);
+		CheckCommandOutput(command, sizes[i]);
+		// each read ended when its own child exited
+		if(i % 4 == 0)
+			CHECK(command.dwElapsed >= LONG_SLEEP - 100);
+		else
+			CHECK(command.dwElapsed < LONG_SLEEP / 2);
+	}
+}
+
+// Waits for a job to leave the queued and running states
+static CShellJobQueue::JobState WaitForJob( const CShellJobQueue & queue, int nJob )
+{
+	CShellJobQueue::JobState state = CShellJobQueue::kQueued;
+	DWORD dwStart = GetTickCount();
+	while(queue.Poll(nJob, state) == RTNORM && GetTickCount() - dwStart < JOB_TIMEOUT
+		&& (state == CShellJobQueue::kQueued || state == CShellJobQueue::kRunning))
+		Sleep(10);
+	return state;
+}
+
+void TestShellJobs( void )
+{
+	// the same commands as the batch, on one worker per processor
+	std::vector<CShellCommand> commands;
+	std::vector<DWORD> sizes;
+	MakeCommands(commands, sizes);
+
+	CShellJobQueue queue;
+	std::vector<int> jobs;
+	for(int i = 0; i < BATCH_COMMANDS; ++i)
+		jobs.push_back(queue.Submit(commands[i].sApplicationName.c_str(), commands[i].sCommandLine.c_str(), 0));
+	for(int i = 0; i < BATCH_COMMANDS; ++i) {
+		CHECK(jobs[i] > 0);
+		CHECK(WaitForJob(queue, jobs[i]) == CShellJobQueue::kDone);
+		CShellCommand command;
+		CHECK(queue.GetResult(jobs[i], command) == RTNORM);
+		CHECK(command.nResult == RTNORM && command.dwExitCode == 0);
+		CheckCommandOutput(command, sizes[i]);
+		if(i % 4 == 0)
+			CHECK(command.dwElapsed >= LONG_SLEEP - 100);
+		else
+			CHECK(command.dwElapsed < LONG_SLEEP / 2);
+	}
+	CHECK(queue.GetCompleted() == BATCH_COMMANDS);
+	CHECK(queue.GetQueued() == 0 && queue.GetRunning() == 0);
+
+	// a job cancelled while it runs is killed, and isn't counted as completed
+	TString sApplicationName, sCommandLine;
+	GetChildCommandLine(_T("/sleep 60000"), sApplicationName, sCommandLine);
+	int nJob = queue.Submit(sApplicationName.c_str(), sCommandLine.c_str(), 0);
+	CShellJobQueue::JobState state = CShellJobQueue::kQueued;
+	DWORD dwStart = GetTickCount();
+	while(queue.Poll(nJob, state) == RTNORM && state == CShellJobQueue::kQueued && GetTickCount() - dwStart < JOB_TIMEOUT)
+		Sleep(10);
+	CHECK(state == CShellJobQueue::kRunning);
+	CHECK(queue.Cancel(nJob) == RTNORM);
+	CShellCommand command;
+	dwStart = GetTickCount();
+	while(queue.GetResult(nJob, command) != RTNORM && GetTickCount() - dwStart < JOB_TIMEOUT)
+		Sleep(10);
+	CHECK(GetTickCount() - dwStart < JOB_TIMEOUT);
+	CHECK(queue.GetCompleted() == BATCH_COMMANDS);
+}
@@ -0,0 +1,271 @@
+/**	\file ShellPipeTests.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	ShellPipeTests.cpp														*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#include "StdAfx.h"
+#include "RunShellTests.h"
+#include "..\RunShell\ShellPipe.h"
+#include "..\RunShell\ShellBuffer.h"
+
+#define CHILD_BYTES (1024 * 1024 + 17)
+#define LIMITED_BYTES (4 * 1024 * 1024)
+#define BUFFER_LIMIT (256 * 1024)
+#define BENCH_BYTES (32 * 1024 * 1024)
+#define BENCH_LINES 100000
+
+// Starts this executable as the child of shell in one of its child modes
+static int OpenChild( CShellPipe & shell, const TCHAR * pcszArguments, const CShellOptions & options )
+{
+	TString sApplicationName, sCommandLine;
+	GetChildCommandLine(pcszArguments, sApplicationName, sCommandLine);
+	return shell.OpenShell(sApplicationName.c_str(), sCommandLine.c_str(), options);
+}
+
+// Reads stdout with ReadShellData until it ends, and checks it was
+// nBytes of what a "/write" child writes.
+static void CheckChildOutput( CShellPipe & shell, DWORD nBytes )
+{
+	DWORD nOffset = 0, nWrong = 0;
+	TString sResults;
+	while(shell.ReadShellData(sResults) == RTNORM) {
+		for(TString::size_type i = 0; i < sResults.size(); ++i) {
+			if(sResults[i] != (TCHAR) GetChildByte(nOffset + (DWORD) i))
+				++nWrong;
+		}
+		nOffset += (DWORD) sResults.size();
+	}
+	DWORD dwError = CShellPipe::GetLastShellError();
+	CHECK(dwError == ERROR_BROKEN_PIPE || dwError == ERROR_HANDLE_EOF);
+	CHECK(nOffset == nBytes);
+	CHECK(nWrong == 0);
+}
+
+void TestShellBuffer( void )
+{
+	CShellBuffer buffer;
+	char data[16];
+	DWORD nRead = 0;
+
+	// nothing there yet
+	CHECK(buffer.Read(data, sizeof(data), nRead, 0) == RTNONE && nRead == 0);
+
+	// bytes come out in order, in as many reads as it takes
+	buffer.Append("abcdef", 6);
+	CHECK(buffer.GetSize() == 6);
+	CHECK(buffer.Read(data, 4, nRead, 0) == RTNORM && nRead == 4 && !memcmp(data, "abcd", 4));
+	buffer.Append("gh", 2);
+	CHECK(buffer.Read(data, sizeof(data), nRead, 0) == RTNORM && nRead == 4 && !memcmp(data, "efgh", 4));
+
+	// after the end of stream what is left is read, then Read fails
+	buffer.Append("ij", 2);
+	buffer.SetEof(ERROR_BROKEN_PIPE);
+	CHECK(!buffer.IsEof());
+	CHECK(buffer.Read(data, sizeof(data), nRead, 0) == RTNORM && nRead == 2);
+	CHECK(buffer.IsEof() && buffer.GetError() == ERROR_BROKEN_PIPE);
+	CHECK(buffer.Read(data, sizeof(data), nRead, INFINITE) == RTERROR && nRead == 0);
+
+	// Reset starts over
+	buffer.Reset();
+	CHECK(!buffer.IsEof() && buffer.GetSize() == 0);
+	CHECK(buffer.Read(data, sizeof(data), nRead, 0) == RTNONE);
+}
+
+void TestShellPipe( void )
+{
+	// the child's output arrives whole and in order, read straight from
+	// the pipe and through the pump thread
+	for(int nPumped = 0; nPumped < 2; ++nPumped) {
+		CShellOptions options;
+		options.bPumped = nPumped != 0;
+		options.bCheckUserBreak = false;
+		TCHAR szArguments[32];
+		_stprintf(szArguments, _T("/write %lu"), (unsigned long) CHILD_BYTES);
+
+		CShellPipe shell;
+		CHECK(OpenChild(shell, szArguments, options) == RTNORM);
+		CheckChildOutput(shell, CHILD_BYTES);
+		CHECK(shell.CloseShell() == RTNORM);
+		DWORD dwExitCode = STILL_ACTIVE;
+		CHECK(shell.GetShellExitCode(dwExitCode) == RTNORM && dwExitCode == 0);
+	}
+
+	// A child writing more than the buffer limit is held at the full
+	// pipe. The pump goes over the limit by at most the one read that
+	// reached it, and everything arrives once the reader drains it.
+	{
+		CShellOptions options;
+		options.bPumped = true;
+		options.bCheckUserBreak = false;
+		options.nBufferLimit = BUFFER_LIMIT;
+		TCHAR szArguments[32];
+		_stprintf(szArguments, _T("/write %lu"), (unsigned long) LIMITED_BYTES);
+
+		CShellPipe shell;
+		CHECK(OpenChild(shell, szArguments, options) == RTNORM);
+		DWORD nBytes = 0;
+		for(int nTries = 0; nTries < 100 && nBytes < BUFFER_LIMIT; ++nTries) {
+			Sleep(50);
+			CHECK(shell.ShellDataAvailable(nBytes) == RTNORM);
+		}
+		CHECK(nBytes >= BUFFER_LIMIT);
+		// give the pump time to go further if it was going to
+		Sleep(250);
+		CHECK(shell.ShellDataAvailable(nBytes) == RTNORM);
+		CHECK(nBytes <= BUFFER_LIMIT + options.nReadAhead);
+		CHECK(shell.WaitShell(0) == RTNONE);
+
+		CheckChildOutput(shell, LIMITED_BYTES);
+		CHECK(shell.CloseShell() == RTNORM);
+		DWORD dwExitCode = STILL_ACTIVE;
+		CHECK(shell.GetShellExitCode(dwExitCode) == RTNORM && dwExitCode == 0);
+	}
+}
+
+// Reads a BENCH_BYTES child through ReadShellData until the end, the way
+// a loop in Autolisp does, or with ReadShellAll in one call. Returns the
+// milliseconds from opening the shell to having all of its output.
+static double TimeRead( int nMode, const CShellOptions & options )
+{
+	TCHAR szArguments[32];
+	_stprintf(szArguments, _T("/write %lu"), (unsigned long) BENCH_BYTES);
+	double dStart = GetMilliseconds();
+	CShellPipe shell;
+	if(OpenChild(shell, szArguments, options) != RTNORM)
+		return -1;
+	size_t nChars = 0;
+	if(nMode == 0) {
+		TString sResults;
+		while(shell.ReadShellData(sResults) == RTNORM)
+			nChars += sResults.size();
+	} else {
+		std::vector<TString> results;
+		if(shell.ReadShellAll(results, nMode == 2) != RTNORM)
+			return -1;
+		for(size_t i = 0; i < results.size(); ++i)
+			nChars += results[i].size();
+	}
+	double dElapsed = GetMilliseconds() - dStart;
+	shell.CloseShell();
+	// "lines" leaves out the line feeds
+	if(nChars != BENCH_BYTES && !(nMode == 2 && nChars == BENCH_BYTES - BENCH_BYTES / 64))
+		return -1;
+	return dElapsed;
+}
+
+void BenchReadShellAll( void )
+{
+	static const char * pcszModes[] = { "ReadShellData loop", "ReadShellAll chunks", "ReadShellAll lines" };
+	CShellOptions options;
+	options.bCheckUserBreak = false;
+	double dMegabytes = BENCH_BYTES / (1024.0 * 1024.0);
+	for(int nMode = 0; nMode < 3; ++nMode) {
+		double dElapsed = TimeRead(nMode, options);
+		if(dElapsed < 0) {
+			printf("read: %s failed, error %lu\n", pcszModes[nMode], CShellPipe::GetLastShellError());
+			continue;
+		}
+		printf("read %.0f MB: %s %.0f ms, %.0f MB/s\n", dMegabytes, pcszModes[nMode],
+			dElapsed, dMegabytes * 1000 / dElapsed);
+	}
+}
+
+// ReadShellData throughput for a range of read-ahead sizes. 503 is one
+// kernel call per ADS string, the way stdout was read before there was
+// a read-ahead buffer.
+void BenchReadAhead( void )
+{
+	const DWORD nSizes[] = { 503, 4096, 65536, 1024 * 1024 };
+	double dMegabytes = BENCH_BYTES / (1024.0 * 1024.0);
+	for(int nPumped = 0; nPumped < 2; ++nPumped) {
+		for(size_t i = 0; i < sizeof(nSizes) / sizeof(nSizes[0]); ++i) {
+			CShellOptions options;
+			options.bCheckUserBreak = false;
+			options.bPumped = nPumped != 0;
+			options.nReadAhead = nSizes[i];
+			double dElapsed = TimeRead(0, options);
+			if(dElapsed < 0) {
+				printf("readahead: read failed, error %lu\n", CShellPipe::GetLastShellError());
+				return;
+			}
+			printf("readahead %lu%s: %.0f MB/s\n", nSizes[i], nPumped ? " pumped" : "",
+				dMegabytes * 1000 / dElapsed);
+		}
+	}
+}
+
+// Writes BENCH_LINES short lines to a "/read" child, in one
+// WriteShellData call with the whole list or in one call per line.
+// Returns the milliseconds from the first write until the child has
+// reported how much it got.
+static double TimeWriteLines( bool bList, const std::vector<TString> & lines, size_t nBytes )
+{
+	CShellOptions options;
+	options.bCheckUserBreak = false;
+	CShellPipe shell;
+	if(OpenChild(shell, _T("/read"), options) != RTNORM)
+		return -1;
+
+	double dStart = GetMilliseconds();
+	if(bList) {
+		std::vector<const TCHAR *> strings;
+		for(size_t i = 0; i < lines.size(); ++i)
+			strings.push_back(lines[i].c_str());
+		DWORD nWritten;
+		if(shell.WriteShellData(strings, nWritten) != RTNORM)
+			return -1;
+	} else {
+		for(size_t i = 0; i < lines.size(); ++i) {
+			if(shell.WriteShellData(lines[i].c_str()) != RTNORM)
+				return -1;
+		}
+	}
+	TString sResults, sCount;
+	if(shell.CloseShellInput() != RTNORM)
+		return -1;
+	while(shell.ReadShellData(sResults) == RTNORM)
+		sCount += sResults;
+	double dElapsed = GetMilliseconds() - dStart;
+	shell.CloseShell();
+	if(_tcstoul(sCount.c_str(), NULL, 10) != nBytes)
+		return -1;
+	return dElapsed;
+}
+
+void BenchWriteLines( void )
+{
+	std::vector<TString> lines;
+	size_t nBytes = 0;
+	for(int i = 0; i < BENCH_LINES; ++i) {
+		TCHAR szLine[32];
+		_stprintf(szLine, _T("line %06d\n"), i);
+		lines.push_back(szLine);
+		nBytes += lines.back().size();
+	}
+	double dList = TimeWriteLines(true, lines, nBytes);
+	double dSingle = TimeWriteLines(false, lines, nBytes);
+	if(dList < 0 || dSingle < 0) {
+		printf("write: writing the lines failed, error %lu\n", CShellPipe::GetLastShellError());
+		return;
+	}
+	printf("write %d lines: one list %.0f ms, one at a time %.0f ms\n", BENCH_LINES, dList, dSingle);
+}
@@ -0,0 +1,88 @@
+/**	\file SpawnBench.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	SpawnBench.cpp															*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#include "StdAfx.h"
+#include "RunShellTests.h"
+#include "..\RunShell\CommandLine.h"
+
+#define SPAWN_RUNS 50
+
+// Starts a command line the way CShellPipe does, suspended and without a
+// window, and waits for it to exit. Returns the milliseconds it took.
+static double Spawn(const TString & sApplication, const TString & sCommandLine)
+{
+	STARTUPINFO si;
+	memset(&si, 0, sizeof(si));
+	si.cb = sizeof(si);
+	PROCESS_INFORMATION pi;
+	TString sBuffer = sCommandLine;
+
+	double dStart = GetMilliseconds();
+	if(!CreateProcess(sApplication.c_str(), &sBuffer[0], NULL, NULL, FALSE,
+		CREATE_NO_WINDOW | CREATE_SUSPENDED, NULL, NULL, &si, &pi))
+		return -1;
+	ResumeThread(pi.hThread);
+	WaitForSingleObject(pi.hProcess, INFINITE);
+	double dElapsed = GetMilliseconds() - dStart;
+	CloseHandle(pi.hThread);
+	CloseHandle(pi.hProcess);
+	return dElapsed;
+}
+
+// Compares starting a program directly, as OpenProcessArgs does, with
+// starting it through "%comspec% /c", as OpenShell is mostly used. The
+// program is this executable with "/exit", so the difference is the
+// cost of cmd.exe.
+void BenchSpawn( const TCHAR * pcszSelf )
+{
+	TString sSelf, sComspec;
+	if(FindProgram(pcszSelf, sSelf) != RTNORM || FindProgram(_T("%comspec%"), sComspec) != RTNORM) {
+		printf("spawn: can't find the programs, error %lu\n", GetLastError());
+		return;
+	}
+
+	TString sDirect;
+	AppendProgramName(sSelf.c_str(), sDirect);
+	AppendArgument(_T("/exit"), sDirect);
+
+	TString sThroughCmd;
+	AppendProgramName(sComspec.c_str(), sThroughCmd);
+	sThroughCmd += _T(" /s /c \"");
+	sThroughCmd += sDirect;
+	sThroughCmd += _T("\"");
+
+	double dDirect = 0, dThroughCmd = 0;
+	for(int i = 0; i < SPAWN_RUNS; ++i) {
+		double dRun = Spawn(sSelf, sDirect);
+		double dCmdRun = Spawn(sComspec, sThroughCmd);
+		if(dRun < 0 || dCmdRun < 0) {
+			printf("spawn: CreateProcess failed, error %lu\n", GetLastError());
+			return;
+		}
+		dDirect += dRun;
+		dThroughCmd += dCmdRun;
+	}
+	printf("spawn and exit, average of %d: direct %.2f ms, through cmd.exe %.2f ms\n",
+		SPAWN_RUNS, dDirect / SPAWN_RUNS, dThroughCmd / SPAWN_RUNS);
+}
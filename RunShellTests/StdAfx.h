@@ -0,0 +1,38 @@
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
+// The tests build the RunShell sources that don't need AutoCAD, so in
+// place of arxHeaders.h this only defines the ADS result codes they
+// return, and declares the one ADS function the shell sources call.
+
+#pragma once
+
+#pragma warning(disable: 4786 4996)
+
+#define VC_EXTRALEAN
+#define STRICT
+
+//-----------------------------------------------------------------------------
+#include <windows.h>
+#include <tchar.h>
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
+
+
+#ifdef _UNICODE
+    typedef std::wstring TString;
+#else
+    typedef std::string TString;
+#endif
+
+// from adscodes.h
+#define RTNONE 5000
+#define RTNORM 5100
+#define RTERROR (-5001)
+#define RTCAN (-5002)
+
+// from acedads.h, RunShellTests.cpp has a stand-in that never sees ESC
+int acedUsrBrk(void);
@@ -0,0 +1,220 @@
+/**	\file TextDecoderTests.cpp
+*	\brief
+*/
+
+/****************************************************************************/
+/*	TextDecoderTests.cpp													*/
+/****************************************************************************/
+/*                                                                          */
+/*  Copyright 2010 Paul Kohut                                               */
+/*  Licensed under the Apache License, Version 2.0 (the "License"); you may */
+/*  not use this file except in compliance with the License. You may obtain */
+/*  a copy of the License at                                                */
+/*                                                                          */
+/*  http://www.apache.org/licenses/LICENSE-2.0                              */
+/*                                                                          */
+/*  Unless required by applicable law or agreed to in writing, software     */
+/*  distributed under the License is distributed on an "AS IS" BASIS,       */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or         */
+/*  implied. See the License for the specific language governing            */
+/*  permissions and limitations under the License.                          */
+/*                                                                          */
+/****************************************************************************/
+
+
+#include "StdAfx.h"
+#include "RunShellTests.h"
+#include "..\RunShell\TextDecoder.h"
+#include "..\RunShell\LineScanner.h"
+
+// ASCII runs longer and shorter than the 16 byte blocks of the fast path,
+// with 2, 3 and 4 byte UTF-8 characters in between.
+static const char g_szUtf8[] =
+	"plain ascii text, longer than a block "
+	"\xC3\xA9t\xC3\xA9 \xE2\x82\xAC\xE2\x82\xAC x\xF0\x9F\x98\x80y \xC3\xA9"
+	"and the end of the line\r\n";
+
+// Decodes bytes in pieces of nPiece bytes, as they come from a pipe
+static TString DecodePieces(CTextDecoder & decoder, const std::string & sBytes, size_t nPiece)
+{
+	TString sText, sPiece;
+	for(size_t i = 0; i < sBytes.size(); i += nPiece) {
+		size_t nBytes = sBytes.size() - i < nPiece ? sBytes.size() - i : nPiece;
+		decoder.Decode(sBytes.data() + i, nBytes, sPiece);
+		sText += sPiece;
+	}
+	decoder.Decode(NULL, 0, sPiece, true);
+	sText += sPiece;
+	return sText;
+}
+
+void TestTextDecoder( void )
+{
+	std::string sUtf8;
+	for(int i = 0; i < 4; ++i)
+		sUtf8 += g_szUtf8;
+
+	// the whole stream at once is what every split has to give
+	CTextDecoder whole;
+	TString sWhole;
+	whole.Decode(sUtf8.data(), sUtf8.size(), sWhole, true);
+	CHECK(!whole.GetPending());
+#ifdef _UNICODE
+	CHECK(sWhole.find(L"\x00e9t\x00e9 \x20ac\x20ac x\xd83d\xde00y") != TString::npos);
+	CHECK(sWhole.find(L'\xfffd') == TString::npos);
+
+	// and encodes back to the same bytes
+	CTextEncoder encoder;
+	std::string sEncoded;
+	encoder.Encode(sWhole.c_str(), sWhole.size(), sEncoded);
+	CHECK(sEncoded == sUtf8);
+#endif
+
+	// characters split across calls at every possible point
+	for(size_t nPiece = 1; nPiece <= 40; ++nPiece) {
+		CTextDecoder decoder;
+		CHECK(DecodePieces(decoder, sUtf8, nPiece) == sWhole);
+	}
+
+	// the incomplete character is kept, not converted
+	CTextDecoder split;
+	TString sText;
+	split.Decode("ab\xE2\x82", 4, sText);
+	CHECK(split.GetPending() == 2);
+	CHECK(sText == _T("ab"));
+	split.Decode("\xAC", 1, sText);
+	CHECK(!split.GetPending());
+#ifdef _UNICODE
+	CHECK(sText == L"\x20ac");
+#endif
+
+	// at the end of the stream it is converted as it is
+	split.Decode("c\xE2\x82", 3, sText, true);
+	CHECK(!split.GetPending());
+	CHECK(sText.size() >= 2 && sText[0] == _T('c'));
+
+	// UTF-16 split at odd bytes and in the middle of a surrogate pair
+	const wchar_t szWide[] = L"ab\x00e9\x20ac\xd83d\xde00 plain ascii after it";
+	std::string sUtf16((const char *) szWide, sizeof(szWide) - sizeof(wchar_t));
+	CTextDecoder wholeUtf16(kEncodingUtf16);
+	wholeUtf16.Decode(sUtf16.data(), sUtf16.size(), sWhole, true);
+#ifdef _UNICODE
+	CHECK(sWhole == szWide);
+#endif
+	for(size_t nPiece = 1; nPiece <= 7; ++nPiece) {
+		CTextDecoder decoder(kEncodingUtf16);
+		CHECK(DecodePieces(decoder, sUtf16, nPiece) == sWhole);
+	}
+
+	// the OEM code page is what MultiByteToWideChar makes of it
+#ifdef _UNICODE
+	const char szOem[] = "dir \x81\x82\x8A\xE1 ok";
+	wchar_t szExpected[32];
+	int nExpected = MultiByteToWideChar(CP_OEMCP, 0, szOem, sizeof(szOem) - 1, szExpected, 32);
+	CTextDecoder oem(kEncodingOem);
+	oem.Decode(szOem, sizeof(szOem) - 1, sText, true);
+	CHECK(sText == TString(szExpected, nExpected));
+#endif
+
+	// the encoder gives back the bytes the decoder read
+	CTextEncoder encoderUtf16(kEncodingUtf16);
+	std::string sBytes;
+	encoderUtf16.Encode(sWhole.c_str(), sWhole.size(), sBytes);
+#ifdef _UNICODE
+	CHECK(sBytes == sUtf16);
+#endif
+	CTextDecoder again(kEncodingUtf16);
+	TString sBack;
+	again.Decode(sBytes.data(), sBytes.size(), sBack, true);
+	CHECK(sBack == sWhole);
+}
+
+void TestLineScanner( void )
+{
+	// a line feed at every offset, from every alignment of the start,
+	// so it is found in the SSE2 blocks, at their edges and in the tail
+	char buffer[80];
+	for(size_t nStart = 0; nStart < 16; ++nStart) {
+		for(size_t nLength = 0; nLength <= 64; ++nLength) {
+			const char * pBegin = buffer + nStart;
+			const char * pEnd = pBegin + nLength;
+			memset(buffer, 'x', sizeof(buffer));
+			// a byte with the high bit set and 0x0A below it is not a line feed
+			if(nLength > 1)
+				buffer[nStart + nLength / 2] = (char) 0x8A;
+			CHECK(FindNewline(pBegin, pEnd) == pEnd);
+			for(size_t nNewline = 0; nNewline < nLength; ++nNewline) {
+				buffer[nStart + nNewline] = '\n';
+				CHECK(FindNewline(pBegin, pEnd) == pBegin + nNewline);
+				buffer[nStart + nNewline] = 'x';
+			}
+			// one past the end is not looked at
+			buffer[nStart + nLength] = '\n';
+			CHECK(FindNewline(pBegin, pEnd) == pEnd);
+		}
+	}
+
+	const char szLine[] = "line\r\n";
+	CHECK(LineLength(szLine, szLine + 5) == 4);
+	CHECK(LineLength(szLine, szLine + 4) == 4);
+	CHECK(LineLength(szLine, szLine) == 0);
+}
+
+void BenchTextDecoder( void )
+{
+	// mostly ASCII output, like a directory listing, with some UTF-8
+	std::string sData;
+	while(sData.size() < 32 * 1024 * 1024)
+		sData += g_szUtf8;
+	const size_t nPieces[] = { 503, 65536 };
+
+	for(size_t i = 0; i < sizeof(nPieces) / sizeof(nPieces[0]); ++i) {
+		size_t nPiece = nPieces[i];
+
+		// the old way, two MultiByteToWideChar calls per piece
+		double dStart = GetMilliseconds();
+		std::wstring sWide;
+		for(size_t nOffset = 0; nOffset < sData.size(); nOffset += nPiece) {
+			int nBytes = (int) (sData.size() - nOffset < nPiece ? sData.size() - nOffset : nPiece);
+			int nLength = MultiByteToWideChar(CP_UTF8, 0, sData.data() + nOffset, nBytes, NULL, 0);
+			sWide.resize(nLength);
+			MultiByteToWideChar(CP_UTF8, 0, sData.data() + nOffset, nBytes, &sWide[0], nLength);
+		}
+		double dApi = GetMilliseconds() - dStart;
+
+		dStart = GetMilliseconds();
+		CTextDecoder decoder;
+		TString sText;
+		for(size_t nOffset = 0; nOffset < sData.size(); nOffset += nPiece) {
+			size_t nBytes = sData.size() - nOffset < nPiece ? sData.size() - nOffset : nPiece;
+			decoder.Decode(sData.data() + nOffset, nBytes, sText);
+		}
+		double dDecoder = GetMilliseconds() - dStart;
+
+		double dMegabytes = sData.size() / (1024.0 * 1024.0);
+		printf("decode %u byte pieces: MultiByteToWideChar %.0f MB/s, CTextDecoder %.0f MB/s\n",
+			(unsigned) nPiece, dMegabytes * 1000 / dApi, dMegabytes * 1000 / dDecoder);
+	}
+
+	// line feeds in 16K of text per line, like a long ReadShellLines line
+	// read through a volatile, so the search isn't moved out of the loop
+	std::string sLine(16 * 1024, 'x');
+	sLine += '\n';
+	const char * volatile pLine = sLine.data();
+	double dStart = GetMilliseconds();
+	size_t nFound = 0;
+	for(int i = 0; i < 20000; ++i) {
+		const char * p = pLine;
+		nFound += FindNewline(p, p + sLine.size()) - p;
+	}
+	double dScanner = GetMilliseconds() - dStart;
+	dStart = GetMilliseconds();
+	for(int i = 0; i < 20000; ++i) {
+		const char * p = pLine;
+		nFound += (const char *) memchr(p, '\n', sLine.size()) - p;
+	}
+	double dMemchr = GetMilliseconds() - dStart;
+	double dMegabytes = 20000.0 * sLine.size() / (1024.0 * 1024.0);
+	printf("find newline: FindNewline %.0f MB/s, memchr %.0f MB/s (%u)\n",
+		dMegabytes * 1000 / dScanner, dMegabytes * 1000 / dMemchr, (unsigned) (nFound & 1));
+}